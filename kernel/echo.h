@@ -0,0 +1,196 @@
+/*
+ * Protocol shared by the echo module and its userland tools.
+ */
+#ifndef _ECHO_H_
+#define _ECHO_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+
+typedef struct nvecho {
+	void *buf;
+	size_t len;
+} nvecho_t;
+
+/*
+ * Namespaced configs.  Names are up to ECHO_NSNAMELEN - 1 characters out of
+ * [A-Za-z0-9_-].  For a get, len is the capacity of buf on the way in and the
+ * size of the config on the way out; a NULL buf only asks for the size and a
+ * buffer too small for the config fails with ERANGE.
+ */
+#define ECHO_NSNAMELEN	64
+
+typedef struct nvecho_ns {
+	char name[ECHO_NSNAMELEN];
+	void *buf;
+	size_t len;
+} nvecho_ns_t;
+
+/*
+ * Get only the value at path, see echo_path.h for the syntax, from namespace
+ * ns or from the global config if ns is empty.  The result is a packed
+ * nvlist holding the last key of the path and buf and len work as for a
+ * namespace get.
+ */
+#define ECHO_PATHMAX	1024
+
+typedef struct nvecho_query {
+	char ns[ECHO_NSNAMELEN];
+	const char *path;
+	size_t pathlen;
+	void *buf;
+	size_t len;
+} nvecho_query_t;
+
+/*
+ * Run up to ECHO_BATCHMAX ops in one call, with a single copyin of the op
+ * array.  Every op reports its own status in error and the ioctl only fails
+ * if the array cannot be read or written back.  Gets and queries work as
+ * their single op counterparts, except that ERANGE also leaves the size
+ * needed in len.
+ */
+#define ECHO_BATCHMAX	256
+
+#define ECHO_OP_GET	1	/* config of ns, or the global one */
+#define ECHO_OP_SET	2	/* set ns, or the global config, from buf */
+#define ECHO_OP_QUERY	3	/* value at path in ns or the global config */
+#define ECHO_OP_DEL	4	/* delete ns */
+
+typedef struct nvecho_op {
+	int op;
+	int error;
+	char ns[ECHO_NSNAMELEN];
+	const char *path;
+	size_t pathlen;
+	void *buf;
+	size_t len;
+} nvecho_op_t;
+
+typedef struct nvecho_batch {
+	nvecho_op_t *ops;
+	size_t count;
+} nvecho_batch_t;
+
+/*
+ * Upload a config too large for one set in chunks.  Begin with ns, the size
+ * of the blob and its echo_hash(), send chunks of up to ECHO_CHUNKMAX bytes
+ * in order at off, then commit, which sets the config, or abort.  A chunk
+ * that is misplaced or breaks the structure of the blob is refused and can
+ * be resent.  A file descriptor has at most one upload open at a time.
+ */
+#define ECHO_CHUNKMAX		(64 * 1024)
+
+#define ECHO_UPLOAD_BEGIN	1
+#define ECHO_UPLOAD_CHUNK	2
+#define ECHO_UPLOAD_COMMIT	3
+#define ECHO_UPLOAD_ABORT	4
+
+typedef struct nvecho_upload {
+	int op;
+	char ns[ECHO_NSNAMELEN];
+	uint64_t size;
+	uint64_t hash;
+	uint64_t off;
+	const void *buf;
+	size_t len;
+} nvecho_upload_t;
+
+#define ECHO_HASH_INIT	0xcbf29ce484222325ULL
+
+/*
+ * FNV-1a, fed chunk by chunk starting from ECHO_HASH_INIT.
+ */
+static inline uint64_t
+echo_hash(uint64_t hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	for (; len > 0; ++p, --len) {
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Every publish to any config bumps a generation number.  ECHO_IOCTL_GEN
+ * reads it and ECHO_IOCTL_WAIT sleeps until it is past gen, for at most
+ * timeout milliseconds unless that is 0, and returns it in gen.  Both mark
+ * the generation returned as seen by the file descriptor, which polls
+ * readable once there is a newer one.
+ */
+typedef struct nvecho_wait {
+	uint64_t gen;
+	u_int timeout;
+} nvecho_wait_t;
+
+/*
+ * Past versions of a config, by generation.  LIST gets a packed nvlist with
+ * the generations kept, newest first, in a number array named
+ * ECHO_HISTORY_GENS.  GET gets the config of version gen and ROLLBACK
+ * publishes it again as a new generation.  buf and len work as for a get,
+ * except that too small a buf does not fail the call: error is set to
+ * ERANGE and len to the size needed, as a failing ioctl copies nothing back.
+ */
+#define ECHO_HISTORY_LIST	1
+#define ECHO_HISTORY_GET	2
+#define ECHO_HISTORY_ROLLBACK	3
+
+#define ECHO_HISTORY_GENS	"generations"
+
+typedef struct nvecho_history {
+	int op;
+	char ns[ECHO_NSNAMELEN];
+	uint64_t gen;
+	void *buf;
+	size_t len;
+	int error;
+} nvecho_history_t;
+
+/*
+ * Get a config in one call into a buffer of capacity cap.  The call succeeds
+ * whenever the config exists, with len and gen set to the size and the
+ * generation of the snapshot read and error to 0 if it was copied out, or to
+ * ERANGE if buf is NULL or too small.  Callers keep their buffer and only
+ * grow it to len when told to.
+ *
+ * A nonzero gen on entry names the generation the caller already holds.  If
+ * that is still the current one nothing is copied and error is EALREADY.
+ */
+typedef struct nvecho_get {
+	char ns[ECHO_NSNAMELEN];
+	void *buf;
+	size_t cap;
+	size_t len;
+	uint64_t gen;
+	int error;
+} nvecho_get_t;
+
+/*
+ * Apply the patch in buf to the global config, see echo_patch.h, but only if
+ * it is still at generation base, which the patch was made against; it fails
+ * with ESTALE otherwise.  A zero base applies it to whatever is current, like
+ * ECHO_IOCTL_PATCH.  On success gen is the generation the result was
+ * published as.
+ */
+typedef struct nvecho_patch {
+	void *buf;
+	size_t len;
+	uint64_t base;
+	uint64_t gen;
+} nvecho_patch_t;
+
+#define ECHO_IOCTL		_IOWR('H', 1, nvecho_t)
+#define ECHO_IOCTL_PATCH	_IOW('H', 2, nvecho_t)
+#define ECHO_IOCTL_NSGET	_IOWR('H', 3, nvecho_ns_t)
+#define ECHO_IOCTL_NSSET	_IOW('H', 4, nvecho_ns_t)
+#define ECHO_IOCTL_NSDEL	_IOW('H', 5, nvecho_ns_t)
+#define ECHO_IOCTL_QUERY	_IOWR('H', 6, nvecho_query_t)
+#define ECHO_IOCTL_BATCH	_IOW('H', 7, nvecho_batch_t)
+#define ECHO_IOCTL_UPLOAD	_IOW('H', 8, nvecho_upload_t)
+#define ECHO_IOCTL_GEN		_IOR('H', 9, uint64_t)
+#define ECHO_IOCTL_WAIT		_IOWR('H', 10, nvecho_wait_t)
+#define ECHO_IOCTL_HISTORY	_IOWR('H', 11, nvecho_history_t)
+#define ECHO_IOCTL_GET		_IOWR('H', 12, nvecho_get_t)
+#define ECHO_IOCTL_PATCHGEN	_IOWR('H', 13, nvecho_patch_t)
+
+#endif /* !_ECHO_H_ */
@@ -0,0 +1,1282 @@
+#include "echo_compat.h"
+
+#include <sys/cnv.h>
+
+#include "echo.h"
+#include "echo_compact.h"
+
+#define DICT_NONE	UINT32_MAX
+#define NV_FLAG_MASK	(NV_FLAG_IGNORE_CASE | NV_FLAG_NO_UNIQUE)
+
+struct dict_entry {
+	const char	*de_str;
+	size_t		 de_len;
+	uint32_t	 de_hash;
+	uint32_t	 de_count;
+	uint32_t	 de_index;
+	bool		 de_key;
+};
+
+struct dict {
+	struct dict_entry	 *d_table;
+	size_t			  d_size;
+	size_t			  d_used;
+	struct dict_entry	**d_order;
+	size_t			  d_count;
+};
+
+struct cbuf {
+	uint8_t	*cb_data;
+	size_t	 cb_len;
+	size_t	 cb_size;
+	int	 cb_error;
+};
+
+struct centry {
+	const char	*ce_str;
+	size_t		 ce_len;
+};
+
+/*
+ * Input is read from pages of cr_pagesize bytes, the last one possibly
+ * short; a contiguous blob is one page.
+ */
+struct creader {
+	const uint8_t	*cr_ptr;	/* the current page */
+	const uint8_t	*cr_end;
+	void *const	*cr_next;	/* the pages after it */
+	size_t		 cr_pagesize;
+	size_t		 cr_rest;	/* bytes in those */
+	struct centry	*cr_dict;
+	size_t		 cr_ndict;
+};
+
+static uint32_t
+dict_hash(const char *str, size_t len)
+{
+	return (uint32_t)echo_hash(ECHO_HASH_INIT, str, len);
+}
+
+static struct dict_entry *
+dict_slot(struct dict_entry *table, size_t size, const char *str, size_t len,
+    uint32_t hash)
+{
+	struct dict_entry *entry = NULL;
+	size_t mask = size - 1;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		entry = &table[i];
+		if (entry->de_str == NULL) {
+			return entry;
+		}
+		if (entry->de_hash == hash && entry->de_len == len &&
+		    memcmp(entry->de_str, str, len) == 0) {
+			return entry;
+		}
+	}
+}
+
+static int
+dict_grow(struct dict *d)
+{
+	struct dict_entry *table = NULL;
+	struct dict_entry *entry = NULL;
+	size_t size = d->d_size == 0 ? 64 : d->d_size * 2;
+
+	table = echo_malloc(size * sizeof(*table));
+	if (table == NULL) {
+		return ENOMEM;
+	}
+	for (size_t i = 0; i < d->d_size; ++i) {
+		if (d->d_table[i].de_str == NULL) {
+			continue;
+		}
+		entry = dict_slot(table, size, d->d_table[i].de_str,
+		    d->d_table[i].de_len, d->d_table[i].de_hash);
+		*entry = d->d_table[i];
+	}
+	echo_free(d->d_table);
+	d->d_table = table;
+	d->d_size = size;
+	return 0;
+}
+
+static int
+dict_add(struct dict *d, const char *str, bool key)
+{
+	struct dict_entry *entry = NULL;
+	size_t len = strlen(str);
+	uint32_t hash = dict_hash(str, len);
+	int error = 0;
+
+	if ((d->d_used + 1) * 2 > d->d_size) {
+		error = dict_grow(d);
+		if (error) {
+			return error;
+		}
+	}
+	entry = dict_slot(d->d_table, d->d_size, str, len, hash);
+	if (entry->de_str == NULL) {
+		entry->de_str = str;
+		entry->de_len = len;
+		entry->de_hash = hash;
+		entry->de_index = DICT_NONE;
+		++d->d_used;
+	}
+	++entry->de_count;
+	entry->de_key |= key;
+	return 0;
+}
+
+static struct dict_entry *
+dict_lookup(const struct dict *d, const char *str, size_t len)
+{
+	struct dict_entry *entry = NULL;
+
+	entry = dict_slot(d->d_table, d->d_size, str, len, dict_hash(str, len));
+	return entry->de_str == NULL ? NULL : entry;
+}
+
+static int
+dict_order_compare(const void *a, const void *b)
+{
+	const struct dict_entry *e1 = *(const struct dict_entry * const *)a;
+	const struct dict_entry *e2 = *(const struct dict_entry * const *)b;
+
+	if (e1->de_count != e2->de_count) {
+		return e1->de_count > e2->de_count ? -1 : 1;
+	}
+	if (e1->de_len != e2->de_len) {
+		return e1->de_len < e2->de_len ? -1 : 1;
+	}
+	return memcmp(e1->de_str, e2->de_str, e1->de_len);
+}
+
+static int
+dict_build(struct dict *d)
+{
+	struct dict_entry *entry = NULL;
+
+	d->d_order = echo_malloc((d->d_used + 1) * sizeof(*d->d_order));
+	if (d->d_order == NULL) {
+		return ENOMEM;
+	}
+	for (size_t i = 0; i < d->d_size; ++i) {
+		entry = &d->d_table[i];
+		if (entry->de_str != NULL && (entry->de_key || entry->de_count > 1)) {
+			d->d_order[d->d_count++] = entry;
+		}
+	}
+	qsort(d->d_order, d->d_count, sizeof(*d->d_order), dict_order_compare);
+	for (size_t i = 0; i < d->d_count; ++i) {
+		d->d_order[i]->de_index = i;
+	}
+	return 0;
+}
+
+static void
+dict_free(struct dict *d)
+{
+	echo_free(d->d_table);
+	echo_free(d->d_order);
+}
+
+static int
+compact_count(struct dict *d, const nvlist_t *nvl, int depth)
+{
+	const char *name = NULL;
+	void *cookie = NULL;
+	int type = 0, error = 0;
+	size_t items = 0;
+
+	if (depth > ECHO_COMPACT_MAXDEPTH) {
+		return EINVAL;
+	}
+	while (error == 0 && (name = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		error = dict_add(d, name, true);
+		if (error) {
+			break;
+		}
+		switch (type) {
+			case NV_TYPE_STRING:
+				error = dict_add(d, cnvlist_get_string(cookie), false);
+				break;
+			case NV_TYPE_STRING_ARRAY: {
+				const char * const *array = cnvlist_get_string_array(cookie, &items);
+
+				for (size_t i = 0; error == 0 && i < items; ++i) {
+					error = dict_add(d, array[i], false);
+				}
+				break;
+			}
+			case NV_TYPE_NVLIST:
+				error = compact_count(d, cnvlist_get_nvlist(cookie), depth + 1);
+				break;
+			case NV_TYPE_NVLIST_ARRAY: {
+				const nvlist_t * const *array = cnvlist_get_nvlist_array(cookie, &items);
+
+				for (size_t i = 0; error == 0 && i < items; ++i) {
+					error = compact_count(d, array[i], depth + 1);
+				}
+				break;
+			}
+			case NV_TYPE_DESCRIPTOR:
+			case NV_TYPE_DESCRIPTOR_ARRAY:
+				error = EOPNOTSUPP;
+				break;
+		}
+	}
+	return error;
+}
+
+static void
+put_bytes(struct cbuf *cb, const void *data, size_t len)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+
+	if (cb->cb_error) {
+		return;
+	}
+	if (cb->cb_size - cb->cb_len < len) {
+		size = cb->cb_size == 0 ? 256 : cb->cb_size;
+		while (size - cb->cb_len < len) {
+			size *= 2;
+		}
+		buf = echo_realloc(cb->cb_data, size);
+		if (buf == NULL) {
+			cb->cb_error = ENOMEM;
+			return;
+		}
+		cb->cb_data = buf;
+		cb->cb_size = size;
+	}
+	memcpy(cb->cb_data + cb->cb_len, data, len);
+	cb->cb_len += len;
+}
+
+static void
+put_byte(struct cbuf *cb, uint8_t byte)
+{
+	put_bytes(cb, &byte, 1);
+}
+
+static void
+put_varint(struct cbuf *cb, uint64_t value)
+{
+	uint8_t bytes[10];
+	size_t len = 0;
+
+	do {
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if (value != 0) {
+			bytes[len] |= 0x80;
+		}
+		++len;
+	} while (value != 0);
+	put_bytes(cb, bytes, len);
+}
+
+static void
+put_string(struct cbuf *cb, const struct dict *d, const char *str)
+{
+	struct dict_entry *entry = NULL;
+	size_t len = strlen(str);
+
+	entry = dict_lookup(d, str, len);
+	if (entry != NULL && entry->de_index != DICT_NONE) {
+		put_varint(cb, (uint64_t)entry->de_index << 1 | 1);
+		return;
+	}
+	put_varint(cb, (uint64_t)len << 1);
+	put_bytes(cb, str, len);
+}
+
+static void
+put_body(struct cbuf *cb, const struct dict *d, const nvlist_t *nvl)
+{
+	const char *name = NULL;
+	void *cookie = NULL;
+	int type = 0;
+	size_t items = 0;
+	uint64_t npairs = 0;
+
+	while (nvlist_next(nvl, &type, &cookie) != NULL) {
+		++npairs;
+	}
+	put_byte(cb, nvlist_flags(nvl) & NV_FLAG_MASK);
+	put_varint(cb, npairs);
+	cookie = NULL;
+	while ((name = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		put_byte(cb, type);
+		put_varint(cb, dict_lookup(d, name, strlen(name))->de_index);
+		switch (type) {
+			case NV_TYPE_NULL:
+				break;
+			case NV_TYPE_BOOL:
+				put_byte(cb, cnvlist_get_bool(cookie) ? 1 : 0);
+				break;
+			case NV_TYPE_NUMBER:
+				put_varint(cb, cnvlist_get_number(cookie));
+				break;
+			case NV_TYPE_STRING:
+				put_string(cb, d, cnvlist_get_string(cookie));
+				break;
+			case NV_TYPE_NVLIST:
+				put_body(cb, d, cnvlist_get_nvlist(cookie));
+				break;
+			case NV_TYPE_BINARY: {
+				const void *data = cnvlist_get_binary(cookie, &items);
+
+				put_varint(cb, items);
+				put_bytes(cb, data, items);
+				break;
+			}
+			case NV_TYPE_BOOL_ARRAY: {
+				const bool *array = cnvlist_get_bool_array(cookie, &items);
+				uint8_t byte = 0;
+
+				put_varint(cb, items);
+				for (size_t i = 0; i < items; ++i) {
+					if (array[i]) {
+						byte |= 1 << (i % 8);
+					}
+					if (i % 8 == 7 || i + 1 == items) {
+						put_byte(cb, byte);
+						byte = 0;
+					}
+				}
+				break;
+			}
+			case NV_TYPE_NUMBER_ARRAY: {
+				const uint64_t *array = cnvlist_get_number_array(cookie, &items);
+
+				put_varint(cb, items);
+				for (size_t i = 0; i < items; ++i) {
+					put_varint(cb, array[i]);
+				}
+				break;
+			}
+			case NV_TYPE_STRING_ARRAY: {
+				const char * const *array = cnvlist_get_string_array(cookie, &items);
+
+				put_varint(cb, items);
+				for (size_t i = 0; i < items; ++i) {
+					put_string(cb, d, array[i]);
+				}
+				break;
+			}
+			case NV_TYPE_NVLIST_ARRAY: {
+				const nvlist_t * const *array = cnvlist_get_nvlist_array(cookie, &items);
+
+				put_varint(cb, items);
+				for (size_t i = 0; i < items; ++i) {
+					put_body(cb, d, array[i]);
+				}
+				break;
+			}
+		}
+	}
+}
+
+bool
+echo_compact_is(const void *buf, size_t len)
+{
+	return len >= 2 && ((const uint8_t *)buf)[0] == ECHO_COMPACT_MAGIC;
+}
+
+/*
+ * Encode nvl into a newly allocated compact blob, which the caller releases
+ * with echo_free().
+ */
+int
+echo_compact_encode(const nvlist_t *nvl, void **bufp, size_t *lenp)
+{
+	struct dict d = {0};
+	struct cbuf cb = {0};
+	int error = 0;
+
+	error = nvlist_error(nvl);
+	if (error) {
+		return error;
+	}
+	error = compact_count(&d, nvl, 0);
+	if (error == 0) {
+		error = dict_build(&d);
+	}
+	if (error) {
+		dict_free(&d);
+		return error;
+	}
+	put_byte(&cb, ECHO_COMPACT_MAGIC);
+	put_byte(&cb, ECHO_COMPACT_VERSION);
+	put_varint(&cb, d.d_count);
+	for (size_t i = 0; i < d.d_count; ++i) {
+		put_varint(&cb, d.d_order[i]->de_len);
+		put_bytes(&cb, d.d_order[i]->de_str, d.d_order[i]->de_len);
+	}
+	put_body(&cb, &d, nvl);
+	dict_free(&d);
+	if (cb.cb_error) {
+		echo_free(cb.cb_data);
+		return cb.cb_error;
+	}
+	*bufp = cb.cb_data;
+	*lenp = cb.cb_len;
+	return 0;
+}
+
+static size_t
+get_left(const struct creader *cr)
+{
+	return cr->cr_end - cr->cr_ptr + cr->cr_rest;
+}
+
+static void
+get_page(struct creader *cr)
+{
+	size_t len = cr->cr_rest < cr->cr_pagesize ? cr->cr_rest :
+	    cr->cr_pagesize;
+
+	cr->cr_ptr = *cr->cr_next++;
+	cr->cr_end = cr->cr_ptr + len;
+	cr->cr_rest -= len;
+}
+
+static bool
+get_byte(struct creader *cr, uint8_t *bytep)
+{
+	if (cr->cr_ptr == cr->cr_end) {
+		if (cr->cr_rest == 0) {
+			return false;
+		}
+		get_page(cr);
+	}
+	*bytep = *cr->cr_ptr++;
+	return true;
+}
+
+/*
+ * Copy len bytes, which the caller made sure are left, to dst or skip them
+ * if dst is NULL.
+ */
+static void
+get_bytes(struct creader *cr, void *dst, size_t len)
+{
+	uint8_t *out = dst;
+	size_t n = 0;
+
+	for (; len > 0; len -= n) {
+		if (cr->cr_ptr == cr->cr_end) {
+			get_page(cr);
+		}
+		n = (size_t)(cr->cr_end - cr->cr_ptr);
+		if (n > len) {
+			n = len;
+		}
+		if (out != NULL) {
+			memcpy(out, cr->cr_ptr, n);
+			out += n;
+		}
+		cr->cr_ptr += n;
+	}
+}
+
+static int
+get_varint(struct creader *cr, uint64_t *valuep)
+{
+	uint64_t value = 0;
+	uint8_t byte = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (!get_byte(cr, &byte)) {
+			return EINVAL;
+		}
+		if (shift == 63 && (byte & 0x7e) != 0) {
+			return EINVAL;
+		}
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*valuep = value;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/*
+ * Read a length or element count and make sure the remaining input can hold
+ * that many elements of at least minsize bytes each.
+ */
+static int
+get_count(struct creader *cr, size_t minsize, size_t *countp)
+{
+	uint64_t value = 0;
+	int error = 0;
+
+	error = get_varint(cr, &value);
+	if (error) {
+		return error;
+	}
+	if (value > get_left(cr) / minsize) {
+		return EINVAL;
+	}
+	*countp = value;
+	return 0;
+}
+
+static int
+get_name(struct creader *cr, const char **namep)
+{
+	uint64_t index = 0;
+	int error = 0;
+
+	error = get_varint(cr, &index);
+	if (error) {
+		return error;
+	}
+	if (index >= cr->cr_ndict) {
+		return EINVAL;
+	}
+	*namep = cr->cr_dict[index].ce_str;
+	return 0;
+}
+
+/*
+ * Read a string value into a buffer suitable for nvlist_move_string().
+ */
+static int
+get_string(struct creader *cr, char **strp)
+{
+	const struct centry *ce = NULL;
+	uint64_t value = 0;
+	size_t len = 0;
+	char *str = NULL;
+	int error = 0;
+
+	error = get_varint(cr, &value);
+	if (error) {
+		return error;
+	}
+	if (value & 1) {
+		if ((value >> 1) >= cr->cr_ndict) {
+			return EINVAL;
+		}
+		ce = &cr->cr_dict[value >> 1];
+		len = ce->ce_len;
+	} else if ((value >> 1) > get_left(cr)) {
+		return EINVAL;
+	} else {
+		len = value >> 1;
+	}
+	str = echo_nv_malloc(len + 1);
+	if (str == NULL) {
+		return ENOMEM;
+	}
+	if (ce != NULL) {
+		memcpy(str, ce->ce_str, len);
+	} else {
+		get_bytes(cr, str, len);
+		if (memchr(str, '\0', len) != NULL) {
+			echo_nv_free(str);
+			return EINVAL;
+		}
+	}
+	str[len] = '\0';
+	*strp = str;
+	return 0;
+}
+
+static int
+get_body(struct creader *cr, int depth, nvlist_t **nvlp)
+{
+	nvlist_t *nvl = NULL;
+	const char *name = NULL;
+	size_t npairs = 0, items = 0;
+	uint8_t flags = 0, type = 0;
+	int error = 0;
+
+	if (depth > ECHO_COMPACT_MAXDEPTH || get_left(cr) < 2) {
+		return EINVAL;
+	}
+	get_byte(cr, &flags);
+	if ((flags & ~NV_FLAG_MASK) != 0) {
+		return EINVAL;
+	}
+	error = get_count(cr, 2, &npairs);
+	if (error) {
+		return error;
+	}
+	nvl = nvlist_create(flags);
+	if (nvl == NULL) {
+		return ENOMEM;
+	}
+	for (size_t n = 0; error == 0 && n < npairs; ++n) {
+		if (!get_byte(cr, &type)) {
+			error = EINVAL;
+			break;
+		}
+		error = get_name(cr, &name);
+		if (error) {
+			break;
+		}
+		switch (type) {
+			case NV_TYPE_NULL:
+				nvlist_add_null(nvl, name);
+				break;
+			case NV_TYPE_BOOL: {
+				uint8_t value = 0;
+
+				if (!get_byte(cr, &value) || value > 1) {
+					error = EINVAL;
+					break;
+				}
+				nvlist_add_bool(nvl, name, value != 0);
+				break;
+			}
+			case NV_TYPE_NUMBER: {
+				uint64_t value = 0;
+
+				error = get_varint(cr, &value);
+				if (error == 0) {
+					nvlist_add_number(nvl, name, value);
+				}
+				break;
+			}
+			case NV_TYPE_STRING: {
+				char *value = NULL;
+
+				error = get_string(cr, &value);
+				if (error == 0) {
+					nvlist_move_string(nvl, name, value);
+				}
+				break;
+			}
+			case NV_TYPE_NVLIST: {
+				nvlist_t *nested = NULL;
+
+				error = get_body(cr, depth + 1, &nested);
+				if (error == 0) {
+					nvlist_move_nvlist(nvl, name, nested);
+				}
+				break;
+			}
+			case NV_TYPE_BINARY: {
+				void *value = NULL;
+
+				/* libnv refuses empty binaries anyway. */
+				error = get_count(cr, 1, &items);
+				if (error == 0 && items == 0) {
+					error = EINVAL;
+				}
+				if (error) {
+					break;
+				}
+				value = echo_nv_malloc(items);
+				if (value == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				get_bytes(cr, value, items);
+				nvlist_move_binary(nvl, name, value, items);
+				break;
+			}
+			case NV_TYPE_BOOL_ARRAY: {
+				bool *array = NULL;
+				uint64_t value = 0;
+				uint8_t byte = 0;
+
+				error = get_varint(cr, &value);
+				if (error == 0 && (value == 0 ||
+				    value / 8 + (value % 8 != 0) > get_left(cr))) {
+					error = EINVAL;
+				}
+				if (error) {
+					break;
+				}
+				items = value;
+				array = echo_nv_malloc(items * sizeof(*array));
+				if (array == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				for (size_t i = 0; i < items; ++i) {
+					if (i % 8 == 0) {
+						get_byte(cr, &byte);
+					}
+					array[i] = (byte >> (i % 8)) & 1;
+				}
+				nvlist_move_bool_array(nvl, name, array, items);
+				break;
+			}
+			case NV_TYPE_NUMBER_ARRAY: {
+				uint64_t *array = NULL;
+
+				error = get_count(cr, 1, &items);
+				if (error == 0 && items == 0) {
+					error = EINVAL;
+				}
+				if (error) {
+					break;
+				}
+				array = echo_nv_malloc(items * sizeof(*array));
+				if (array == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				for (size_t i = 0; error == 0 && i < items; ++i) {
+					error = get_varint(cr, &array[i]);
+				}
+				if (error) {
+					echo_nv_free(array);
+					break;
+				}
+				nvlist_move_number_array(nvl, name, array, items);
+				break;
+			}
+			case NV_TYPE_STRING_ARRAY: {
+				char **array = NULL;
+				size_t i = 0;
+
+				error = get_count(cr, 1, &items);
+				if (error == 0 && items == 0) {
+					error = EINVAL;
+				}
+				if (error) {
+					break;
+				}
+				array = echo_nv_malloc(items * sizeof(*array));
+				if (array == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				for (i = 0; error == 0 && i < items; ++i) {
+					error = get_string(cr, &array[i]);
+				}
+				if (error) {
+					while (i-- > 0) {
+						echo_nv_free(array[i]);
+					}
+					echo_nv_free(array);
+					break;
+				}
+				nvlist_move_string_array(nvl, name, array, items);
+				break;
+			}
+			case NV_TYPE_NVLIST_ARRAY: {
+				nvlist_t **array = NULL;
+				size_t i = 0;
+
+				error = get_count(cr, 2, &items);
+				if (error == 0 && items == 0) {
+					error = EINVAL;
+				}
+				if (error) {
+					break;
+				}
+				array = echo_nv_malloc(items * sizeof(*array));
+				if (array == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				for (i = 0; error == 0 && i < items; ++i) {
+					error = get_body(cr, depth + 1, &array[i]);
+				}
+				if (error) {
+					while (i-- > 0) {
+						nvlist_destroy(array[i]);
+					}
+					echo_nv_free(array);
+					break;
+				}
+				nvlist_move_nvlist_array(nvl, name, array, items);
+				break;
+			}
+			default:
+				error = EINVAL;
+				break;
+		}
+	}
+	if (error == 0) {
+		error = nvlist_error(nvl);
+	}
+	if (error) {
+		nvlist_destroy(nvl);
+		return error;
+	}
+	*nvlp = nvl;
+	return 0;
+}
+
+int
+echo_compact_decode(const void *buf, size_t len, nvlist_t **nvlp)
+{
+	void *page = __DECONST(void *, buf);
+
+	return echo_compact_decode_pages(&page, len, len, nvlp);
+}
+
+/*
+ * Decode a blob of len bytes laid out in pages of pagesize bytes, only the
+ * last of which may be short, without joining them first.
+ */
+int
+echo_compact_decode_pages(void *const *pages, size_t pagesize, size_t len,
+    nvlist_t **nvlp)
+{
+	struct creader cr = {0}, dict = {0};
+	uint8_t version = 0;
+	char *strings = NULL, *str = NULL;
+	size_t ndict = 0, total = 0;
+	int error = 0;
+
+	if (len < 2 || pagesize == 0 ||
+	    *(const uint8_t *)pages[0] != ECHO_COMPACT_MAGIC) {
+		return EINVAL;
+	}
+	cr.cr_next = pages;
+	cr.cr_pagesize = pagesize;
+	cr.cr_rest = len;
+	get_bytes(&cr, NULL, 1);
+	get_byte(&cr, &version);
+	if (version != ECHO_COMPACT_VERSION) {
+		return EPROTONOSUPPORT;
+	}
+	error = get_count(&cr, 1, &ndict);
+	if (error) {
+		return error;
+	}
+	cr.cr_dict = echo_malloc((ndict + 1) * sizeof(*cr.cr_dict));
+	if (cr.cr_dict == NULL) {
+		return ENOMEM;
+	}
+
+	/* Size the dictionary first, then copy it out in a second pass. */
+	dict = cr;
+	for (size_t i = 0; i < ndict; ++i) {
+		error = get_count(&cr, 1, &cr.cr_dict[i].ce_len);
+		if (error) {
+			goto out;
+		}
+		get_bytes(&cr, NULL, cr.cr_dict[i].ce_len);
+		total += cr.cr_dict[i].ce_len + 1;
+	}
+	strings = echo_malloc(total + 1);
+	if (strings == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	str = strings;
+	for (size_t i = 0; i < ndict; ++i) {
+		get_count(&dict, 1, &cr.cr_dict[i].ce_len);
+		get_bytes(&dict, str, cr.cr_dict[i].ce_len);
+		if (memchr(str, '\0', cr.cr_dict[i].ce_len) != NULL) {
+			error = EINVAL;
+			goto out;
+		}
+		cr.cr_dict[i].ce_str = str;
+		str += cr.cr_dict[i].ce_len + 1;
+	}
+	cr.cr_ndict = ndict;
+	error = get_body(&cr, 0, nvlp);
+	if (error == 0 && get_left(&cr) != 0) {
+		nvlist_destroy(*nvlp);
+		*nvlp = NULL;
+		error = EINVAL;
+	}
+out:
+	echo_free(strings);
+	echo_free(cr.cr_dict);
+	return error;
+}
+
+/*
+ * The structural check mirrors the decoder one byte at a time, so that it
+ * can stop at the end of any piece and carry on with the next.  The states
+ * name what the next byte belongs to.
+ */
+enum {
+	CK_MAGIC,
+	CK_VERSION,
+	CK_NDICT,
+	CK_DICTLEN,
+	CK_DICTSTR,
+	CK_FLAGS,
+	CK_NPAIRS,
+	CK_TYPE,
+	CK_NAME,
+	CK_BOOL,
+	CK_NUMBER,
+	CK_STRING,
+	CK_STRBYTES,
+	CK_BINLEN,
+	CK_BINBYTES,
+	CK_COUNT,
+	CK_BOOLBYTES,
+	CK_DONE,
+};
+
+void
+echo_compact_check_init(struct echo_compact_check *cc, size_t len)
+{
+	memset(cc, 0, sizeof(*cc));
+	cc->ecc_state = CK_MAGIC;
+	cc->ecc_left = len;
+}
+
+bool
+echo_compact_check_done(const struct echo_compact_check *cc)
+{
+	return cc->ecc_state == CK_DONE && cc->ecc_left == 0;
+}
+
+/*
+ * Add a byte to the varint being read.  *donep tells whether it was the
+ * last one, leaving the value in ecc_value.
+ */
+static int
+check_varint(struct echo_compact_check *cc, uint8_t byte, bool *donep)
+{
+	if (cc->ecc_shift == 0) {
+		cc->ecc_value = 0;
+	}
+	if (cc->ecc_shift == 63 && (byte & 0x7e) != 0) {
+		return EINVAL;
+	}
+	cc->ecc_value |= (uint64_t)(byte & 0x7f) << cc->ecc_shift;
+	if ((byte & 0x80) == 0) {
+		cc->ecc_shift = 0;
+		*donep = true;
+		return 0;
+	}
+	cc->ecc_shift += 7;
+	if (cc->ecc_shift > 63) {
+		return EINVAL;
+	}
+	*donep = false;
+	return 0;
+}
+
+/* As get_count(): the rest of the blob has to hold that many elements. */
+static int
+check_count(const struct echo_compact_check *cc, size_t minsize)
+{
+	return cc->ecc_value > cc->ecc_left / minsize ? EINVAL : 0;
+}
+
+static int
+check_body(struct echo_compact_check *cc)
+{
+	if (cc->ecc_left < 2) {
+		return EINVAL;
+	}
+	cc->ecc_state = CK_FLAGS;
+	return 0;
+}
+
+static int
+check_nested(struct echo_compact_check *cc)
+{
+	if (cc->ecc_depth >= ECHO_COMPACT_MAXDEPTH) {
+		return EINVAL;
+	}
+	cc->ecc_depth++;
+	return check_body(cc);
+}
+
+static int
+check_element(struct echo_compact_check *cc)
+{
+	switch (cc->ecc_stack[cc->ecc_depth].ecf_type) {
+		case NV_TYPE_NUMBER_ARRAY:
+			cc->ecc_state = CK_NUMBER;
+			return 0;
+		case NV_TYPE_STRING_ARRAY:
+			cc->ecc_state = CK_STRING;
+			return 0;
+		default:
+			return check_nested(cc);
+	}
+}
+
+static int	check_value_done(struct echo_compact_check *cc);
+
+/* A nvlist ended, which ends the value it is or the blob. */
+static int
+check_body_done(struct echo_compact_check *cc)
+{
+	if (cc->ecc_depth == 0) {
+		cc->ecc_state = CK_DONE;
+		return 0;
+	}
+	cc->ecc_depth--;
+	return check_value_done(cc);
+}
+
+/*
+ * A value ended: go on with the next element of its array, the next pair of
+ * its nvlist or, if that was the last, with whatever follows the nvlist.
+ */
+static int
+check_value_done(struct echo_compact_check *cc)
+{
+	struct echo_compact_frame *frame = &cc->ecc_stack[cc->ecc_depth];
+
+	switch (frame->ecf_type) {
+		case NV_TYPE_NUMBER_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+		case NV_TYPE_NVLIST_ARRAY:
+			if (--frame->ecf_items > 0) {
+				return check_element(cc);
+			}
+			break;
+	}
+	if (--frame->ecf_pairs > 0) {
+		cc->ecc_state = CK_TYPE;
+		return 0;
+	}
+	return check_body_done(cc);
+}
+
+static int
+check_dict_done(struct echo_compact_check *cc)
+{
+	if (--cc->ecc_dictleft > 0) {
+		cc->ecc_state = CK_DICTLEN;
+		return 0;
+	}
+	return check_body(cc);
+}
+
+/* A run of bytes ended, either a dictionary entry or a value. */
+static int
+check_run_done(struct echo_compact_check *cc)
+{
+	if (cc->ecc_state == CK_DICTSTR) {
+		return check_dict_done(cc);
+	}
+	return check_value_done(cc);
+}
+
+/* Start a run of len bytes, which may be empty. */
+static int
+check_run(struct echo_compact_check *cc, int state, size_t len)
+{
+	cc->ecc_skip = len;
+	cc->ecc_state = state;
+	if (len > 0) {
+		return 0;
+	}
+	return check_run_done(cc);
+}
+
+/* The name of a pair was read: set up for its value. */
+static int
+check_pair(struct echo_compact_check *cc)
+{
+	switch (cc->ecc_stack[cc->ecc_depth].ecf_type) {
+		case NV_TYPE_NULL:
+			return check_value_done(cc);
+		case NV_TYPE_BOOL:
+			cc->ecc_state = CK_BOOL;
+			return 0;
+		case NV_TYPE_NUMBER:
+			cc->ecc_state = CK_NUMBER;
+			return 0;
+		case NV_TYPE_STRING:
+			cc->ecc_state = CK_STRING;
+			return 0;
+		case NV_TYPE_NVLIST:
+			return check_nested(cc);
+		case NV_TYPE_BINARY:
+			cc->ecc_state = CK_BINLEN;
+			return 0;
+		case NV_TYPE_BOOL_ARRAY:
+		case NV_TYPE_NUMBER_ARRAY:
+		case NV_TYPE_STRING_ARRAY:
+		case NV_TYPE_NVLIST_ARRAY:
+			cc->ecc_state = CK_COUNT;
+			return 0;
+		default:
+			return EINVAL;
+	}
+}
+
+/* The element count of an array was read into ecc_value. */
+static int
+check_array(struct echo_compact_check *cc)
+{
+	struct echo_compact_frame *frame = &cc->ecc_stack[cc->ecc_depth];
+	uint64_t count = cc->ecc_value;
+
+	if (count == 0) {
+		return EINVAL;
+	}
+	if (frame->ecf_type == NV_TYPE_BOOL_ARRAY) {
+		if (count / 8 + (count % 8 != 0) > cc->ecc_left) {
+			return EINVAL;
+		}
+		return check_run(cc, CK_BOOLBYTES, (count + 7) / 8);
+	}
+	if (check_count(cc, frame->ecf_type == NV_TYPE_NVLIST_ARRAY ? 2 : 1)) {
+		return EINVAL;
+	}
+	frame->ecf_items = count;
+	return check_element(cc);
+}
+
+/* A varint ended, its value in ecc_value. */
+static int
+check_varint_done(struct echo_compact_check *cc)
+{
+	struct echo_compact_frame *frame = &cc->ecc_stack[cc->ecc_depth];
+	uint64_t value = cc->ecc_value;
+
+	switch (cc->ecc_state) {
+		case CK_NDICT:
+			if (check_count(cc, 1)) {
+				return EINVAL;
+			}
+			cc->ecc_ndict = value;
+			cc->ecc_dictleft = value;
+			if (value == 0) {
+				return check_body(cc);
+			}
+			cc->ecc_state = CK_DICTLEN;
+			return 0;
+		case CK_DICTLEN:
+			if (check_count(cc, 1)) {
+				return EINVAL;
+			}
+			return check_run(cc, CK_DICTSTR, value);
+		case CK_NPAIRS:
+			if (check_count(cc, 2)) {
+				return EINVAL;
+			}
+			frame->ecf_pairs = value;
+			if (value == 0) {
+				return check_body_done(cc);
+			}
+			cc->ecc_state = CK_TYPE;
+			return 0;
+		case CK_NAME:
+			if (value >= cc->ecc_ndict) {
+				return EINVAL;
+			}
+			return check_pair(cc);
+		case CK_NUMBER:
+			return check_value_done(cc);
+		case CK_STRING:
+			if (value & 1) {
+				return (value >> 1) >= cc->ecc_ndict ? EINVAL :
+				    check_value_done(cc);
+			}
+			if ((value >> 1) > cc->ecc_left) {
+				return EINVAL;
+			}
+			return check_run(cc, CK_STRBYTES, value >> 1);
+		case CK_BINLEN:
+			if (check_count(cc, 1)) {
+				return EINVAL;
+			}
+			return check_run(cc, CK_BINBYTES, value);
+		case CK_COUNT:
+			return check_array(cc);
+		default:
+			return EINVAL;
+	}
+}
+
+static int
+check_byte(struct echo_compact_check *cc, uint8_t byte)
+{
+	struct echo_compact_frame *frame = &cc->ecc_stack[cc->ecc_depth];
+	bool done = false;
+	int error = 0;
+
+	switch (cc->ecc_state) {
+		case CK_MAGIC:
+			if (byte != ECHO_COMPACT_MAGIC) {
+				return EINVAL;
+			}
+			cc->ecc_state = CK_VERSION;
+			return 0;
+		case CK_VERSION:
+			if (byte != ECHO_COMPACT_VERSION) {
+				return EPROTONOSUPPORT;
+			}
+			cc->ecc_state = CK_NDICT;
+			return 0;
+		case CK_FLAGS:
+			if ((byte & ~NV_FLAG_MASK) != 0) {
+				return EINVAL;
+			}
+			cc->ecc_state = CK_NPAIRS;
+			return 0;
+		case CK_TYPE:
+			frame->ecf_type = byte;
+			cc->ecc_state = CK_NAME;
+			return 0;
+		case CK_BOOL:
+			if (byte > 1) {
+				return EINVAL;
+			}
+			return check_value_done(cc);
+		case CK_DONE:
+			return EINVAL;
+		default:
+			error = check_varint(cc, byte, &done);
+			if (error || !done) {
+				return error;
+			}
+			return check_varint_done(cc);
+	}
+}
+
+/*
+ * Check the next len bytes of the blob.  Every byte up to the first error
+ * was consumed, so a caller that wants to retry a piece checks it on a copy
+ * of the state.
+ */
+int
+echo_compact_check(struct echo_compact_check *cc, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	const uint8_t *end = ptr + len;
+	size_t run = 0;
+	int error = 0;
+
+	if (len > cc->ecc_left) {
+		return EINVAL;
+	}
+	while (error == 0 && ptr < end) {
+		switch (cc->ecc_state) {
+			case CK_DICTSTR:
+			case CK_STRBYTES:
+			case CK_BINBYTES:
+			case CK_BOOLBYTES:
+				run = (size_t)(end - ptr);
+				if (run > cc->ecc_skip) {
+					run = cc->ecc_skip;
+				}
+				if (cc->ecc_state != CK_BINBYTES &&
+				    cc->ecc_state != CK_BOOLBYTES &&
+				    memchr(ptr, '\0', run) != NULL) {
+					return EINVAL;
+				}
+				ptr += run;
+				cc->ecc_left -= run;
+				cc->ecc_skip -= run;
+				if (cc->ecc_skip == 0) {
+					error = check_run_done(cc);
+				}
+				break;
+			default:
+				cc->ecc_left--;
+				error = check_byte(cc, *ptr++);
+				break;
+		}
+	}
+	return error;
+}
@@ -0,0 +1,64 @@
+/*
+ * Compact, dictionary coded wire format for echo configs.
+ *
+ * A blob starts with ECHO_COMPACT_MAGIC, ECHO_COMPACT_VERSION and a varint
+ * count of dictionary entries, each a varint length followed by the bytes.
+ * The dictionary holds every pair name plus every string value that occurs
+ * more than once, most frequent first so hot entries get one byte indexes.
+ *
+ * The root nvlist body follows: a flags byte, a varint pair count and the
+ * pairs.  A pair is its NV_TYPE_* byte, the varint dictionary index of its
+ * name and the value:
+ *
+ *	NULL		nothing
+ *	BOOL		one byte
+ *	NUMBER		varint
+ *	STRING		varint (index << 1 | 1) or (length << 1) and the bytes
+ *	BINARY		varint length and the bytes
+ *	NVLIST		nested body
+ *	*_ARRAY		varint count and a run of untagged elements, booleans
+ *			packed eight per byte
+ *
+ * All varints are unsigned LEB128.
+ */
+#ifndef _ECHO_COMPACT_H_
+#define _ECHO_COMPACT_H_
+
+#define ECHO_COMPACT_MAGIC	0xec
+#define ECHO_COMPACT_VERSION	0x01
+#define ECHO_COMPACT_MAXDEPTH	64
+
+struct echo_compact_frame {
+	uint64_t	 ecf_pairs;	/* pairs left in the body */
+	uint64_t	 ecf_items;	/* elements left of the current array */
+	uint8_t		 ecf_type;	/* type of the current pair */
+};
+
+/*
+ * State of a structural check of a blob fed to it in pieces, which rejects
+ * the first byte that the decoder would reject for its structure.  Names
+ * repeated within a nvlist are only caught by the decoder.
+ */
+struct echo_compact_check {
+	int				 ecc_state;
+	int				 ecc_depth;
+	size_t				 ecc_left;	/* bytes not fed yet */
+	size_t				 ecc_skip;	/* bytes left of a run */
+	uint64_t			 ecc_value;	/* varint being read */
+	unsigned			 ecc_shift;
+	uint64_t			 ecc_ndict;
+	uint64_t			 ecc_dictleft;
+	struct echo_compact_frame	 ecc_stack[ECHO_COMPACT_MAXDEPTH + 1];
+};
+
+bool	echo_compact_is(const void *buf, size_t len);
+int	echo_compact_encode(const nvlist_t *nvl, void **bufp, size_t *lenp);
+int	echo_compact_decode(const void *buf, size_t len, nvlist_t **nvlp);
+int	echo_compact_decode_pages(void *const *pages, size_t pagesize,
+	    size_t len, nvlist_t **nvlp);
+void	echo_compact_check_init(struct echo_compact_check *cc, size_t len);
+int	echo_compact_check(struct echo_compact_check *cc, const void *buf,
+	    size_t len);
+bool	echo_compact_check_done(const struct echo_compact_check *cc);
+
+#endif /* !_ECHO_COMPACT_H_ */
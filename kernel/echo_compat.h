@@ -0,0 +1,289 @@
+/*
+ * Shims that let the portable echo sources build both in the kernel module
+ * and in userland.
+ */
+#ifndef _ECHO_COMPAT_H_
+#define _ECHO_COMPAT_H_
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/errno.h>
+#include <sys/stdint.h>
+#include <sys/systm.h>
+#include <sys/condvar.h>
+#include <sys/epoch.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/nv.h>
+#include <sys/queue.h>
+#include <sys/refcount.h>
+#include <sys/sx.h>
+#include <sys/time.h>
+
+#include <machine/atomic.h>
+
+MALLOC_DECLARE(M_ECHOBUF);
+
+#define echo_malloc(size)	malloc((size), M_ECHOBUF, M_WAITOK | M_ZERO)
+#define echo_realloc(ptr, size)	realloc((ptr), (size), M_ECHOBUF, M_WAITOK)
+#define echo_free(ptr)		free((ptr), M_ECHOBUF)
+
+/* Memory handed to or received from nvlist_move_*() and nvlist_pack(). */
+#define echo_nv_malloc(size)	malloc((size), M_NVLIST, M_WAITOK | M_ZERO)
+#define echo_nv_free(ptr)	free((ptr), M_NVLIST)
+
+#define echo_copyin(uaddr, kaddr, len)	copyin((uaddr), (kaddr), (len))
+#define echo_copyout(kaddr, uaddr, len)	copyout((kaddr), (uaddr), (len))
+
+typedef struct sx echo_lock_t;
+#define echo_lock_init(lock, name)	sx_init((lock), (name))
+#define echo_lock_destroy(lock)		sx_destroy(lock)
+#define echo_lock(lock)			sx_xlock(lock)
+#define echo_unlock(lock)		sx_xunlock(lock)
+#define echo_slock(lock)		sx_slock(lock)
+#define echo_sunlock(lock)		sx_sunlock(lock)
+
+/*
+ * Sleeping waits.  echo_cv_wait() gives up after ms milliseconds, or never if
+ * ms is 0, and returns EWOULDBLOCK on timeout or an error if interrupted.
+ * The tick count is clamped so that a long timeout cannot wrap negative.
+ */
+typedef struct mtx echo_mtx_t;
+typedef struct cv echo_cv_t;
+#define echo_mtx_init(mtx, name)	mtx_init((mtx), (name), NULL, MTX_DEF)
+#define echo_mtx_destroy(mtx)		mtx_destroy(mtx)
+#define echo_mtx_lock(mtx)		mtx_lock(mtx)
+#define echo_mtx_unlock(mtx)		mtx_unlock(mtx)
+#define echo_cv_init(cv, name)		cv_init((cv), (name))
+#define echo_cv_destroy(cv)		cv_destroy(cv)
+#define echo_cv_broadcast(cv)		cv_broadcast(cv)
+#define echo_cv_wait(cv, mtx, ms)					\
+	((ms) == 0 ? cv_wait_sig((cv), (mtx)) :				\
+	    cv_timedwait_sig((cv), (mtx),				\
+	    (int)MAX(1, MIN((uint64_t)(ms) * hz / 1000, INT_MAX))))
+
+/* Milliseconds of uptime, for deadlines across several waits. */
+#define echo_uptime_ms()		((uint64_t)sbttoms(getsbinuptime()))
+
+typedef epoch_t echo_epoch_t;
+typedef struct epoch_tracker echo_epoch_tracker_t;
+#define echo_epoch_alloc(name)		epoch_alloc((name), EPOCH_PREEMPT)
+#define echo_epoch_free(epoch)		epoch_free(epoch)
+#define echo_epoch_enter(epoch, et)	epoch_enter_preempt((epoch), (et))
+#define echo_epoch_exit(epoch, et)	epoch_exit_preempt((epoch), (et))
+#define echo_epoch_wait(epoch)		epoch_wait_preempt(epoch)
+
+#define echo_refcount_init(count, value)	refcount_init((count), (value))
+#define echo_refcount_acquire(count)	refcount_acquire(count)
+#define echo_refcount_release(count)	refcount_release(count)
+
+#define echo_load_ptr(ptr)						\
+	((void *)atomic_load_acq_ptr((volatile uintptr_t *)(ptr)))
+#define echo_store_ptr(ptr, value)					\
+	atomic_store_rel_ptr((volatile uintptr_t *)(ptr), (uintptr_t)(value))
+#define echo_load_acq_64(ptr)		atomic_load_acq_64(ptr)
+#define echo_store_rel_64(ptr, value)	atomic_store_rel_64((ptr), (value))
+#define echo_fence_acq()		atomic_thread_fence_acq()
+#define echo_fence_rel()		atomic_thread_fence_rel()
+#define echo_spinwait()			cpu_spinwait()
+
+#define echo_atomic_load_int(ptr)	atomic_load_int(ptr)
+#define echo_atomic_load_long(ptr)	atomic_load_long(ptr)
+#define echo_atomic_cmpset_long(ptr, old, new)				\
+	atomic_cmpset_long((ptr), (old), (new))
+#define echo_atomic_add_long(ptr, value)				\
+	atomic_add_long((ptr), (value))
+#define echo_atomic_subtract_long(ptr, value)				\
+	atomic_subtract_long((ptr), (value))
+#else
+#include <sys/types.h>
+#include <sys/nv.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* glibc has neither of these. */
+#ifndef __DECONST
+#define __DECONST(type, var)	((type)(uintptr_t)(const void *)(var))
+#endif
+#ifndef __unused
+#define __unused		__attribute__((__unused__))
+#endif
+
+#define echo_malloc(size)	calloc(1, (size))
+#define echo_realloc(ptr, size)	realloc((ptr), (size))
+#define echo_free(ptr)		free(ptr)
+
+#define echo_nv_malloc(size)	calloc(1, (size))
+#define echo_nv_free(ptr)	free(ptr)
+
+/* Userland callers of the protocol code pass plain pointers. */
+static inline int
+echo_copyin(const void *uaddr, void *kaddr, size_t len)
+{
+	memcpy(kaddr, uaddr, len);
+	return 0;
+}
+
+static inline int
+echo_copyout(const void *kaddr, void *uaddr, size_t len)
+{
+	memcpy(uaddr, kaddr, len);
+	return 0;
+}
+
+typedef pthread_rwlock_t echo_lock_t;
+#define echo_lock_init(lock, name)	pthread_rwlock_init((lock), NULL)
+#define echo_lock_destroy(lock)		pthread_rwlock_destroy(lock)
+#define echo_lock(lock)			pthread_rwlock_wrlock(lock)
+#define echo_unlock(lock)		pthread_rwlock_unlock(lock)
+#define echo_slock(lock)		pthread_rwlock_rdlock(lock)
+#define echo_sunlock(lock)		pthread_rwlock_unlock(lock)
+
+typedef pthread_mutex_t echo_mtx_t;
+typedef pthread_cond_t echo_cv_t;
+#define echo_mtx_init(mtx, name)	pthread_mutex_init((mtx), NULL)
+#define echo_mtx_destroy(mtx)		pthread_mutex_destroy(mtx)
+#define echo_mtx_lock(mtx)		pthread_mutex_lock(mtx)
+#define echo_mtx_unlock(mtx)		pthread_mutex_unlock(mtx)
+#define echo_cv_init(cv, name)		pthread_cond_init((cv), NULL)
+#define echo_cv_destroy(cv)		pthread_cond_destroy(cv)
+#define echo_cv_broadcast(cv)		pthread_cond_broadcast(cv)
+
+static inline int
+echo_cv_wait(echo_cv_t *cv, echo_mtx_t *mtx, u_int ms)
+{
+	struct timespec ts = {0};
+
+	if (ms == 0) {
+		return pthread_cond_wait(cv, mtx);
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return pthread_cond_timedwait(cv, mtx, &ts) == ETIMEDOUT ?
+	    EWOULDBLOCK : 0;
+}
+
+static inline uint64_t
+echo_uptime_ms(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Userland stand-in for epoch(9).  A reader counts itself in the current
+ * phase and re-checks the phase so it never joins one that a waiter has
+ * already flipped away from; a waiter flips the phase and waits for the
+ * readers of the old one to drain.
+ */
+struct echo_epoch {
+	pthread_mutex_t	ee_lock;
+	u_int		ee_phase;
+	u_int		ee_readers[2];
+};
+
+typedef struct echo_epoch *echo_epoch_t;
+typedef u_int echo_epoch_tracker_t;
+
+static inline echo_epoch_t
+echo_epoch_alloc(const char *name __unused)
+{
+	echo_epoch_t epoch = NULL;
+
+	epoch = calloc(1, sizeof(*epoch));
+	if (epoch != NULL) {
+		pthread_mutex_init(&epoch->ee_lock, NULL);
+	}
+	return epoch;
+}
+
+static inline void
+echo_epoch_free(echo_epoch_t epoch)
+{
+	pthread_mutex_destroy(&epoch->ee_lock);
+	free(epoch);
+}
+
+static inline void
+echo_epoch_enter(echo_epoch_t epoch, echo_epoch_tracker_t *et)
+{
+	u_int phase = 0;
+
+	for (;;) {
+		phase = __atomic_load_n(&epoch->ee_phase, __ATOMIC_SEQ_CST) & 1;
+		__atomic_fetch_add(&epoch->ee_readers[phase], 1, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&epoch->ee_phase, __ATOMIC_SEQ_CST) & 1) == phase) {
+			break;
+		}
+		__atomic_fetch_sub(&epoch->ee_readers[phase], 1, __ATOMIC_SEQ_CST);
+	}
+	*et = phase;
+}
+
+static inline void
+echo_epoch_exit(echo_epoch_t epoch, echo_epoch_tracker_t *et)
+{
+	__atomic_fetch_sub(&epoch->ee_readers[*et], 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+echo_epoch_wait(echo_epoch_t epoch)
+{
+	u_int phase = 0;
+
+	pthread_mutex_lock(&epoch->ee_lock);
+	phase = epoch->ee_phase & 1;
+	__atomic_store_n(&epoch->ee_phase, epoch->ee_phase + 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&epoch->ee_readers[phase], __ATOMIC_ACQUIRE) != 0) {
+		sched_yield();
+	}
+	pthread_mutex_unlock(&epoch->ee_lock);
+}
+
+#define echo_refcount_init(count, value)				\
+	__atomic_store_n((count), (value), __ATOMIC_RELAXED)
+#define echo_refcount_acquire(count)					\
+	__atomic_fetch_add((count), 1, __ATOMIC_RELAXED)
+#define echo_refcount_release(count)					\
+	(__atomic_sub_fetch((count), 1, __ATOMIC_ACQ_REL) == 0)
+
+#define echo_load_ptr(ptr)	__atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define echo_store_ptr(ptr, value)					\
+	__atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define echo_load_acq_64(ptr)	__atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define echo_store_rel_64(ptr, value)					\
+	__atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define echo_fence_acq()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define echo_fence_rel()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define echo_spinwait()		sched_yield()
+
+#define echo_atomic_load_int(ptr)	__atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define echo_atomic_load_long(ptr)	__atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define echo_atomic_cmpset_long(ptr, old, new)				\
+	({ u_long __old = (old);					\
+	__atomic_compare_exchange_n((ptr), &__old, (new), false,	\
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })
+#define echo_atomic_add_long(ptr, value)				\
+	__atomic_fetch_add((ptr), (value), __ATOMIC_SEQ_CST)
+#define echo_atomic_subtract_long(ptr, value)				\
+	__atomic_fetch_sub((ptr), (value), __ATOMIC_SEQ_CST)
+#endif
+
+#endif /* !_ECHO_COMPAT_H_ */
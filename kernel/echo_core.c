@@ -0,0 +1,707 @@
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_compact.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+#include "echo_patch.h"
+#include "echo_path.h"
+
+static echo_epoch_t echo_epoch;
+
+/*
+ * Generation of the last publish to any store.  Writers bump it under
+ * echo_gen_mtx together with installing their snapshot, so a waiter that
+ * sees a generation also sees the config that came with it.
+ */
+static uint64_t echo_gen = 0;
+static bool echo_gen_dying = false;
+static echo_mtx_t echo_gen_mtx;
+static echo_cv_t echo_gen_cv;
+static void (*echo_notify)(uint64_t gen) = NULL;
+
+u_long echo_maxsize = 64 * 1024 * 1024;
+
+/*
+ * notify, if not NULL, is called after every publish with only the store
+ * lock held.
+ */
+int
+echo_core_init(void (*notify)(uint64_t gen))
+{
+	echo_epoch = echo_epoch_alloc("echo");
+	if (echo_epoch == NULL) {
+		return ENOMEM;
+	}
+	echo_mtx_init(&echo_gen_mtx, "echo generation");
+	echo_cv_init(&echo_gen_cv, "echo generation");
+	echo_gen_dying = false;
+	echo_notify = notify;
+	return 0;
+}
+
+/*
+ * Wake up every waiter for good, so nobody is left sleeping in the store
+ * while the module goes away.
+ */
+void
+echo_core_shutdown(void)
+{
+	echo_mtx_lock(&echo_gen_mtx);
+	echo_gen_dying = true;
+	echo_cv_broadcast(&echo_gen_cv);
+	echo_mtx_unlock(&echo_gen_mtx);
+}
+
+void
+echo_core_fini(void)
+{
+	echo_cv_destroy(&echo_gen_cv);
+	echo_mtx_destroy(&echo_gen_mtx);
+	echo_epoch_free(echo_epoch);
+	echo_epoch = NULL;
+}
+
+uint64_t
+echo_core_gen(void)
+{
+	return echo_load_acq_64(&echo_gen);
+}
+
+/*
+ * Sleep until the generation passes gen or ms milliseconds went by, with 0
+ * meaning no timeout.  The generation at wakeup is stored in *genp.  The
+ * timeout holds across spurious wakeups, each sleep only gets what is left.
+ */
+int
+echo_core_wait(uint64_t gen, u_int ms, uint64_t *genp)
+{
+	uint64_t deadline = 0, now = 0;
+	u_int left = 0;
+	int error = 0;
+
+	if (ms != 0) {
+		deadline = echo_uptime_ms() + ms;
+	}
+	echo_mtx_lock(&echo_gen_mtx);
+	while (echo_gen <= gen && error == 0) {
+		if (echo_gen_dying) {
+			error = ENXIO;
+			break;
+		}
+		if (ms != 0) {
+			now = echo_uptime_ms();
+			if (now >= deadline) {
+				error = EWOULDBLOCK;
+				break;
+			}
+			left = deadline - now;
+		}
+		error = echo_cv_wait(&echo_gen_cv, &echo_gen_mtx, left);
+	}
+	*genp = echo_gen;
+	echo_mtx_unlock(&echo_gen_mtx);
+	if (error == EWOULDBLOCK) {
+		error = ETIMEDOUT;
+	}
+	return error;
+}
+
+/*
+ * Unpack a config sent in either the packed nvlist or the compact format.
+ */
+nvlist_t *
+echo_unpack(const void *buf, size_t len)
+{
+	nvlist_t *result = NULL;
+
+	if (echo_compact_is(buf, len)) {
+		if (echo_compact_decode(buf, len, &result) != 0) {
+			return NULL;
+		}
+		return result;
+	}
+	return nvlist_unpack(buf, len, 0);
+}
+
+/*
+ * Make a snapshot holding one reference of root and, if buf is not NULL,
+ * its packed form.  The snapshot owns both from here on, even on failure.
+ */
+static int
+echo_snap_new(struct echo_vnode *root, void *buf, size_t len,
+    struct echo_snap **snapp)
+{
+	struct echo_snap *snap = NULL;
+
+	snap = echo_malloc(sizeof(*snap));
+	if (snap == NULL) {
+		echo_vnode_release(root);
+		echo_nv_free(buf);
+		return ENOMEM;
+	}
+	snap->es_root = root;
+	snap->es_buf = buf;
+	snap->es_len = len;
+	echo_lock_init(&snap->es_lock, "echo snapshot");
+	echo_refcount_init(&snap->es_refs, 1);
+	*snapp = snap;
+	return 0;
+}
+
+void
+echo_snap_release(struct echo_snap *snap)
+{
+	if (snap == NULL || !echo_refcount_release(&snap->es_refs)) {
+		return;
+	}
+	echo_vnode_release(snap->es_root);
+	echo_nv_free(snap->es_buf);
+	echo_lock_destroy(&snap->es_lock);
+	echo_free(snap);
+}
+
+/*
+ * Make sure snap->es_buf and es_len hold the packed config.  Only the first
+ * caller exports and packs the tree; everybody else finds the buffer.
+ */
+int
+echo_snap_pack(struct echo_snap *snap)
+{
+	nvlist_t *nvl = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+	int error = 0;
+
+	if (echo_load_ptr(&snap->es_buf) != NULL) {
+		return 0;
+	}
+	echo_lock(&snap->es_lock);
+	if (snap->es_buf != NULL) {
+		goto out;
+	}
+	nvl = echo_vtree_export(snap->es_root);
+	if (nvl == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	buf = nvlist_pack(nvl, &len);
+	if (buf == NULL) {
+		error = nvlist_error(nvl);
+		error = error ? error : EINVAL;
+	} else {
+		snap->es_len = len;
+		echo_store_ptr(&snap->es_buf, buf);
+	}
+	nvlist_destroy(nvl);
+out:
+	echo_unlock(&snap->es_lock);
+	return error;
+}
+
+/*
+ * Make snap current.  Called with the store lock held; readers that still
+ * see the old snapshot have either taken their own reference or leave the
+ * epoch before the store's reference is dropped.  The history gets a
+ * reference of the snapshot's tree.
+ */
+static void
+echo_store_install(struct echo_store *st, struct echo_snap *snap)
+{
+	struct echo_snap *old = st->est_snap;
+	u_int depth = echo_history_limit();
+	uint64_t gen = 0;
+
+	echo_mtx_lock(&echo_gen_mtx);
+	gen = echo_gen + 1;
+	snap->es_gen = gen;
+	echo_store_ptr(&st->est_snap, snap);
+	echo_store_rel_64(&echo_gen, gen);
+	echo_cv_broadcast(&echo_gen_cv);
+	echo_mtx_unlock(&echo_gen_mtx);
+	echo_history_push(&st->est_hist, echo_vnode_hold(snap->es_root), gen,
+	    depth);
+	if (echo_notify != NULL) {
+		echo_notify(gen);
+	}
+	if (old != NULL) {
+		echo_epoch_wait(echo_epoch);
+		echo_snap_release(old);
+	}
+}
+
+void
+echo_store_init(struct echo_store *st)
+{
+	memset(st, 0, sizeof(*st));
+	echo_lock_init(&st->est_lock, "echo store");
+	echo_history_init(&st->est_hist);
+}
+
+void
+echo_store_fini(struct echo_store *st)
+{
+	echo_snap_release(st->est_snap);
+	st->est_snap = NULL;
+	echo_history_fini(&st->est_hist);
+	echo_lock_destroy(&st->est_lock);
+}
+
+/*
+ * Publish nvl, which is consumed.  Its tree shares every subtree that did
+ * not change with the current version.
+ */
+int
+echo_store_publish(struct echo_store *st, nvlist_t *nvl)
+{
+	struct echo_vnode *root = NULL;
+	struct echo_snap *snap = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+	int error = 0;
+
+	error = nvlist_error(nvl);
+	if (error) {
+		nvlist_destroy(nvl);
+		return error;
+	}
+	buf = nvlist_pack(nvl, &len);
+	if (buf == NULL) {
+		error = nvlist_error(nvl);
+		nvlist_destroy(nvl);
+		return error ? error : EINVAL;
+	}
+	echo_lock(&st->est_lock);
+	error = echo_vtree_build(nvl,
+	    st->est_snap != NULL ? st->est_snap->es_root : NULL, &root);
+	if (error) {
+		echo_nv_free(buf);
+		goto out;
+	}
+	error = echo_snap_new(root, buf, len, &snap);
+	if (error == 0) {
+		echo_store_install(st, snap);
+	}
+out:
+	echo_unlock(&st->est_lock);
+	nvlist_destroy(nvl);
+	return error;
+}
+
+int
+echo_store_set(struct echo_store *st, const void *buf, size_t len)
+{
+	nvlist_t *nvl = NULL;
+
+	nvl = echo_unpack(buf, len);
+	if (nvl == NULL) {
+		return EINVAL;
+	}
+	return echo_store_publish(st, nvl);
+}
+
+/*
+ * Apply a patch to the current version tree.  Only the nodes on the paths
+ * it touches are copied and the result is packed when a get first asks for
+ * it, so the cost follows the size of the patch rather than of the config.
+ * A failing patch leaves the store untouched.  The store lock is held
+ * throughout so concurrent patches apply on top of each other.  A nonzero
+ * base is the generation the patch was made against; if the store has moved
+ * on since it fails with ESTALE.  *genp, if not NULL, is set to the
+ * generation the result is published as.
+ */
+int
+echo_store_patch(struct echo_store *st, const void *buf, size_t len,
+    uint64_t base, uint64_t *genp)
+{
+	struct echo_vnode *root = NULL;
+	struct echo_snap *snap = NULL;
+	nvlist_t *patch = NULL;
+	int error = 0;
+
+	patch = echo_unpack(buf, len);
+	if (patch == NULL) {
+		return EINVAL;
+	}
+	echo_lock(&st->est_lock);
+	if (st->est_snap == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	if (base != 0 && st->est_snap->es_gen != base) {
+		error = ESTALE;
+		goto out;
+	}
+	error = echo_vtree_patch(st->est_snap->es_root, patch, &root);
+	if (error == 0) {
+		error = echo_snap_new(root, NULL, 0, &snap);
+	}
+	if (error == 0) {
+		echo_store_install(st, snap);
+		if (genp != NULL) {
+			*genp = snap->es_gen;
+		}
+	}
+out:
+	echo_unlock(&st->est_lock);
+	nvlist_destroy(patch);
+	return error;
+}
+
+/*
+ * Publish version gen again.  Its tree becomes the newest version as is,
+ * sharing every node with the old one, and is packed on the next get.
+ */
+int
+echo_store_rollback(struct echo_store *st, uint64_t gen)
+{
+	struct echo_vnode *root = NULL;
+	struct echo_snap *snap = NULL;
+	int error = 0;
+
+	echo_lock(&st->est_lock);
+	error = echo_history_hold(&st->est_hist, gen, &root);
+	if (error == 0) {
+		error = echo_snap_new(root, NULL, 0, &snap);
+	}
+	if (error == 0) {
+		echo_store_install(st, snap);
+	}
+	echo_unlock(&st->est_lock);
+	return error;
+}
+
+/*
+ * Pack the config of version gen.  The result is freed with echo_nv_free().
+ */
+int
+echo_store_version(struct echo_store *st, uint64_t gen, void **bufp,
+    size_t *lenp)
+{
+	struct echo_vnode *root = NULL;
+	nvlist_t *nvl = NULL;
+	int error = 0;
+
+	echo_slock(&st->est_lock);
+	error = echo_history_hold(&st->est_hist, gen, &root);
+	echo_sunlock(&st->est_lock);
+	if (error) {
+		return error;
+	}
+	nvl = echo_vtree_export(root);
+	echo_vnode_release(root);
+	if (nvl == NULL) {
+		return ENOMEM;
+	}
+	*bufp = nvlist_pack(nvl, lenp);
+	if (*bufp == NULL) {
+		error = nvlist_error(nvl);
+		error = error ? error : EINVAL;
+	}
+	nvlist_destroy(nvl);
+	return error;
+}
+
+nvlist_t *
+echo_store_history(struct echo_store *st)
+{
+	nvlist_t *nvl = NULL;
+
+	echo_slock(&st->est_lock);
+	nvl = echo_history_list(&st->est_hist);
+	echo_sunlock(&st->est_lock);
+	return nvl;
+}
+
+/*
+ * Return a referenced snapshot of the current config, or NULL if nothing is
+ * set.  Release it with echo_snap_release().
+ */
+struct echo_snap *
+echo_store_acquire(struct echo_store *st)
+{
+	echo_epoch_tracker_t et;
+	struct echo_snap *snap = NULL;
+
+	echo_epoch_enter(echo_epoch, &et);
+	snap = echo_load_ptr(&st->est_snap);
+	if (snap != NULL) {
+		echo_refcount_acquire(&snap->es_refs);
+	}
+	echo_epoch_exit(echo_epoch, &et);
+	return snap;
+}
+
+/*
+ * Pack only the value at path, as an nvlist with the last key of the path as
+ * its single pair.  The result is freed with echo_nv_free().
+ */
+int
+echo_snap_query(const struct echo_snap *snap, const char *path, void **bufp,
+    size_t *lenp)
+{
+	nvlist_t *result = NULL;
+	int error = 0;
+
+	result = nvlist_create(0);
+	if (result == NULL) {
+		return ENOMEM;
+	}
+	error = echo_vtree_query(snap->es_root, path, result);
+	if (error == 0) {
+		*bufp = nvlist_pack(result, lenp);
+		if (*bufp == NULL) {
+			error = nvlist_error(result);
+			error = error ? error : EINVAL;
+		}
+	}
+	nvlist_destroy(result);
+	return error;
+}
+
+/*
+ * Names end up as sysctl node names, so keep them to a safe alphabet.
+ */
+bool
+echo_ns_name_valid(const char *name)
+{
+	size_t i = 0;
+
+	for (i = 0; i < ECHO_NSNAMELEN && name[i] != '\0'; ++i) {
+		if (!((name[i] >= 'a' && name[i] <= 'z') ||
+		    (name[i] >= 'A' && name[i] <= 'Z') ||
+		    (name[i] >= '0' && name[i] <= '9') ||
+		    name[i] == '_' || name[i] == '-')) {
+			return false;
+		}
+	}
+	return i > 0 && i < ECHO_NSNAMELEN;
+}
+
+static struct echo_ns_list *
+echo_ns_bucket(struct echo_nstab *tab, const char *name)
+{
+	uint64_t hash = echo_hash(ECHO_HASH_INIT, name, strlen(name));
+
+	return &tab->ent_hash[hash % ECHO_NSHASHSIZE];
+}
+
+/* Called with the table lock held. */
+static struct echo_ns *
+echo_ns_find(struct echo_nstab *tab, const char *name)
+{
+	struct echo_ns *ns = NULL;
+
+	LIST_FOREACH(ns, echo_ns_bucket(tab, name), en_link) {
+		if (strcmp(ns->en_name, name) == 0) {
+			return ns;
+		}
+	}
+	return NULL;
+}
+
+void
+echo_ns_release(struct echo_ns *ns)
+{
+	if (ns == NULL || !echo_refcount_release(&ns->en_refs)) {
+		return;
+	}
+	echo_store_fini(&ns->en_store);
+	echo_free(ns);
+}
+
+void
+echo_nstab_init(struct echo_nstab *tab,
+    int (*attach)(struct echo_ns *), void (*detach)(struct echo_ns *))
+{
+	size_t i = 0;
+
+	memset(tab, 0, sizeof(*tab));
+	for (i = 0; i < ECHO_NSHASHSIZE; ++i) {
+		LIST_INIT(&tab->ent_hash[i]);
+	}
+	echo_lock_init(&tab->ent_lock, "echo namespaces");
+	tab->ent_attach = attach;
+	tab->ent_detach = detach;
+}
+
+/*
+ * Detach and drop every namespace.  Namespaces cannot be created anymore
+ * once this started, but callers still holding a reference keep theirs
+ * alive until they release it.
+ */
+void
+echo_nstab_drain(struct echo_nstab *tab)
+{
+	struct echo_ns *ns = NULL;
+	size_t i = 0;
+
+	echo_lock(&tab->ent_lock);
+	tab->ent_dying = true;
+	for (i = 0; i < ECHO_NSHASHSIZE; ++i) {
+		while ((ns = LIST_FIRST(&tab->ent_hash[i])) != NULL) {
+			LIST_REMOVE(ns, en_link);
+			if (tab->ent_detach != NULL) {
+				tab->ent_detach(ns);
+			}
+			echo_ns_release(ns);
+		}
+	}
+	echo_unlock(&tab->ent_lock);
+}
+
+/*
+ * Stop namespaces from being created and call fn with the table locked, so
+ * no hook runs meanwhile.  Lets the caller tear down what the hooks hang off
+ * before committing to a drain; if fn fails the table is left as it was.
+ */
+int
+echo_nstab_close(struct echo_nstab *tab, int (*fn)(void *), void *arg)
+{
+	int error = 0;
+
+	echo_lock(&tab->ent_lock);
+	error = fn(arg);
+	if (error == 0) {
+		tab->ent_dying = true;
+	}
+	echo_unlock(&tab->ent_lock);
+	return error;
+}
+
+void
+echo_nstab_fini(struct echo_nstab *tab)
+{
+	echo_nstab_drain(tab);
+	echo_lock_destroy(&tab->ent_lock);
+}
+
+/*
+ * Return a referenced namespace, release it with echo_ns_release().
+ */
+int
+echo_nstab_lookup(struct echo_nstab *tab, const char *name,
+    struct echo_ns **nsp)
+{
+	struct echo_ns *ns = NULL;
+
+	if (!echo_ns_name_valid(name)) {
+		return EINVAL;
+	}
+	echo_slock(&tab->ent_lock);
+	ns = echo_ns_find(tab, name);
+	if (ns != NULL) {
+		echo_refcount_acquire(&ns->en_refs);
+	}
+	echo_sunlock(&tab->ent_lock);
+	if (ns == NULL) {
+		return ENOENT;
+	}
+	*nsp = ns;
+	return 0;
+}
+
+/*
+ * Set the config of a namespace, creating it if needed.  Only the config of
+ * this namespace is unpacked and packed.
+ */
+int
+echo_nstab_set(struct echo_nstab *tab, const char *name,
+    const void *buf, size_t len)
+{
+	nvlist_t *nvl = NULL;
+
+	if (!echo_ns_name_valid(name)) {
+		return EINVAL;
+	}
+	nvl = echo_unpack(buf, len);
+	if (nvl == NULL) {
+		return EINVAL;
+	}
+	return echo_nstab_publish(tab, name, nvl);
+}
+
+/*
+ * Publish nvl, which is consumed, as the config of a namespace, creating it
+ * if needed.  A new namespace is published with its config already in
+ * place, so it is never seen empty.
+ */
+int
+echo_nstab_publish(struct echo_nstab *tab, const char *name, nvlist_t *nvl)
+{
+	struct echo_ns *ns = NULL;
+	int error = 0;
+
+	if (!echo_ns_name_valid(name)) {
+		nvlist_destroy(nvl);
+		return EINVAL;
+	}
+	if (echo_nstab_lookup(tab, name, &ns) == 0) {
+		error = echo_store_publish(&ns->en_store, nvl);
+		echo_ns_release(ns);
+		return error;
+	}
+
+	echo_lock(&tab->ent_lock);
+	if (tab->ent_dying) {
+		error = ENXIO;
+		goto fail;
+	}
+	ns = echo_ns_find(tab, name);
+	if (ns != NULL) {
+		echo_refcount_acquire(&ns->en_refs);
+		echo_unlock(&tab->ent_lock);
+		error = echo_store_publish(&ns->en_store, nvl);
+		echo_ns_release(ns);
+		return error;
+	}
+	ns = echo_malloc(sizeof(*ns));
+	if (ns == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	memcpy(ns->en_name, name, strlen(name));
+	echo_refcount_init(&ns->en_refs, 1);
+	echo_store_init(&ns->en_store);
+	error = echo_store_publish(&ns->en_store, nvl);
+	nvl = NULL;
+	if (error == 0 && tab->ent_attach != NULL) {
+		error = tab->ent_attach(ns);
+	}
+	if (error) {
+		echo_unlock(&tab->ent_lock);
+		echo_ns_release(ns);
+		return error;
+	}
+	LIST_INSERT_HEAD(echo_ns_bucket(tab, name), ns, en_link);
+	echo_unlock(&tab->ent_lock);
+	return 0;
+fail:
+	echo_unlock(&tab->ent_lock);
+	nvlist_destroy(nvl);
+	return error;
+}
+
+int
+echo_nstab_delete(struct echo_nstab *tab, const char *name)
+{
+	struct echo_ns *ns = NULL;
+
+	if (!echo_ns_name_valid(name)) {
+		return EINVAL;
+	}
+	echo_lock(&tab->ent_lock);
+	ns = echo_ns_find(tab, name);
+	if (ns == NULL) {
+		echo_unlock(&tab->ent_lock);
+		return ENOENT;
+	}
+	LIST_REMOVE(ns, en_link);
+	if (tab->ent_detach != NULL) {
+		tab->ent_detach(ns);
+	}
+	echo_unlock(&tab->ent_lock);
+	echo_ns_release(ns);
+	return 0;
+}
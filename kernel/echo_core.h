@@ -0,0 +1,121 @@
+/*
+ * Config store shared by the echo module and userland.  The current config
+ * is kept as an immutable snapshot holding its version tree (see
+ * echo_history.h) and its packed form.  A set packs the config it was given
+ * right away; other publishes pack it when a get first asks for it.  Gets
+ * only copy the cached buffer after that.
+ *
+ * Readers never block: echo_store_acquire() takes a reference on the
+ * current snapshot inside a short epoch section and the reference keeps it
+ * alive for as long as the caller needs, copyout included.  Writers are
+ * serialized by the store lock, publish a new snapshot with a release store
+ * of the pointer, bump the generation and drop the store's reference to the
+ * old snapshot once an epoch grace period has passed.
+ *
+ * The generation is shared by all stores and grows with every publish, so a
+ * consumer can read it cheaply or sleep until it passes the one it has seen.
+ *
+ * Each store also keeps its recent versions in an echo_history.  A publish
+ * pushes the tree of the new snapshot there with the store lock held, and
+ * rolling back publishes an old tree again.
+ *
+ * Configs can also be kept in named namespaces, each with a store of its own,
+ * so setting one namespace never repacks the others.  The namespace table is
+ * a hash of referenced entries; lookups share its lock and only creating or
+ * deleting a namespace takes it exclusively.  The attach and detach hooks
+ * run with the table lock held and let the module hang a sysctl node off
+ * each namespace.
+ */
+#ifndef _ECHO_CORE_H_
+#define _ECHO_CORE_H_
+
+struct echo_snap {
+	u_int			 es_refs;
+	struct echo_vnode	*es_root;
+	echo_lock_t		 es_lock;	/* serializes packing */
+	void			*es_buf;	/* es_root packed, or NULL */
+	size_t			 es_len;
+	uint64_t		 es_gen;
+};
+
+struct echo_store {
+	struct echo_snap	*est_snap;
+	echo_lock_t		 est_lock;
+	struct echo_history	 est_hist;
+};
+
+#define ECHO_NSHASHSIZE	64
+
+struct echo_ns {
+	LIST_ENTRY(echo_ns)	 en_link;
+	char			 en_name[ECHO_NSNAMELEN];
+	u_int			 en_refs;
+	struct echo_store	 en_store;
+	void			*en_priv;	/* owned by the attach hook */
+};
+
+LIST_HEAD(echo_ns_list, echo_ns);
+
+struct echo_nstab {
+	struct echo_ns_list	 ent_hash[ECHO_NSHASHSIZE];
+	echo_lock_t		 ent_lock;
+	bool			 ent_dying;
+	int			(*ent_attach)(struct echo_ns *ns);
+	void			(*ent_detach)(struct echo_ns *ns);
+};
+
+/* Largest config any set path accepts. */
+extern u_long	echo_maxsize;
+
+/* Per open file state of a protocol client. */
+struct echo_file {
+	struct echo_upload	 ef_upload;
+	uint64_t		 ef_seen;	/* last generation reported */
+};
+
+int	echo_core_init(void (*notify)(uint64_t gen));
+void	echo_core_shutdown(void);
+void	echo_core_fini(void);
+uint64_t	echo_core_gen(void);
+int	echo_core_wait(uint64_t gen, u_int ms, uint64_t *genp);
+
+nvlist_t	*echo_unpack(const void *buf, size_t len);
+
+void	echo_store_init(struct echo_store *st);
+void	echo_store_fini(struct echo_store *st);
+int	echo_store_publish(struct echo_store *st, nvlist_t *nvl);
+int	echo_store_set(struct echo_store *st, const void *buf, size_t len);
+int	echo_store_patch(struct echo_store *st, const void *buf, size_t len,
+	    uint64_t base, uint64_t *genp);
+struct echo_snap *echo_store_acquire(struct echo_store *st);
+int	echo_store_rollback(struct echo_store *st, uint64_t gen);
+int	echo_store_version(struct echo_store *st, uint64_t gen, void **bufp,
+	    size_t *lenp);
+nvlist_t	*echo_store_history(struct echo_store *st);
+void	echo_snap_release(struct echo_snap *snap);
+int	echo_snap_pack(struct echo_snap *snap);
+int	echo_snap_query(const struct echo_snap *snap, const char *path,
+	    void **bufp, size_t *lenp);
+
+bool	echo_ns_name_valid(const char *name);
+void	echo_nstab_init(struct echo_nstab *tab,
+	    int (*attach)(struct echo_ns *), void (*detach)(struct echo_ns *));
+void	echo_nstab_drain(struct echo_nstab *tab);
+int	echo_nstab_close(struct echo_nstab *tab, int (*fn)(void *),
+	    void *arg);
+void	echo_nstab_fini(struct echo_nstab *tab);
+int	echo_nstab_lookup(struct echo_nstab *tab, const char *name,
+	    struct echo_ns **nsp);
+int	echo_nstab_set(struct echo_nstab *tab, const char *name,
+	    const void *buf, size_t len);
+int	echo_nstab_publish(struct echo_nstab *tab, const char *name,
+	    nvlist_t *nvl);
+int	echo_nstab_delete(struct echo_nstab *tab, const char *name);
+void	echo_ns_release(struct echo_ns *ns);
+
+void	echo_file_init(struct echo_file *fp);
+void	echo_file_fini(struct echo_file *fp);
+int	echo_proto_ioctl(struct echo_store *st, struct echo_nstab *tab,
+	    struct echo_file *fp, u_long cmd, void *data);
+
+#endif /* !_ECHO_CORE_H_ */
@@ -0,0 +1,825 @@
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_history.h"
+#include "echo_patch.h"
+#include "echo_path.h"
+
+/*
+ * A pair name, shared by every copy of the entries that hold it rather than
+ * duplicated when a node on a patched path is copied.
+ */
+struct echo_vname {
+	u_int			 evm_refs;
+	char			 evm_str[];
+};
+
+struct echo_ventry {
+	struct echo_vname	*eve_name;
+	size_t			 eve_order;	/* position in the source nvlist */
+	struct echo_vnode	*eve_node;
+};
+
+struct echo_vnode {
+	u_int			 evn_refs;
+	nvlist_t		*evn_leaf;	/* one pair, NULL if interior */
+	size_t			 evn_count;
+	struct echo_ventry	*evn_entries;	/* sorted by name */
+};
+
+u_int echo_history_depth = 8;
+volatile u_long echo_history_nodes = 0;
+
+static bool vtree_nvlist_equal(const nvlist_t *a, const nvlist_t *b);
+
+static bool
+vtree_pair_equal(const nvlist_t *a, const nvlist_t *b, const char *name,
+    int type)
+{
+	const void *pa = NULL, *pb = NULL;
+	const char * const *sa = NULL, * const *sb = NULL;
+	const nvlist_t * const *na = NULL, * const *nb = NULL;
+	size_t ca = 0, cb = 0, i = 0;
+
+	switch (type) {
+		case NV_TYPE_NULL:
+			return true;
+		case NV_TYPE_BOOL:
+			return nvlist_get_bool(a, name) == nvlist_get_bool(b, name);
+		case NV_TYPE_NUMBER:
+			return nvlist_get_number(a, name) == nvlist_get_number(b, name);
+		case NV_TYPE_STRING:
+			return strcmp(nvlist_get_string(a, name),
+			    nvlist_get_string(b, name)) == 0;
+		case NV_TYPE_NVLIST:
+			return vtree_nvlist_equal(nvlist_get_nvlist(a, name),
+			    nvlist_get_nvlist(b, name));
+		case NV_TYPE_BINARY:
+			pa = nvlist_get_binary(a, name, &ca);
+			pb = nvlist_get_binary(b, name, &cb);
+			return ca == cb && memcmp(pa, pb, ca) == 0;
+		case NV_TYPE_BOOL_ARRAY:
+			pa = nvlist_get_bool_array(a, name, &ca);
+			pb = nvlist_get_bool_array(b, name, &cb);
+			return ca == cb && memcmp(pa, pb, ca * sizeof(bool)) == 0;
+		case NV_TYPE_NUMBER_ARRAY:
+			pa = nvlist_get_number_array(a, name, &ca);
+			pb = nvlist_get_number_array(b, name, &cb);
+			return ca == cb && memcmp(pa, pb, ca * sizeof(uint64_t)) == 0;
+		case NV_TYPE_STRING_ARRAY:
+			sa = nvlist_get_string_array(a, name, &ca);
+			sb = nvlist_get_string_array(b, name, &cb);
+			for (i = 0; ca == cb && i < ca; ++i) {
+				if (strcmp(sa[i], sb[i]) != 0) {
+					return false;
+				}
+			}
+			return ca == cb;
+		case NV_TYPE_NVLIST_ARRAY:
+			na = nvlist_get_nvlist_array(a, name, &ca);
+			nb = nvlist_get_nvlist_array(b, name, &cb);
+			for (i = 0; ca == cb && i < ca; ++i) {
+				if (!vtree_nvlist_equal(na[i], nb[i])) {
+					return false;
+				}
+			}
+			return ca == cb;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Pairs have to match in order too, so an export gives back the same
+ * nvlist that was committed.
+ */
+static bool
+vtree_nvlist_equal(const nvlist_t *a, const nvlist_t *b)
+{
+	const char *na = NULL, *nb = NULL;
+	void *ca = NULL, *cb = NULL;
+	int ta = 0, tb = 0;
+
+	for (;;) {
+		na = nvlist_next(a, &ta, &ca);
+		nb = nvlist_next(b, &tb, &cb);
+		if (na == NULL || nb == NULL) {
+			return na == nb;
+		}
+		if (ta != tb || strcmp(na, nb) != 0 ||
+		    !vtree_pair_equal(a, b, na, ta)) {
+			return false;
+		}
+	}
+}
+
+static int
+vtree_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct echo_ventry *)a)->eve_name->evm_str,
+	    ((const struct echo_ventry *)b)->eve_name->evm_str);
+}
+
+/*
+ * Look name up in node.  *posp is set to its entry if it is found, or to
+ * where it would be inserted.
+ */
+static bool
+vtree_index(const struct echo_vnode *node, const char *name, size_t *posp)
+{
+	size_t lo = 0, hi = node->evn_count, mid = 0;
+	int cmp = 0;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(name, node->evn_entries[mid].eve_name->evm_str);
+		if (cmp == 0) {
+			*posp = mid;
+			return true;
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	*posp = lo;
+	return false;
+}
+
+static struct echo_vnode *
+vtree_find(const struct echo_vnode *node, const char *name)
+{
+	size_t pos = 0;
+
+	return vtree_index(node, name, &pos) ? node->evn_entries[pos].eve_node :
+	    NULL;
+}
+
+static struct echo_vname *
+vtree_name(const char *str)
+{
+	struct echo_vname *name = NULL;
+	size_t len = strlen(str) + 1;
+
+	name = echo_malloc(sizeof(*name) + len);
+	if (name == NULL) {
+		return NULL;
+	}
+	echo_refcount_init(&name->evm_refs, 1);
+	memcpy(name->evm_str, str, len);
+	return name;
+}
+
+static void
+vtree_name_release(struct echo_vname *name)
+{
+	if (echo_refcount_release(&name->evm_refs)) {
+		echo_free(name);
+	}
+}
+
+/* A new node with one reference, counted in echo_history_nodes. */
+static struct echo_vnode *
+vtree_alloc(void)
+{
+	struct echo_vnode *node = NULL;
+
+	node = echo_malloc(sizeof(*node));
+	if (node == NULL) {
+		return NULL;
+	}
+	echo_refcount_init(&node->evn_refs, 1);
+	echo_atomic_add_long(&echo_history_nodes, 1);
+	return node;
+}
+
+struct echo_vnode *
+echo_vnode_hold(struct echo_vnode *node)
+{
+	echo_refcount_acquire(&node->evn_refs);
+	return node;
+}
+
+void
+echo_vnode_release(struct echo_vnode *node)
+{
+	size_t i = 0;
+
+	if (node == NULL || !echo_refcount_release(&node->evn_refs)) {
+		return;
+	}
+	if (node->evn_leaf != NULL) {
+		nvlist_destroy(node->evn_leaf);
+	}
+	for (i = 0; i < node->evn_count; ++i) {
+		echo_vnode_release(node->evn_entries[i].eve_node);
+		vtree_name_release(node->evn_entries[i].eve_name);
+	}
+	echo_free(node->evn_entries);
+	echo_free(node);
+	echo_atomic_subtract_long(&echo_history_nodes, 1);
+}
+
+/*
+ * Make a leaf of the one pair nvlist leaf, which is consumed.
+ */
+static int
+vtree_leaf_take(nvlist_t *leaf, struct echo_vnode **nodep)
+{
+	struct echo_vnode *node = NULL;
+
+	node = vtree_alloc();
+	if (node == NULL) {
+		nvlist_destroy(leaf);
+		return ENOMEM;
+	}
+	node->evn_leaf = leaf;
+	*nodep = node;
+	return 0;
+}
+
+static int
+vtree_leaf(const nvlist_t *nvl, const char *name, int type,
+    struct echo_vnode **nodep)
+{
+	struct echo_path_ref ref = {0};
+	nvlist_t *leaf = NULL;
+	int error = 0;
+
+	leaf = nvlist_create(0);
+	if (leaf == NULL) {
+		return ENOMEM;
+	}
+	ref.epr_parent = nvl;
+	ref.epr_name = name;
+	ref.epr_type = type;
+	error = echo_path_copy(&ref, leaf);
+	if (error) {
+		nvlist_destroy(leaf);
+		return error;
+	}
+	return vtree_leaf_take(leaf, nodep);
+}
+
+/*
+ * Build the tree of nvl, reusing every subtree of prev that did not change.
+ * If nothing changed at all, the result is prev itself.
+ */
+int
+echo_vtree_build(const nvlist_t *nvl, struct echo_vnode *prev,
+    struct echo_vnode **rootp)
+{
+	struct echo_vnode *node = NULL, *child = NULL, *old = NULL;
+	struct echo_ventry *entry = NULL;
+	const char *name = NULL;
+	void *cookie = NULL;
+	size_t count = 0, i = 0;
+	bool same = false;
+	int type = 0, error = 0;
+
+	if (prev != NULL && prev->evn_leaf != NULL) {
+		prev = NULL;
+	}
+	while (nvlist_next(nvl, &type, &cookie) != NULL) {
+		++count;
+	}
+	node = vtree_alloc();
+	if (node == NULL) {
+		return ENOMEM;
+	}
+	if (count > 0) {
+		node->evn_entries = echo_malloc(count * sizeof(*node->evn_entries));
+		if (node->evn_entries == NULL) {
+			echo_vnode_release(node);
+			return ENOMEM;
+		}
+	}
+	cookie = NULL;
+	while ((name = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		old = prev != NULL ? vtree_find(prev, name) : NULL;
+		if (type == NV_TYPE_NVLIST) {
+			error = echo_vtree_build(nvlist_get_nvlist(nvl, name), old,
+			    &child);
+		} else if (old != NULL && old->evn_leaf != NULL &&
+		    nvlist_exists_type(old->evn_leaf, name, type) &&
+		    vtree_pair_equal(old->evn_leaf, nvl, name, type)) {
+			child = echo_vnode_hold(old);
+		} else {
+			error = vtree_leaf(nvl, name, type, &child);
+		}
+		if (error) {
+			goto fail;
+		}
+		entry = &node->evn_entries[node->evn_count];
+		entry->eve_name = vtree_name(name);
+		if (entry->eve_name == NULL) {
+			echo_vnode_release(child);
+			error = ENOMEM;
+			goto fail;
+		}
+		entry->eve_order = node->evn_count;
+		entry->eve_node = child;
+		++node->evn_count;
+	}
+	if (node->evn_count > 1) {
+		qsort(node->evn_entries, node->evn_count,
+		    sizeof(*node->evn_entries), vtree_entry_cmp);
+	}
+
+	/* A shared child comes from prev's child of the same name. */
+	same = prev != NULL && prev->evn_count == node->evn_count;
+	for (i = 0; same && i < node->evn_count; ++i) {
+		same = node->evn_entries[i].eve_node == prev->evn_entries[i].eve_node &&
+		    node->evn_entries[i].eve_order == prev->evn_entries[i].eve_order;
+	}
+	if (same) {
+		echo_vnode_release(node);
+		node = echo_vnode_hold(prev);
+	}
+	*rootp = node;
+	return 0;
+fail:
+	echo_vnode_release(node);
+	return error;
+}
+
+/*
+ * A private copy of the interior node node, with references of its own on
+ * the children and their names and room for one more entry.
+ */
+static struct echo_vnode *
+vtree_copy(const struct echo_vnode *node)
+{
+	struct echo_vnode *copy = NULL;
+	const struct echo_ventry *entry = NULL;
+	size_t i = 0;
+
+	copy = vtree_alloc();
+	if (copy == NULL) {
+		return NULL;
+	}
+	copy->evn_entries = echo_malloc((node->evn_count + 1) *
+	    sizeof(*copy->evn_entries));
+	if (copy->evn_entries == NULL) {
+		echo_vnode_release(copy);
+		return NULL;
+	}
+	for (i = 0; i < node->evn_count; ++i) {
+		entry = &node->evn_entries[i];
+		echo_refcount_acquire(&entry->eve_name->evm_refs);
+		copy->evn_entries[i].eve_name = entry->eve_name;
+		copy->evn_entries[i].eve_order = entry->eve_order;
+		copy->evn_entries[i].eve_node = echo_vnode_hold(entry->eve_node);
+	}
+	copy->evn_count = node->evn_count;
+	return copy;
+}
+
+/* Drop entry pos of a private node, closing the gap in the pair order. */
+static void
+vtree_remove(struct echo_vnode *node, size_t pos)
+{
+	size_t order = node->evn_entries[pos].eve_order, i = 0;
+
+	echo_vnode_release(node->evn_entries[pos].eve_node);
+	vtree_name_release(node->evn_entries[pos].eve_name);
+	memmove(&node->evn_entries[pos], &node->evn_entries[pos + 1],
+	    (node->evn_count - pos - 1) * sizeof(*node->evn_entries));
+	--node->evn_count;
+	for (i = 0; i < node->evn_count; ++i) {
+		if (node->evn_entries[i].eve_order > order) {
+			--node->evn_entries[i].eve_order;
+		}
+	}
+}
+
+/*
+ * Make child, whose reference is taken over, the last pair of a private
+ * node under name, replacing any pair of that name the way nvlist_free()
+ * followed by an add does.
+ */
+static int
+vtree_append(struct echo_vnode *node, const char *name,
+    struct echo_vnode *child)
+{
+	struct echo_ventry *entry = NULL;
+	struct echo_vname *vname = NULL;
+	size_t pos = 0;
+
+	if (vtree_index(node, name, &pos)) {
+		vname = node->evn_entries[pos].eve_name;
+		echo_refcount_acquire(&vname->evm_refs);
+		vtree_remove(node, pos);
+	} else {
+		vname = vtree_name(name);
+		if (vname == NULL) {
+			echo_vnode_release(child);
+			return ENOMEM;
+		}
+	}
+	entry = &node->evn_entries[pos];
+	memmove(entry + 1, entry,
+	    (node->evn_count - pos) * sizeof(*node->evn_entries));
+	entry->eve_name = vname;
+	entry->eve_order = node->evn_count;
+	entry->eve_node = child;
+	++node->evn_count;
+	return 0;
+}
+
+/*
+ * Apply op below node, or only check that it applies if apply is false.
+ * path is what is left of the op's path and key has room for all of it.
+ * Interior nodes on the path are copied; once the path reaches a leaf, or
+ * ends, the op is applied to a copy of that one pair with echo_patch_op().
+ * On success with apply set, *nodep is the new version of node.
+ */
+static int
+vtree_patch_op(struct echo_vnode *node, const char *path, char *key,
+    nvlist_t *op, bool apply, struct echo_vnode **nodep)
+{
+	struct echo_vnode *child = NULL, *next = NULL, *copy = NULL;
+	const char *start = path;
+	nvlist_t *nvl = NULL;
+	bool indexed = false, found = false, own = true;
+	size_t index = 0, pos = 0;
+	int error = 0;
+
+	error = echo_path_next(&path, key, &indexed, &index);
+	if (error) {
+		return error;
+	}
+	found = vtree_index(node, key, &pos);
+	child = found ? node->evn_entries[pos].eve_node : NULL;
+	if (child == NULL && *path != '\0') {
+		return ENOENT;
+	}
+	if (child != NULL && child->evn_leaf == NULL) {
+		if (indexed) {
+			return ENOENT;
+		}
+		if (*path != '\0') {
+			error = vtree_patch_op(child, path, key, op, apply, &next);
+			if (error || !apply) {
+				return error;
+			}
+			copy = vtree_copy(node);
+			if (copy == NULL) {
+				echo_vnode_release(next);
+				return ENOMEM;
+			}
+			echo_vnode_release(copy->evn_entries[pos].eve_node);
+			copy->evn_entries[pos].eve_node = next;
+			*nodep = copy;
+			return 0;
+		}
+		switch (nvlist_get_number(op, ECHO_PATCH_OP)) {
+			case ECHO_PATCH_REMOVE:
+				if (!apply) {
+					return 0;
+				}
+				copy = vtree_copy(node);
+				if (copy == NULL) {
+					return ENOMEM;
+				}
+				vtree_remove(copy, pos);
+				*nodep = copy;
+				return 0;
+			case ECHO_PATCH_SPLICE:
+				return EINVAL;
+		}
+	}
+
+	/* A subtree being replaced is checked and set on an empty nvlist. */
+	if (child != NULL && child->evn_leaf != NULL) {
+		own = apply;
+		nvl = apply ? nvlist_clone(child->evn_leaf) :
+		    __DECONST(nvlist_t *, child->evn_leaf);
+	} else {
+		nvl = nvlist_create(0);
+	}
+	if (nvl == NULL) {
+		return ENOMEM;
+	}
+	error = echo_patch_op(nvl, start, op, apply);
+	if (error || !apply) {
+		if (own) {
+			nvlist_destroy(nvl);
+		}
+		return error;
+	}
+	if (nvlist_empty(nvl)) {
+		nvlist_destroy(nvl);
+	} else if (nvlist_exists_nvlist(nvl, key)) {
+		error = echo_vtree_build(nvlist_get_nvlist(nvl, key), child, &next);
+		nvlist_destroy(nvl);
+	} else {
+		error = vtree_leaf_take(nvl, &next);
+	}
+	if (error) {
+		return error;
+	}
+	copy = vtree_copy(node);
+	if (copy == NULL) {
+		echo_vnode_release(next);
+		return ENOMEM;
+	}
+	if (next == NULL) {
+		vtree_remove(copy, pos);
+	} else if (*path == '\0') {
+		error = vtree_append(copy, key, next);
+	} else {
+		echo_vnode_release(copy->evn_entries[pos].eve_node);
+		copy->evn_entries[pos].eve_node = next;
+	}
+	if (error) {
+		echo_vnode_release(copy);
+		return error;
+	}
+	*nodep = copy;
+	return 0;
+}
+
+/*
+ * Apply patch (see echo_patch.h) to the config of root by path copying:
+ * only the nodes on the paths of its ops are new, everything else is shared
+ * with root.  Like echo_patch_apply(), every op is checked against root
+ * before any is applied, but root itself never changes, so a failing patch
+ * leaves no trace.  Values are moved out of patch.
+ */
+int
+echo_vtree_patch(struct echo_vnode *root, nvlist_t *patch,
+    struct echo_vnode **rootp)
+{
+	const nvlist_t * const *ops = NULL;
+	struct echo_vnode *node = NULL, *next = NULL;
+	const char *path = NULL;
+	size_t nops = 0, i = 0, len = 0;
+	char *key = NULL;
+	int error = 0;
+
+	error = nvlist_error(patch);
+	if (error) {
+		return error;
+	}
+	if (!nvlist_exists_nvlist_array(patch, ECHO_PATCH_OPS)) {
+		if (nvlist_exists(patch, ECHO_PATCH_OPS)) {
+			return EINVAL;
+		}
+		*rootp = echo_vnode_hold(root);
+		return 0;
+	}
+	ops = nvlist_get_nvlist_array(patch, ECHO_PATCH_OPS, &nops);
+	for (i = 0; i < nops; ++i) {
+		path = echo_patch_path(ops[i]);
+		if (path == NULL) {
+			return EINVAL;
+		}
+		if (strlen(path) > len) {
+			len = strlen(path);
+		}
+	}
+	key = echo_malloc(len + 1);
+	if (key == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < nops; ++i) {
+		error = vtree_patch_op(root, echo_patch_path(ops[i]), key,
+		    __DECONST(nvlist_t *, ops[i]), false, NULL);
+		if (error) {
+			goto out;
+		}
+	}
+	node = echo_vnode_hold(root);
+	for (i = 0; i < nops; ++i) {
+		error = vtree_patch_op(node, echo_patch_path(ops[i]), key,
+		    __DECONST(nvlist_t *, ops[i]), true, &next);
+		if (error) {
+			goto out;
+		}
+		echo_vnode_release(node);
+		node = next;
+	}
+	*rootp = node;
+	node = NULL;
+out:
+	echo_vnode_release(node);
+	echo_free(key);
+	return error;
+}
+
+nvlist_t *
+echo_vtree_export(const struct echo_vnode *root)
+{
+	const struct echo_ventry **byorder = NULL;
+	const struct echo_ventry *entry = NULL;
+	struct echo_path_ref ref = {0};
+	nvlist_t *nvl = NULL, *child = NULL;
+	size_t i = 0;
+	int error = 0;
+
+	nvl = nvlist_create(0);
+	if (nvl == NULL) {
+		return NULL;
+	}
+	if (root->evn_count == 0) {
+		return nvl;
+	}
+	byorder = echo_malloc(root->evn_count * sizeof(*byorder));
+	if (byorder == NULL) {
+		nvlist_destroy(nvl);
+		return NULL;
+	}
+	for (i = 0; i < root->evn_count; ++i) {
+		byorder[root->evn_entries[i].eve_order] = &root->evn_entries[i];
+	}
+	for (i = 0; i < root->evn_count && error == 0; ++i) {
+		entry = byorder[i];
+		if (entry->eve_node->evn_leaf != NULL) {
+			ref.epr_parent = entry->eve_node->evn_leaf;
+			ref.epr_name = entry->eve_name->evm_str;
+			ref.epr_type = echo_nv_type(ref.epr_parent, ref.epr_name);
+			error = echo_path_copy(&ref, nvl);
+		} else {
+			child = echo_vtree_export(entry->eve_node);
+			if (child == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			nvlist_move_nvlist(nvl, entry->eve_name->evm_str, child);
+			error = nvlist_error(nvl);
+		}
+	}
+	echo_free(byorder);
+	if (error) {
+		nvlist_destroy(nvl);
+		return NULL;
+	}
+	return nvl;
+}
+
+/*
+ * Add the value at path to dst under the last key of the path, as
+ * echo_path_copy() does for a resolved path.  Only the interior nodes on the
+ * path are visited; once it reaches a leaf, the rest of the path is resolved
+ * inside the leaf's nvlist.
+ */
+int
+echo_vtree_query(const struct echo_vnode *root, const char *path,
+    nvlist_t *dst)
+{
+	const struct echo_vnode *node = root, *child = NULL;
+	struct echo_path_ref ref = {0};
+	const char *start = NULL;
+	nvlist_t *nvl = NULL;
+	bool indexed = false;
+	size_t index = 0;
+	char *key = NULL;
+	int error = 0;
+
+	key = echo_malloc(strlen(path) + 1);
+	if (key == NULL) {
+		return ENOMEM;
+	}
+	for (;;) {
+		start = path;
+		error = echo_path_next(&path, key, &indexed, &index);
+		if (error) {
+			break;
+		}
+		child = vtree_find(node, key);
+		if (child == NULL) {
+			error = ENOENT;
+			break;
+		}
+		if (child->evn_leaf != NULL) {
+			error = echo_path_resolve(child->evn_leaf, start, &ref);
+			if (error == 0) {
+				error = echo_path_copy(&ref, dst);
+				echo_path_release(&ref);
+			}
+			break;
+		}
+		if (indexed) {
+			error = ENOENT;
+			break;
+		}
+		if (*path == '\0') {
+			nvl = echo_vtree_export(child);
+			if (nvl == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			nvlist_move_nvlist(dst, key, nvl);
+			error = nvlist_error(dst);
+			break;
+		}
+		node = child;
+	}
+	echo_free(key);
+	return error;
+}
+
+void
+echo_history_init(struct echo_history *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void
+echo_history_fini(struct echo_history *h)
+{
+	u_int i = 0;
+
+	for (i = 0; i < h->eh_count; ++i) {
+		echo_vnode_release(
+		    h->eh_ring[(h->eh_head + ECHO_HISTORY_MAX - i) % ECHO_HISTORY_MAX].ev_root);
+	}
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * The depth to keep, read once per publish so a concurrent sysctl write
+ * cannot change it halfway through.
+ */
+u_int
+echo_history_limit(void)
+{
+	u_int depth = echo_atomic_load_int(&echo_history_depth);
+
+	return depth < ECHO_HISTORY_MAX ? depth : ECHO_HISTORY_MAX;
+}
+
+/*
+ * Make root, whose reference the history takes over, the newest version and
+ * forget the ones beyond depth.  With a depth of 0 nothing is kept and root
+ * is released right away.
+ */
+void
+echo_history_push(struct echo_history *h, struct echo_vnode *root,
+    uint64_t gen, u_int depth)
+{
+	u_int oldest = 0;
+
+	while (h->eh_count > 0 && h->eh_count >= depth) {
+		oldest = (h->eh_head + ECHO_HISTORY_MAX - (h->eh_count - 1)) %
+		    ECHO_HISTORY_MAX;
+		echo_vnode_release(h->eh_ring[oldest].ev_root);
+		h->eh_ring[oldest].ev_root = NULL;
+		--h->eh_count;
+	}
+	if (depth == 0) {
+		echo_vnode_release(root);
+		return;
+	}
+	h->eh_head = (h->eh_head + 1) % ECHO_HISTORY_MAX;
+	h->eh_ring[h->eh_head].ev_gen = gen;
+	h->eh_ring[h->eh_head].ev_root = root;
+	++h->eh_count;
+}
+
+int
+echo_history_hold(struct echo_history *h, uint64_t gen,
+    struct echo_vnode **rootp)
+{
+	struct echo_version *v = NULL;
+	u_int i = 0;
+
+	for (i = 0; i < h->eh_count; ++i) {
+		v = &h->eh_ring[(h->eh_head + ECHO_HISTORY_MAX - i) % ECHO_HISTORY_MAX];
+		if (v->ev_gen == gen) {
+			*rootp = echo_vnode_hold(v->ev_root);
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * The generations kept, newest first.  The array is built in place for
+ * nvlist_move_number_array() rather than on the stack.
+ */
+nvlist_t *
+echo_history_list(const struct echo_history *h)
+{
+	uint64_t *gens = NULL;
+	nvlist_t *nvl = NULL;
+	u_int i = 0;
+
+	nvl = nvlist_create(0);
+	if (nvl == NULL || h->eh_count == 0) {
+		return nvl;
+	}
+	gens = echo_nv_malloc(h->eh_count * sizeof(*gens));
+	if (gens == NULL) {
+		nvlist_destroy(nvl);
+		return NULL;
+	}
+	for (i = 0; i < h->eh_count; ++i) {
+		gens[i] = h->eh_ring[(h->eh_head + ECHO_HISTORY_MAX - i) %
+		    ECHO_HISTORY_MAX].ev_gen;
+	}
+	nvlist_move_number_array(nvl, ECHO_HISTORY_GENS, gens, h->eh_count);
+	return nvl;
+}
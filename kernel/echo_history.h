@@ -0,0 +1,54 @@
+/*
+ * Config versions.  Every version of a store is kept as a persistent tree:
+ * nested nvlists become interior nodes with their children sorted by name
+ * and every other pair a leaf holding a one pair nvlist.  Nodes are
+ * immutable and reference counted, so a new version only allocates the
+ * nodes on the paths to what changed and shares the rest with the version
+ * before it.  The tree is what a snapshot holds; queries walk it directly.
+ *
+ * A store keeps its last echo_history_depth versions in a ring.  Rolling
+ * back republishes an old version's tree as is.  echo_history_nodes counts
+ * the nodes alive in all trees, so what a version costs is how much it
+ * grows by.
+ */
+#ifndef _ECHO_HISTORY_H_
+#define _ECHO_HISTORY_H_
+
+#define ECHO_HISTORY_MAX	64
+
+struct echo_vnode;
+
+struct echo_version {
+	uint64_t		 ev_gen;
+	struct echo_vnode	*ev_root;
+};
+
+struct echo_history {
+	struct echo_version	 eh_ring[ECHO_HISTORY_MAX];
+	u_int			 eh_head;	/* slot of the newest version */
+	u_int			 eh_count;
+};
+
+extern u_int	echo_history_depth;
+extern volatile u_long	echo_history_nodes;
+
+int	echo_vtree_build(const nvlist_t *nvl, struct echo_vnode *prev,
+	    struct echo_vnode **rootp);
+nvlist_t	*echo_vtree_export(const struct echo_vnode *root);
+int	echo_vtree_patch(struct echo_vnode *root, nvlist_t *patch,
+	    struct echo_vnode **rootp);
+int	echo_vtree_query(const struct echo_vnode *root, const char *path,
+	    nvlist_t *dst);
+struct echo_vnode *echo_vnode_hold(struct echo_vnode *node);
+void	echo_vnode_release(struct echo_vnode *node);
+
+void	echo_history_init(struct echo_history *h);
+void	echo_history_fini(struct echo_history *h);
+u_int	echo_history_limit(void);
+void	echo_history_push(struct echo_history *h, struct echo_vnode *root,
+	    uint64_t gen, u_int depth);
+int	echo_history_hold(struct echo_history *h, uint64_t gen,
+	    struct echo_vnode **rootp);
+nvlist_t	*echo_history_list(const struct echo_history *h);
+
+#endif /* !_ECHO_HISTORY_H_ */
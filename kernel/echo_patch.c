@@ -0,0 +1,306 @@
+#include "echo_compat.h"
+
+#include "echo_patch.h"
+#include "echo_path.h"
+
+static size_t
+patch_elem_size(int type)
+{
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			return sizeof(bool);
+		case NV_TYPE_NUMBER_ARRAY:
+			return sizeof(uint64_t);
+		case NV_TYPE_STRING_ARRAY:
+			return sizeof(char *);
+		case NV_TYPE_NVLIST_ARRAY:
+			return sizeof(nvlist_t *);
+	}
+	return 0;
+}
+
+static size_t
+patch_array_items(const nvlist_t *nvl, const char *name, int type)
+{
+	size_t items = 0;
+
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			nvlist_get_bool_array(nvl, name, &items);
+			break;
+		case NV_TYPE_NUMBER_ARRAY:
+			nvlist_get_number_array(nvl, name, &items);
+			break;
+		case NV_TYPE_STRING_ARRAY:
+			nvlist_get_string_array(nvl, name, &items);
+			break;
+		case NV_TYPE_NVLIST_ARRAY:
+			nvlist_get_nvlist_array(nvl, name, &items);
+			break;
+	}
+	return items;
+}
+
+static void *
+patch_take_array(nvlist_t *nvl, const char *name, int type, size_t *itemsp)
+{
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			return nvlist_take_bool_array(nvl, name, itemsp);
+		case NV_TYPE_NUMBER_ARRAY:
+			return nvlist_take_number_array(nvl, name, itemsp);
+		case NV_TYPE_STRING_ARRAY:
+			return nvlist_take_string_array(nvl, name, itemsp);
+		case NV_TYPE_NVLIST_ARRAY:
+			return nvlist_take_nvlist_array(nvl, name, itemsp);
+	}
+	*itemsp = 0;
+	return NULL;
+}
+
+static void
+patch_move_array(nvlist_t *nvl, const char *name, int type, void *array,
+    size_t items)
+{
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			nvlist_move_bool_array(nvl, name, array, items);
+			break;
+		case NV_TYPE_NUMBER_ARRAY:
+			nvlist_move_number_array(nvl, name, array, items);
+			break;
+		case NV_TYPE_STRING_ARRAY:
+			nvlist_move_string_array(nvl, name, array, items);
+			break;
+		case NV_TYPE_NVLIST_ARRAY:
+			nvlist_move_nvlist_array(nvl, name, array, items);
+			break;
+	}
+}
+
+static void
+patch_free_elems(int type, void *array, size_t first, size_t count)
+{
+	for (size_t i = first; i < first + count; ++i) {
+		if (type == NV_TYPE_STRING_ARRAY) {
+			echo_nv_free(((char **)array)[i]);
+		} else if (type == NV_TYPE_NVLIST_ARRAY) {
+			nvlist_destroy(((nvlist_t **)array)[i]);
+		}
+	}
+}
+
+/*
+ * Move the pair srcname out of src and add it to dst as name.
+ */
+static void
+patch_move(nvlist_t *dst, const char *name, nvlist_t *src, const char *srcname,
+    int type)
+{
+	size_t size = 0;
+	void *data = NULL;
+
+	switch (type) {
+		case NV_TYPE_NULL:
+			nvlist_add_null(dst, name);
+			break;
+		case NV_TYPE_BOOL:
+			nvlist_add_bool(dst, name, nvlist_get_bool(src, srcname));
+			break;
+		case NV_TYPE_NUMBER:
+			nvlist_add_number(dst, name, nvlist_get_number(src, srcname));
+			break;
+		case NV_TYPE_STRING:
+			nvlist_move_string(dst, name, nvlist_take_string(src, srcname));
+			break;
+		case NV_TYPE_NVLIST:
+			nvlist_move_nvlist(dst, name, nvlist_take_nvlist(src, srcname));
+			break;
+		case NV_TYPE_BINARY:
+			data = nvlist_take_binary(src, srcname, &size);
+			nvlist_move_binary(dst, name, data, size);
+			break;
+		default:
+			data = patch_take_array(src, srcname, type, &size);
+			patch_move_array(dst, name, type, data, size);
+			break;
+	}
+}
+
+static int
+patch_splice(nvlist_t *parent, const struct echo_path_ref *ref, nvlist_t *op,
+    bool apply)
+{
+	uint8_t *old = NULL, *insert = NULL, *array = NULL;
+	size_t elem = patch_elem_size(ref->epr_type);
+	size_t items = 0, ninsert = 0, count = 0;
+	uint64_t index = 0, remove = 0;
+	int type = NV_TYPE_NONE;
+
+	if (ref->epr_type == NV_TYPE_NONE) {
+		return ENOENT;
+	}
+	if (elem == 0 || !nvlist_exists_number(op, ECHO_PATCH_INDEX) ||
+	    !nvlist_exists_number(op, ECHO_PATCH_COUNT)) {
+		return EINVAL;
+	}
+	type = echo_nv_type(op, ECHO_PATCH_VALUE);
+	if (type != NV_TYPE_NONE && type != ref->epr_type) {
+		return EINVAL;
+	}
+	index = nvlist_get_number(op, ECHO_PATCH_INDEX);
+	remove = nvlist_get_number(op, ECHO_PATCH_COUNT);
+	items = patch_array_items(parent, ref->epr_name, ref->epr_type);
+	if (index > items || remove > items - index) {
+		return EINVAL;
+	}
+	if (!apply) {
+		return 0;
+	}
+
+	old = patch_take_array(parent, ref->epr_name, ref->epr_type, &items);
+	if (type != NV_TYPE_NONE) {
+		insert = patch_take_array(op, ECHO_PATCH_VALUE, type, &ninsert);
+	}
+	count = items - remove + ninsert;
+	if (count > 0) {
+		array = echo_nv_malloc(count * elem);
+		if (array == NULL) {
+			patch_move_array(parent, ref->epr_name, ref->epr_type, old, items);
+			patch_free_elems(type, insert, 0, ninsert);
+			echo_nv_free(insert);
+			return ENOMEM;
+		}
+		memcpy(array, old, index * elem);
+		if (ninsert > 0) {
+			memcpy(array + index * elem, insert, ninsert * elem);
+		}
+		memcpy(array + (index + ninsert) * elem, old + (index + remove) * elem,
+		    (items - index - remove) * elem);
+	}
+	patch_free_elems(ref->epr_type, old, index, remove);
+	echo_nv_free(old);
+	echo_nv_free(insert);
+	if (count > 0) {
+		patch_move_array(parent, ref->epr_name, ref->epr_type, array, count);
+	}
+	return 0;
+}
+
+/*
+ * The path of op, or NULL if op is not well formed.
+ */
+const char *
+echo_patch_path(const nvlist_t *op)
+{
+	if (!nvlist_exists_number(op, ECHO_PATCH_OP) ||
+	    !nvlist_exists_string(op, ECHO_PATCH_PATH)) {
+		return NULL;
+	}
+	return nvlist_get_string(op, ECHO_PATCH_PATH);
+}
+
+/*
+ * Apply op to the key at path below nvl, or only check that it would apply
+ * if apply is false.  The path is passed separately so a caller can apply an
+ * op to the part of a config the rest of its path leads to.
+ */
+int
+echo_patch_op(nvlist_t *nvl, const char *path, nvlist_t *op, bool apply)
+{
+	struct echo_path_ref ref = {0};
+	nvlist_t *parent = NULL;
+	int type = NV_TYPE_NONE;
+	int error = 0;
+
+	error = echo_path_resolve(nvl, path, &ref);
+	if (error) {
+		return error;
+	}
+	if (ref.epr_indexed) {
+		echo_path_release(&ref);
+		return EINVAL;
+	}
+	parent = __DECONST(nvlist_t *, ref.epr_parent);
+	switch (nvlist_get_number(op, ECHO_PATCH_OP)) {
+		case ECHO_PATCH_SET:
+			type = echo_nv_type(op, ECHO_PATCH_VALUE);
+			if (type == NV_TYPE_NONE || type == NV_TYPE_DESCRIPTOR ||
+			    type == NV_TYPE_DESCRIPTOR_ARRAY) {
+				error = EINVAL;
+				break;
+			}
+			if (!apply) {
+				break;
+			}
+			if (ref.epr_type != NV_TYPE_NONE) {
+				nvlist_free(parent, ref.epr_name);
+			}
+			patch_move(parent, ref.epr_name, op, ECHO_PATCH_VALUE, type);
+			break;
+		case ECHO_PATCH_REMOVE:
+			if (ref.epr_type == NV_TYPE_NONE) {
+				error = ENOENT;
+				break;
+			}
+			if (apply) {
+				nvlist_free(parent, ref.epr_name);
+			}
+			break;
+		case ECHO_PATCH_SPLICE:
+			error = patch_splice(parent, &ref, op, apply);
+			break;
+		default:
+			error = EINVAL;
+			break;
+	}
+	if (error == 0 && apply) {
+		error = nvlist_error(parent);
+	}
+	echo_path_release(&ref);
+	return error;
+}
+
+/*
+ * Apply patch to nvl in place.  Every op is checked against the config as it
+ * was before the patch so a bad patch is normally rejected before anything
+ * changes; ops are re-validated as they are applied, so a patch whose ops
+ * depend on each other fails safely but may leave earlier ops applied.
+ * Values are moved out of patch rather than copied.
+ */
+int
+echo_patch_apply(nvlist_t *nvl, nvlist_t *patch)
+{
+	const nvlist_t * const *ops = NULL;
+	const char *path = NULL;
+	size_t nops = 0;
+	int error = 0;
+
+	error = nvlist_error(patch);
+	if (error) {
+		return error;
+	}
+	if (!nvlist_exists_nvlist_array(patch, ECHO_PATCH_OPS)) {
+		return nvlist_exists(patch, ECHO_PATCH_OPS) ? EINVAL : 0;
+	}
+	ops = nvlist_get_nvlist_array(patch, ECHO_PATCH_OPS, &nops);
+	for (size_t i = 0; i < nops; ++i) {
+		path = echo_patch_path(ops[i]);
+		if (path == NULL) {
+			return EINVAL;
+		}
+		error = echo_patch_op(nvl, path, __DECONST(nvlist_t *, ops[i]),
+		    false);
+		if (error) {
+			return error;
+		}
+	}
+	for (size_t i = 0; i < nops; ++i) {
+		error = echo_patch_op(nvl, echo_patch_path(ops[i]),
+		    __DECONST(nvlist_t *, ops[i]), true);
+		if (error) {
+			return error;
+		}
+	}
+	return nvlist_error(nvl);
+}
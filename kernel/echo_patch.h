@@ -0,0 +1,31 @@
+/*
+ * Config patches.  A patch is an nvlist whose "ops" nvlist array holds the
+ * operations to apply, in order.  Every op has an "op" number and the
+ * "path" (see echo_path.h) of the key it applies to:
+ *
+ *	ECHO_PATCH_SET		add or replace the key with the op's "value"
+ *	ECHO_PATCH_REMOVE	remove the key
+ *	ECHO_PATCH_SPLICE	remove "remove" elements of the array at "index"
+ *				and insert the elements of the optional "value"
+ *				array of the same type in their place
+ */
+#ifndef _ECHO_PATCH_H_
+#define _ECHO_PATCH_H_
+
+#define ECHO_PATCH_OPS		"ops"
+#define ECHO_PATCH_OP		"op"
+#define ECHO_PATCH_PATH		"path"
+#define ECHO_PATCH_VALUE	"value"
+#define ECHO_PATCH_INDEX	"index"
+#define ECHO_PATCH_COUNT	"remove"
+
+#define ECHO_PATCH_SET		1
+#define ECHO_PATCH_REMOVE	2
+#define ECHO_PATCH_SPLICE	3
+
+int	echo_patch_apply(nvlist_t *nvl, nvlist_t *patch);
+const char	*echo_patch_path(const nvlist_t *op);
+int	echo_patch_op(nvlist_t *nvl, const char *path, nvlist_t *op,
+	    bool apply);
+
+#endif /* !_ECHO_PATCH_H_ */
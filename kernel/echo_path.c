@@ -0,0 +1,235 @@
+#include "echo_compat.h"
+
+#include "echo_path.h"
+
+int
+echo_nv_type(const nvlist_t *nvl, const char *name)
+{
+	for (int type = NV_TYPE_NULL; type <= NV_TYPE_DESCRIPTOR_ARRAY; ++type) {
+		if (nvlist_exists_type(nvl, name, type)) {
+			return type;
+		}
+	}
+	return NV_TYPE_NONE;
+}
+
+/*
+ * Copy the next component of *pathp into key, which must have room for the
+ * rest of the path, and advance *pathp past it and its trailing separator.
+ */
+int
+echo_path_next(const char **pathp, char *key, bool *indexedp, size_t *indexp)
+{
+	const char *path = *pathp;
+	size_t index = 0;
+	char *start = key;
+
+	while (*path != '\0' && *path != '.' && *path != '[') {
+		if (*path == '\\') {
+			++path;
+			if (*path == '\0') {
+				return EINVAL;
+			}
+		} else if (*path == ']') {
+			return EINVAL;
+		}
+		*key++ = *path++;
+	}
+	*key = '\0';
+	if (key == start) {
+		return EINVAL;
+	}
+	*indexedp = false;
+	if (*path == '[') {
+		++path;
+		if (*path < '0' || *path > '9') {
+			return EINVAL;
+		}
+		while (*path >= '0' && *path <= '9') {
+			if (index > (SIZE_MAX - 9) / 10) {
+				return EINVAL;
+			}
+			index = index * 10 + (*path++ - '0');
+		}
+		if (*path++ != ']') {
+			return EINVAL;
+		}
+		*indexedp = true;
+		*indexp = index;
+	}
+	if (*path == '.') {
+		++path;
+		if (*path == '\0') {
+			return EINVAL;
+		}
+	} else if (*path != '\0') {
+		return EINVAL;
+	}
+	*pathp = path;
+	return 0;
+}
+
+/*
+ * Walk every component but the last one, which is looked up in the nvlist
+ * it would live in.  Only the intermediate components have to exist.
+ */
+int
+echo_path_resolve(const nvlist_t *root, const char *path,
+    struct echo_path_ref *ref)
+{
+	const nvlist_t *nvl = root;
+	const nvlist_t * const *array = NULL;
+	bool indexed = false;
+	size_t index = 0, items = 0;
+	char *key = NULL;
+	int error = 0;
+
+	memset(ref, 0, sizeof(*ref));
+	key = echo_malloc(strlen(path) + 1);
+	if (key == NULL) {
+		return ENOMEM;
+	}
+	ref->epr_buf = key;
+	for (;;) {
+		error = echo_path_next(&path, key, &indexed, &index);
+		if (error) {
+			goto fail;
+		}
+		if (*path == '\0') {
+			break;
+		}
+		if (indexed) {
+			if (!nvlist_exists_nvlist_array(nvl, key)) {
+				error = ENOENT;
+				goto fail;
+			}
+			array = nvlist_get_nvlist_array(nvl, key, &items);
+			if (index >= items) {
+				error = ENOENT;
+				goto fail;
+			}
+			nvl = array[index];
+		} else {
+			if (!nvlist_exists_nvlist(nvl, key)) {
+				error = ENOENT;
+				goto fail;
+			}
+			nvl = nvlist_get_nvlist(nvl, key);
+		}
+	}
+	ref->epr_parent = nvl;
+	ref->epr_name = key;
+	ref->epr_type = echo_nv_type(nvl, key);
+	ref->epr_indexed = indexed;
+	ref->epr_index = index;
+	if (indexed) {
+		switch (ref->epr_type) {
+			case NV_TYPE_BOOL_ARRAY:
+				nvlist_get_bool_array(nvl, key, &items);
+				break;
+			case NV_TYPE_NUMBER_ARRAY:
+				nvlist_get_number_array(nvl, key, &items);
+				break;
+			case NV_TYPE_STRING_ARRAY:
+				nvlist_get_string_array(nvl, key, &items);
+				break;
+			case NV_TYPE_NVLIST_ARRAY:
+				nvlist_get_nvlist_array(nvl, key, &items);
+				break;
+			default:
+				items = 0;
+				break;
+		}
+		if (index >= items) {
+			error = ENOENT;
+			goto fail;
+		}
+	}
+	return 0;
+fail:
+	echo_path_release(ref);
+	return error;
+}
+
+void
+echo_path_release(struct echo_path_ref *ref)
+{
+	echo_free(ref->epr_buf);
+	memset(ref, 0, sizeof(*ref));
+}
+
+/*
+ * Add a copy of the value ref points at to dst, under the last key of the
+ * path.  An indexed path copies the array element as a single value.
+ */
+int
+echo_path_copy(const struct echo_path_ref *ref, nvlist_t *dst)
+{
+	const nvlist_t *nvl = ref->epr_parent;
+	const char *name = ref->epr_name;
+	const bool *bools = NULL;
+	const uint64_t *numbers = NULL;
+	const char * const *strings = NULL;
+	const nvlist_t * const *nvls = NULL;
+	const void *data = NULL;
+	size_t items = 0;
+
+	switch (ref->epr_type) {
+		case NV_TYPE_NONE:
+			return ENOENT;
+		case NV_TYPE_NULL:
+			nvlist_add_null(dst, name);
+			break;
+		case NV_TYPE_BOOL:
+			nvlist_add_bool(dst, name, nvlist_get_bool(nvl, name));
+			break;
+		case NV_TYPE_NUMBER:
+			nvlist_add_number(dst, name, nvlist_get_number(nvl, name));
+			break;
+		case NV_TYPE_STRING:
+			nvlist_add_string(dst, name, nvlist_get_string(nvl, name));
+			break;
+		case NV_TYPE_NVLIST:
+			nvlist_add_nvlist(dst, name, nvlist_get_nvlist(nvl, name));
+			break;
+		case NV_TYPE_BINARY:
+			data = nvlist_get_binary(nvl, name, &items);
+			nvlist_add_binary(dst, name, data, items);
+			break;
+		case NV_TYPE_BOOL_ARRAY:
+			bools = nvlist_get_bool_array(nvl, name, &items);
+			if (ref->epr_indexed) {
+				nvlist_add_bool(dst, name, bools[ref->epr_index]);
+			} else {
+				nvlist_add_bool_array(dst, name, bools, items);
+			}
+			break;
+		case NV_TYPE_NUMBER_ARRAY:
+			numbers = nvlist_get_number_array(nvl, name, &items);
+			if (ref->epr_indexed) {
+				nvlist_add_number(dst, name, numbers[ref->epr_index]);
+			} else {
+				nvlist_add_number_array(dst, name, numbers, items);
+			}
+			break;
+		case NV_TYPE_STRING_ARRAY:
+			strings = nvlist_get_string_array(nvl, name, &items);
+			if (ref->epr_indexed) {
+				nvlist_add_string(dst, name, strings[ref->epr_index]);
+			} else {
+				nvlist_add_string_array(dst, name, strings, items);
+			}
+			break;
+		case NV_TYPE_NVLIST_ARRAY:
+			nvls = nvlist_get_nvlist_array(nvl, name, &items);
+			if (ref->epr_indexed) {
+				nvlist_add_nvlist(dst, name, nvls[ref->epr_index]);
+			} else {
+				nvlist_add_nvlist_array(dst, name, nvls, items);
+			}
+			break;
+		default:
+			return EINVAL;
+	}
+	return nvlist_error(dst);
+}
@@ -0,0 +1,26 @@
+/*
+ * Dotted config paths such as "jail0.interface[1].destroy".  Components are
+ * separated by '.', an nvlist array element is selected with "[n]" and a
+ * backslash escapes '.', '[', ']' or '\' inside a key name.
+ */
+#ifndef _ECHO_PATH_H_
+#define _ECHO_PATH_H_
+
+struct echo_path_ref {
+	const nvlist_t	*epr_parent;	/* nvlist holding the last key */
+	const char	*epr_name;	/* last key */
+	int		 epr_type;	/* its NV_TYPE_*, NV_TYPE_NONE if absent */
+	bool		 epr_indexed;	/* path ends in "[n]" */
+	size_t		 epr_index;
+	char		*epr_buf;
+};
+
+int	echo_path_next(const char **pathp, char *key, bool *indexedp,
+	    size_t *indexp);
+int	echo_path_resolve(const nvlist_t *root, const char *path,
+	    struct echo_path_ref *ref);
+void	echo_path_release(struct echo_path_ref *ref);
+int	echo_path_copy(const struct echo_path_ref *ref, nvlist_t *dst);
+int	echo_nv_type(const nvlist_t *nvl, const char *name);
+
+#endif /* !_ECHO_PATH_H_ */
@@ -0,0 +1,448 @@
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+
+static int
+proto_copyin(const void *ubuf, size_t len, void **bufp)
+{
+	void *buf = NULL;
+	int error = 0;
+
+	if (len > echo_maxsize) {
+		return EFBIG;
+	}
+	buf = echo_malloc(len);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	error = echo_copyin(ubuf, buf, len);
+	if (error) {
+		echo_free(buf);
+		return error;
+	}
+	*bufp = buf;
+	return 0;
+}
+
+/*
+ * Copy len bytes out to a user buffer of capacity *ulenp, or only report the
+ * size if ubuf is NULL.  The size is reported when the buffer is too small
+ * too, for callers that get it back along with the error.
+ */
+static int
+proto_copyout(const void *buf, size_t len, void *ubuf, size_t *ulenp)
+{
+	int error = 0;
+
+	if (ubuf != NULL) {
+		if (*ulenp < len) {
+			*ulenp = len;
+			return ERANGE;
+		}
+		error = echo_copyout(buf, ubuf, len);
+	}
+	if (error == 0) {
+		*ulenp = len;
+	}
+	return error;
+}
+
+/*
+ * Acquire the current snapshot of namespace name, or of st if name is empty.
+ */
+static int
+proto_acquire(struct echo_store *st, struct echo_nstab *tab, const char *name,
+    struct echo_snap **snapp)
+{
+	struct echo_ns *ns = NULL;
+	struct echo_snap *snap = NULL;
+	int error = 0;
+
+	if (name[0] == '\0') {
+		snap = echo_store_acquire(st);
+	} else {
+		error = echo_nstab_lookup(tab, name, &ns);
+		if (error) {
+			return error;
+		}
+		snap = echo_store_acquire(&ns->en_store);
+		echo_ns_release(ns);
+	}
+	if (snap == NULL) {
+		return ENOENT;
+	}
+	*snapp = snap;
+	return 0;
+}
+
+static int
+proto_get(struct echo_store *st, struct echo_nstab *tab, const char *name,
+    void *ubuf, size_t *ulenp)
+{
+	struct echo_snap *snap = NULL;
+	int error = 0;
+
+	error = proto_acquire(st, tab, name, &snap);
+	if (error) {
+		return error;
+	}
+	error = echo_snap_pack(snap);
+	if (error == 0) {
+		error = proto_copyout(snap->es_buf, snap->es_len, ubuf, ulenp);
+	}
+	echo_snap_release(snap);
+	return error;
+}
+
+/*
+ * The outcome of the copy goes in get->error so the sizes reach the caller
+ * along with it; only failing to find the config fails the call.
+ */
+static int
+proto_getbuf(struct echo_store *st, struct echo_nstab *tab, nvecho_get_t *get)
+{
+	struct echo_snap *snap = NULL;
+	uint64_t have = get->gen;
+	int error = 0;
+
+	if (memchr(get->ns, '\0', sizeof(get->ns)) == NULL) {
+		return EINVAL;
+	}
+	error = proto_acquire(st, tab, get->ns, &snap);
+	if (error) {
+		return error;
+	}
+	error = echo_snap_pack(snap);
+	if (error) {
+		echo_snap_release(snap);
+		return error;
+	}
+	get->len = snap->es_len;
+	get->gen = snap->es_gen;
+	get->error = 0;
+	if (have != 0 && have == snap->es_gen) {
+		get->error = EALREADY;
+	} else if (get->buf == NULL || get->cap < snap->es_len) {
+		get->error = ERANGE;
+	} else {
+		error = echo_copyout(snap->es_buf, get->buf, snap->es_len);
+	}
+	echo_snap_release(snap);
+	return error;
+}
+
+static int
+proto_set(struct echo_store *st, struct echo_nstab *tab, const char *name,
+    const void *ubuf, size_t len)
+{
+	void *buf = NULL;
+	int error = 0;
+
+	error = proto_copyin(ubuf, len, &buf);
+	if (error) {
+		return error;
+	}
+	if (name[0] == '\0') {
+		error = echo_store_set(st, buf, len);
+	} else {
+		error = echo_nstab_set(tab, name, buf, len);
+	}
+	echo_free(buf);
+	return error;
+}
+
+static int
+proto_query(struct echo_store *st, struct echo_nstab *tab, const char *name,
+    const char *upath, size_t pathlen, void *ubuf, size_t *ulenp)
+{
+	struct echo_snap *snap = NULL;
+	char *path = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+	int error = 0;
+
+	if (pathlen == 0 || pathlen >= ECHO_PATHMAX) {
+		return EINVAL;
+	}
+	path = echo_malloc(pathlen + 1);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	error = echo_copyin(upath, path, pathlen);
+	if (error) {
+		goto out;
+	}
+	if (strlen(path) != pathlen) {
+		error = EINVAL;
+		goto out;
+	}
+	error = proto_acquire(st, tab, name, &snap);
+	if (error) {
+		goto out;
+	}
+	error = echo_snap_query(snap, path, &buf, &len);
+	echo_snap_release(snap);
+	if (error == 0) {
+		error = proto_copyout(buf, len, ubuf, ulenp);
+		echo_nv_free(buf);
+	}
+out:
+	echo_free(path);
+	return error;
+}
+
+static int
+proto_op(struct echo_store *st, struct echo_nstab *tab, nvecho_op_t *op)
+{
+	if (memchr(op->ns, '\0', sizeof(op->ns)) == NULL) {
+		return EINVAL;
+	}
+	switch (op->op) {
+		case ECHO_OP_GET:
+			return proto_get(st, tab, op->ns, op->buf, &op->len);
+		case ECHO_OP_SET:
+			return proto_set(st, tab, op->ns, op->buf, op->len);
+		case ECHO_OP_QUERY:
+			return proto_query(st, tab, op->ns, op->path, op->pathlen,
+			    op->buf, &op->len);
+		case ECHO_OP_DEL:
+			return echo_nstab_delete(tab, op->ns);
+		default:
+			return EINVAL;
+	}
+}
+
+/*
+ * Run the ops in order.  A failing op does not stop the ones after it.
+ */
+static int
+proto_batch(struct echo_store *st, struct echo_nstab *tab,
+    const nvecho_batch_t *batch)
+{
+	nvecho_op_t *ops = NULL;
+	size_t i = 0;
+	int error = 0;
+
+	if (batch->count == 0 || batch->count > ECHO_BATCHMAX) {
+		return EINVAL;
+	}
+	error = proto_copyin(batch->ops, batch->count * sizeof(*ops),
+	    (void **)&ops);
+	if (error) {
+		return error;
+	}
+	for (i = 0; i < batch->count; ++i) {
+		ops[i].error = proto_op(st, tab, &ops[i]);
+	}
+	error = echo_copyout(ops, batch->ops, batch->count * sizeof(*ops));
+	echo_free(ops);
+	return error;
+}
+
+/*
+ * History requests on namespace name, or on st if name is empty.  A buffer
+ * too small only sets hist->error, so the size needed reaches the caller.
+ */
+static int
+proto_history(struct echo_store *st, struct echo_nstab *tab,
+    nvecho_history_t *hist)
+{
+	struct echo_ns *ns = NULL;
+	nvlist_t *nvl = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+	int error = 0;
+
+	if (memchr(hist->ns, '\0', sizeof(hist->ns)) == NULL) {
+		return EINVAL;
+	}
+	hist->error = 0;
+	if (hist->ns[0] != '\0') {
+		error = echo_nstab_lookup(tab, hist->ns, &ns);
+		if (error) {
+			return error;
+		}
+		st = &ns->en_store;
+	}
+	switch (hist->op) {
+		case ECHO_HISTORY_LIST:
+			nvl = echo_store_history(st);
+			if (nvl == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			buf = nvlist_pack(nvl, &len);
+			if (buf == NULL) {
+				error = nvlist_error(nvl);
+				error = error ? error : EINVAL;
+			}
+			nvlist_destroy(nvl);
+			break;
+		case ECHO_HISTORY_GET:
+			error = echo_store_version(st, hist->gen, &buf, &len);
+			break;
+		case ECHO_HISTORY_ROLLBACK:
+			error = echo_store_rollback(st, hist->gen);
+			break;
+		default:
+			error = EINVAL;
+			break;
+	}
+	if (error == 0 && buf != NULL) {
+		error = proto_copyout(buf, len, hist->buf, &hist->len);
+		if (error == ERANGE) {
+			hist->error = error;
+			error = 0;
+		}
+	}
+	echo_nv_free(buf);
+	echo_ns_release(ns);
+	return error;
+}
+
+void
+echo_file_init(struct echo_file *fp)
+{
+	memset(fp, 0, sizeof(*fp));
+	echo_upload_init(&fp->ef_upload);
+	fp->ef_seen = echo_core_gen();
+}
+
+void
+echo_file_fini(struct echo_file *fp)
+{
+	echo_upload_fini(&fp->ef_upload);
+}
+
+/*
+ * ECHO_IOCTL gets the config size when buf is NULL, copies the config out
+ * when len is 0 and sets it otherwise.  Gets are served from the cached
+ * packed snapshot.  The ECHO_IOCTL_NS* commands work on one namespace of tab
+ * and ECHO_IOCTL_QUERY on either.  ECHO_IOCTL_BATCH runs several of those
+ * and ECHO_IOCTL_UPLOAD drives the upload session of the caller's file.
+ * ECHO_IOCTL_HISTORY lists, gets and rolls back to past versions.
+ * ECHO_IOCTL_GET gets either config in a single call when the caller's
+ * buffer is large enough, and ECHO_IOCTL_PATCHGEN only patches the
+ * generation the patch was made against.
+ */
+int
+echo_proto_ioctl(struct echo_store *st, struct echo_nstab *tab,
+    struct echo_file *fp, u_long cmd, void *data)
+{
+	nvecho_t *udata = (nvecho_t *)data;
+	nvecho_ns_t *nsdata = (nvecho_ns_t *)data;
+	nvecho_query_t *query = (nvecho_query_t *)data;
+	nvecho_batch_t *batch = (nvecho_batch_t *)data;
+	nvecho_upload_t *upload = (nvecho_upload_t *)data;
+	nvecho_wait_t *wait = (nvecho_wait_t *)data;
+	nvecho_history_t *hist = (nvecho_history_t *)data;
+	nvecho_get_t *get = (nvecho_get_t *)data;
+	nvecho_patch_t *patch = (nvecho_patch_t *)data;
+	struct echo_snap *snap = NULL;
+	void *buf = NULL;
+	int error = 0;
+
+	switch (cmd) {
+		case ECHO_IOCTL:
+			if (udata->buf == NULL) {
+				snap = echo_store_acquire(st);
+				if (snap == NULL) {
+					udata->len = 0;
+					return ENOMEM;
+				}
+				error = echo_snap_pack(snap);
+				udata->len = error == 0 ? snap->es_len : 0;
+				echo_snap_release(snap);
+			} else if (udata->len == 0) {
+				snap = echo_store_acquire(st);
+				if (snap == NULL) {
+					return ENOMEM;
+				}
+				error = echo_snap_pack(snap);
+				if (error == 0) {
+					error = echo_copyout(snap->es_buf, udata->buf,
+					    snap->es_len);
+				}
+				if (error == 0) {
+					udata->len = snap->es_len;
+				}
+				echo_snap_release(snap);
+			} else {
+				error = proto_copyin(udata->buf, udata->len, &buf);
+				if (error) {
+					return error;
+				}
+				error = echo_store_set(st, buf, udata->len);
+				echo_free(buf);
+			}
+			break;
+		case ECHO_IOCTL_PATCH:
+			error = proto_copyin(udata->buf, udata->len, &buf);
+			if (error) {
+				return error;
+			}
+			error = echo_store_patch(st, buf, udata->len, 0, NULL);
+			echo_free(buf);
+			break;
+		case ECHO_IOCTL_PATCHGEN:
+			error = proto_copyin(patch->buf, patch->len, &buf);
+			if (error) {
+				return error;
+			}
+			error = echo_store_patch(st, buf, patch->len, patch->base,
+			    &patch->gen);
+			echo_free(buf);
+			break;
+		case ECHO_IOCTL_NSGET:
+			if (nsdata->name[0] == '\0') {
+				return EINVAL;
+			}
+			error = proto_get(st, tab, nsdata->name, nsdata->buf, &nsdata->len);
+			break;
+		case ECHO_IOCTL_NSSET:
+			if (nsdata->name[0] == '\0') {
+				return EINVAL;
+			}
+			error = proto_set(st, tab, nsdata->name, nsdata->buf, nsdata->len);
+			break;
+		case ECHO_IOCTL_NSDEL:
+			error = echo_nstab_delete(tab, nsdata->name);
+			break;
+		case ECHO_IOCTL_QUERY:
+			if (memchr(query->ns, '\0', sizeof(query->ns)) == NULL) {
+				return EINVAL;
+			}
+			error = proto_query(st, tab, query->ns, query->path,
+			    query->pathlen, query->buf, &query->len);
+			break;
+		case ECHO_IOCTL_BATCH:
+			error = proto_batch(st, tab, batch);
+			break;
+		case ECHO_IOCTL_UPLOAD:
+			error = echo_upload_ioctl(&fp->ef_upload, st, tab, upload);
+			break;
+		case ECHO_IOCTL_GEN:
+			fp->ef_seen = echo_core_gen();
+			*(uint64_t *)data = fp->ef_seen;
+			break;
+		case ECHO_IOCTL_WAIT:
+			error = echo_core_wait(wait->gen, wait->timeout, &wait->gen);
+			if (error == 0) {
+				fp->ef_seen = wait->gen;
+			}
+			break;
+		case ECHO_IOCTL_HISTORY:
+			error = proto_history(st, tab, hist);
+			break;
+		case ECHO_IOCTL_GET:
+			error = proto_getbuf(st, tab, get);
+			break;
+		default:
+			error = ENOTTY;
+			break;
+	}
+	return error;
+}
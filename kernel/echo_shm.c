@@ -0,0 +1,187 @@
+#include "echo_compat.h"
+
+#ifndef _KERNEL
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "echo_shm.h"
+
+/*
+ * Reads give up with EBUSY if the producer does not finish an update within
+ * this many tries, which is also what they do forever once it has died
+ * mid-update.
+ */
+#define ECHO_SHM_RETRIES	4096
+
+_Static_assert(sizeof(struct echo_shm_hdr) <= ECHO_SHM_HDRSIZE,
+    "echo_shm_hdr does not fit ECHO_SHM_HDRSIZE");
+
+/*
+ * FNV-1a over 64 bit words, with the tail bytes folded in one by one.
+ */
+uint64_t
+echo_shm_cksum(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t hash = 0xcbf29ce484222325ULL, word = 0;
+
+	for (; len >= sizeof(word); p += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for (; len > 0; ++p, --len) {
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Lay out an empty region of size bytes, header included.
+ */
+int
+echo_shm_init(void *region, size_t size)
+{
+	struct echo_shm_hdr *hdr = region;
+
+	if (size < ECHO_SHM_HDRSIZE) {
+		return EINVAL;
+	}
+	memset(hdr, 0, ECHO_SHM_HDRSIZE);
+	hdr->esh_magic = ECHO_SHM_MAGIC;
+	hdr->esh_version = ECHO_SHM_VERSION;
+	hdr->esh_size = size - ECHO_SHM_HDRSIZE;
+	hdr->esh_cksum = echo_shm_cksum(NULL, 0);
+	return 0;
+}
+
+int
+echo_shm_publish(struct echo_shm_hdr *hdr, const void *buf, size_t len,
+    uint64_t gen)
+{
+	/* Odd already if a previous producer died mid-update. */
+	uint64_t seq = hdr->esh_seq | 1;
+
+	if (len > hdr->esh_size) {
+		return ENOSPC;
+	}
+	echo_store_rel_64(&hdr->esh_seq, seq);
+	echo_fence_rel();
+	memcpy(ECHO_SHM_DATA(hdr), buf, len);
+	hdr->esh_gen = gen;
+	hdr->esh_len = len;
+	hdr->esh_cksum = echo_shm_cksum(buf, len);
+	echo_store_rel_64(&hdr->esh_seq, seq + 1);
+	return 0;
+}
+
+/*
+ * Copy the current data into buf, which holds *lenp bytes.  On ERANGE *lenp
+ * is set to the size needed, which may have changed again by the next try.
+ */
+int
+echo_shm_read(const struct echo_shm_hdr *hdr, void *buf, size_t *lenp,
+    uint64_t *genp)
+{
+	uint64_t seq = 0, gen = 0, len = 0, cksum = 0;
+	int retries = 0;
+
+	if (hdr->esh_magic != ECHO_SHM_MAGIC ||
+	    hdr->esh_version != ECHO_SHM_VERSION) {
+		return EINVAL;
+	}
+	for (retries = 0; retries < ECHO_SHM_RETRIES; ++retries) {
+		seq = echo_load_acq_64(&hdr->esh_seq);
+		if (seq & 1) {
+			echo_spinwait();
+			continue;
+		}
+		gen = hdr->esh_gen;
+		len = hdr->esh_len;
+		cksum = hdr->esh_cksum;
+		if (len > hdr->esh_size) {
+			len = 0;
+		} else if (len <= *lenp) {
+			memcpy(buf, ECHO_SHM_DATA(hdr), len);
+		}
+		echo_fence_acq();
+		if (echo_load_acq_64(&hdr->esh_seq) != seq) {
+			continue;
+		}
+		if (len > *lenp) {
+			*lenp = len;
+			return ERANGE;
+		}
+		if (echo_shm_cksum(buf, len) != cksum) {
+			return EIO;
+		}
+		*lenp = len;
+		*genp = gen;
+		return 0;
+	}
+	return EBUSY;
+}
+
+#ifndef _KERNEL
+/*
+ * Map the POSIX shared memory object name.  The producer creates it with a
+ * data area of size bytes; consumers pass 0 and get a read-only mapping.
+ */
+int
+echo_shm_map(const char *name, size_t size, bool create,
+    struct echo_shm_hdr **hdrp)
+{
+	struct stat st = {0};
+	void *region = NULL;
+	int fd = -1, error = 0;
+
+	fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0) {
+		return errno;
+	}
+	if (create) {
+		size += ECHO_SHM_HDRSIZE;
+		if (ftruncate(fd, size) != 0) {
+			error = errno;
+			goto out;
+		}
+	} else {
+		if (fstat(fd, &st) != 0) {
+			error = errno;
+			goto out;
+		}
+		size = st.st_size;
+		if (size < ECHO_SHM_HDRSIZE) {
+			error = EINVAL;
+			goto out;
+		}
+	}
+	region = mmap(NULL, size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+	    MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED) {
+		error = errno;
+		goto out;
+	}
+	if (create) {
+		echo_shm_init(region, size);
+	} else if (((struct echo_shm_hdr *)region)->esh_size !=
+	    size - ECHO_SHM_HDRSIZE) {
+		munmap(region, size);
+		error = EINVAL;
+		goto out;
+	}
+	*hdrp = region;
+out:
+	close(fd);
+	return error;
+}
+
+void
+echo_shm_unmap(struct echo_shm_hdr *hdr)
+{
+	munmap(hdr, ECHO_SHM_HDRSIZE + hdr->esh_size);
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Shared memory publication of the packed config.  A region is a header
+ * followed by a data area of esh_size bytes holding the current packed
+ * nvlist, so readers that map it never enter the kernel.  The layout is
+ * what the module is meant to hand out through d_mmap; until it does, the
+ * code is only built in userland, where a producer and its readers share a
+ * POSIX shared memory object.
+ *
+ * The header is guarded by a sequence counter: the producer makes it odd,
+ * rewrites the header and data and makes it even again.  A reader copies the
+ * data out between two reads of an even, unchanged counter and retries
+ * otherwise.  There is one producer per region; callers serialize publishes.
+ *
+ * A producer that dies mid-update leaves the counter odd.  Every read then
+ * spends its retries and fails with EBUSY, never returning data, until a
+ * producer publishes again: a publish starts from whatever count it finds,
+ * so a new producer takes over a region left odd.  The checksum covers the
+ * data and catches a data area changed outside the protocol.
+ */
+#ifndef _ECHO_SHM_H_
+#define _ECHO_SHM_H_
+
+#define ECHO_SHM_MAGIC		0x53484345	/* "ECHS" */
+#define ECHO_SHM_VERSION	1
+#define ECHO_SHM_HDRSIZE	64
+
+struct echo_shm_hdr {
+	uint32_t	esh_magic;
+	uint32_t	esh_version;
+	uint64_t	esh_seq;	/* odd while an update is in progress */
+	uint64_t	esh_gen;
+	uint64_t	esh_len;	/* bytes of data in use */
+	uint64_t	esh_cksum;
+	uint64_t	esh_size;	/* capacity of the data area */
+};
+
+#define ECHO_SHM_DATA(hdr)	((unsigned char *)(hdr) + ECHO_SHM_HDRSIZE)
+
+uint64_t	echo_shm_cksum(const void *buf, size_t len);
+int	echo_shm_init(void *region, size_t size);
+int	echo_shm_publish(struct echo_shm_hdr *hdr, const void *buf, size_t len,
+	    uint64_t gen);
+int	echo_shm_read(const struct echo_shm_hdr *hdr, void *buf, size_t *lenp,
+	    uint64_t *genp);
+#ifndef _KERNEL
+int	echo_shm_map(const char *name, size_t size, bool create,
+	    struct echo_shm_hdr **hdrp);
+void	echo_shm_unmap(struct echo_shm_hdr *hdr);
+#endif
+
+#endif /* !_ECHO_SHM_H_ */
@@ -0,0 +1,370 @@
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_compact.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+
+#define UPLOAD_PAGE		ECHO_CHUNKMAX
+#define UPLOAD_NPAGES(size)	(((size) + UPLOAD_PAGE - 1) / UPLOAD_PAGE)
+
+/* The header of a packed nvlist, as libnv lays it out and checks it. */
+#define NVLIST_HEADER_SIZE	19
+#define NVLIST_HEADER_MAGIC	0x6c
+#define NVLIST_HEADER_VERSION	0x00
+#define NVLIST_FLAG_BIG_ENDIAN	0x80
+#define NVLIST_FLAG_MASK						\
+	(NV_FLAG_IGNORE_CASE | NV_FLAG_NO_UNIQUE | NVLIST_FLAG_BIG_ENDIAN)
+
+u_long echo_upload_budget = 256 * 1024 * 1024;
+static volatile u_long echo_upload_reserved = 0;
+
+/*
+ * Reserve size bytes of the staging budget shared by all sessions.
+ */
+static bool
+upload_reserve(size_t size)
+{
+	u_long reserved = 0;
+
+	do {
+		reserved = echo_atomic_load_long(&echo_upload_reserved);
+		if (reserved > echo_upload_budget ||
+		    size > echo_upload_budget - reserved) {
+			return false;
+		}
+	} while (!echo_atomic_cmpset_long(&echo_upload_reserved, reserved,
+	    reserved + size));
+	return true;
+}
+
+/* Called with the session lock held. */
+static void
+upload_close(struct echo_upload *up)
+{
+	if (!up->eu_open) {
+		return;
+	}
+	for (size_t i = 0; i < up->eu_npages; ++i) {
+		echo_free(up->eu_pages[i]);
+	}
+	echo_free(up->eu_pages);
+	echo_free(up->eu_check);
+	echo_atomic_subtract_long(&echo_upload_reserved, up->eu_reserved);
+	up->eu_pages = NULL;
+	up->eu_npages = 0;
+	up->eu_check = NULL;
+	up->eu_reserved = 0;
+	up->eu_size = 0;
+	up->eu_off = 0;
+	up->eu_open = false;
+}
+
+/* Allocate the next page, only as long as the blob has bytes left for. */
+static int
+upload_page(struct echo_upload *up)
+{
+	size_t size = up->eu_size - up->eu_npages * UPLOAD_PAGE;
+	void *page = NULL;
+
+	if (size > UPLOAD_PAGE) {
+		size = UPLOAD_PAGE;
+	}
+	if (!upload_reserve(size)) {
+		return ENOMEM;
+	}
+	page = echo_malloc(size);
+	if (page == NULL) {
+		echo_atomic_subtract_long(&echo_upload_reserved, size);
+		return ENOMEM;
+	}
+	up->eu_reserved += size;
+	up->eu_pages[up->eu_npages++] = page;
+	return 0;
+}
+
+/* The staged bytes from off on, up to the end of its page or of end. */
+static unsigned char *
+upload_span(const struct echo_upload *up, size_t off, size_t end,
+    size_t *lenp)
+{
+	size_t len = UPLOAD_PAGE - off % UPLOAD_PAGE;
+
+	*lenp = end - off < len ? end - off : len;
+	return (unsigned char *)up->eu_pages[off / UPLOAD_PAGE] +
+	    off % UPLOAD_PAGE;
+}
+
+static uint64_t
+upload_dec64(const unsigned char *ptr, bool big)
+{
+	uint64_t value = 0;
+
+	for (int i = 0; i < 8; ++i) {
+		value |= (uint64_t)ptr[big ? 7 - i : i] << (8 * i);
+	}
+	return value;
+}
+
+/*
+ * Check the header of a packed nvlist of size bytes the way nvlist_unpack()
+ * would: nothing follows it but the pairs it counts and no descriptors can
+ * come through an ioctl.  The pairs themselves are only checked when
+ * nvlist_unpack() gets the joined blob at commit.
+ */
+static int
+upload_check_nvlist(const unsigned char *hdr, size_t size)
+{
+	bool big = false;
+
+	if (size < NVLIST_HEADER_SIZE || hdr[0] != NVLIST_HEADER_MAGIC ||
+	    hdr[1] != NVLIST_HEADER_VERSION ||
+	    (hdr[2] & ~NVLIST_FLAG_MASK) != 0) {
+		return EINVAL;
+	}
+	big = (hdr[2] & NVLIST_FLAG_BIG_ENDIAN) != 0;
+	if (upload_dec64(hdr + 3, big) != 0 ||
+	    upload_dec64(hdr + 11, big) != size - NVLIST_HEADER_SIZE) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+void
+echo_upload_init(struct echo_upload *up)
+{
+	memset(up, 0, sizeof(*up));
+	echo_lock_init(&up->eu_lock, "echo upload");
+}
+
+void
+echo_upload_fini(struct echo_upload *up)
+{
+	echo_lock(&up->eu_lock);
+	upload_close(up);
+	echo_unlock(&up->eu_lock);
+	echo_lock_destroy(&up->eu_lock);
+}
+
+static int
+upload_begin(struct echo_upload *up, const nvecho_upload_t *udata)
+{
+	if (up->eu_open) {
+		return EBUSY;
+	}
+	if (memchr(udata->ns, '\0', sizeof(udata->ns)) == NULL ||
+	    (udata->ns[0] != '\0' && !echo_ns_name_valid(udata->ns))) {
+		return EINVAL;
+	}
+	if (udata->size == 0 || udata->size > echo_maxsize) {
+		return EFBIG;
+	}
+	up->eu_pages = echo_malloc(UPLOAD_NPAGES(udata->size) *
+	    sizeof(*up->eu_pages));
+	if (up->eu_pages == NULL) {
+		return ENOMEM;
+	}
+	memcpy(up->eu_ns, udata->ns, sizeof(up->eu_ns));
+	up->eu_hash = udata->hash;
+	up->eu_sum = ECHO_HASH_INIT;
+	up->eu_size = udata->size;
+	up->eu_off = 0;
+	up->eu_open = true;
+	return 0;
+}
+
+/*
+ * Chunks have to arrive in order, so a resent chunk is refused rather than
+ * hashed twice.  The chunk is only accepted, its hash and structure state
+ * kept, once all of it is staged and checked.
+ */
+static int
+upload_chunk(struct echo_upload *up, const nvecho_upload_t *udata)
+{
+	struct echo_compact_check *cc = NULL;
+	const char *src = udata->buf;
+	unsigned char *dst = NULL;
+	uint64_t sum = 0;
+	size_t off = 0, end = 0, len = 0;
+	bool compact = up->eu_compact;
+	int error = 0;
+
+	if (!up->eu_open) {
+		return ENOENT;
+	}
+	if (udata->off != up->eu_off || udata->len == 0 ||
+	    udata->len > ECHO_CHUNKMAX || udata->len > up->eu_size - up->eu_off) {
+		return EINVAL;
+	}
+	end = up->eu_off + udata->len;
+	while (up->eu_npages < UPLOAD_NPAGES(end)) {
+		error = upload_page(up);
+		if (error) {
+			return error;
+		}
+	}
+	for (off = up->eu_off; off < end; off += len) {
+		dst = upload_span(up, off, end, &len);
+		error = echo_copyin(src + (off - up->eu_off), dst, len);
+		if (error) {
+			return error;
+		}
+	}
+
+	if (up->eu_off == 0) {
+		compact = echo_compact_is(up->eu_pages[0], up->eu_size);
+		if (compact && up->eu_check == NULL) {
+			up->eu_check = echo_malloc(2 * sizeof(*up->eu_check));
+			if (up->eu_check == NULL) {
+				return ENOMEM;
+			}
+		}
+		if (compact) {
+			echo_compact_check_init(&up->eu_check[0], up->eu_size);
+		}
+	}
+	if (compact) {
+		cc = &up->eu_check[1];
+		*cc = up->eu_check[0];
+	}
+	sum = up->eu_sum;
+	for (off = up->eu_off; error == 0 && off < end; off += len) {
+		dst = upload_span(up, off, end, &len);
+		sum = echo_hash(sum, dst, len);
+		if (compact) {
+			error = echo_compact_check(cc, dst, len);
+		}
+	}
+	if (error == 0 && !compact && up->eu_off < NVLIST_HEADER_SIZE &&
+	    (end >= NVLIST_HEADER_SIZE || end == up->eu_size)) {
+		error = upload_check_nvlist(up->eu_pages[0], up->eu_size);
+	}
+	if (error) {
+		return error;
+	}
+	if (compact) {
+		up->eu_check[0] = *cc;
+	}
+	up->eu_compact = compact;
+	up->eu_sum = sum;
+	up->eu_off = end;
+	return 0;
+}
+
+/*
+ * A packed blob as one buffer for nvlist_unpack(): its only page, or the
+ * pages copied into a buffer that counts against the budget until the
+ * session closes.
+ */
+static int
+upload_join(struct echo_upload *up, void **bufp)
+{
+	unsigned char *buf = NULL, *page = NULL;
+	size_t len = 0;
+
+	if (up->eu_npages == 1) {
+		*bufp = up->eu_pages[0];
+		return 0;
+	}
+	if (!upload_reserve(up->eu_size)) {
+		return ENOMEM;
+	}
+	buf = echo_malloc(up->eu_size);
+	if (buf == NULL) {
+		echo_atomic_subtract_long(&echo_upload_reserved, up->eu_size);
+		return ENOMEM;
+	}
+	up->eu_reserved += up->eu_size;
+	for (size_t off = 0; off < up->eu_size; off += len) {
+		page = upload_span(up, off, up->eu_size, &len);
+		memcpy(buf + off, page, len);
+	}
+	*bufp = buf;
+	return 0;
+}
+
+/* The blob decoded, a compact one straight from its pages. */
+static int
+upload_decode(struct echo_upload *up, nvlist_t **nvlp)
+{
+	void *buf = NULL;
+	int error = 0;
+
+	if (up->eu_compact) {
+		if (!echo_compact_check_done(&up->eu_check[0])) {
+			return EINVAL;
+		}
+		return echo_compact_decode_pages(up->eu_pages, UPLOAD_PAGE,
+		    up->eu_size, nvlp);
+	}
+	error = upload_join(up, &buf);
+	if (error) {
+		return error;
+	}
+	*nvlp = nvlist_unpack(buf, up->eu_size, 0);
+	if (up->eu_npages > 1) {
+		echo_free(buf);
+	}
+	return *nvlp == NULL ? EINVAL : 0;
+}
+
+static int
+upload_commit(struct echo_upload *up, struct echo_store *st,
+    struct echo_nstab *tab)
+{
+	nvlist_t *nvl = NULL;
+	int error = 0;
+
+	if (!up->eu_open) {
+		return ENOENT;
+	}
+	if (up->eu_off != up->eu_size) {
+		return EINVAL;
+	}
+	if (up->eu_sum != up->eu_hash) {
+		error = EBADMSG;
+	} else {
+		error = upload_decode(up, &nvl);
+	}
+	if (error == 0 && up->eu_ns[0] == '\0') {
+		error = echo_store_publish(st, nvl);
+	} else if (error == 0) {
+		error = echo_nstab_publish(tab, up->eu_ns, nvl);
+	}
+	upload_close(up);
+	return error;
+}
+
+/*
+ * Drive the upload session up.  A commit ends the session whether it
+ * succeeds or not; a bad chunk leaves it open so the chunk can be resent.
+ */
+int
+echo_upload_ioctl(struct echo_upload *up, struct echo_store *st,
+    struct echo_nstab *tab, nvecho_upload_t *udata)
+{
+	int error = 0;
+
+	echo_lock(&up->eu_lock);
+	switch (udata->op) {
+		case ECHO_UPLOAD_BEGIN:
+			error = upload_begin(up, udata);
+			break;
+		case ECHO_UPLOAD_CHUNK:
+			error = upload_chunk(up, udata);
+			break;
+		case ECHO_UPLOAD_COMMIT:
+			error = upload_commit(up, st, tab);
+			break;
+		case ECHO_UPLOAD_ABORT:
+			error = up->eu_open ? 0 : ENOENT;
+			upload_close(up);
+			break;
+		default:
+			error = EINVAL;
+			break;
+	}
+	echo_unlock(&up->eu_lock);
+	return error;
+}
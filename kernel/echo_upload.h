@@ -0,0 +1,49 @@
+/*
+ * Chunked uploads.  A session is opened with the size and hash of the blob,
+ * filled with in order chunks of at most ECHO_CHUNKMAX bytes and committed,
+ * which checks the hash and sets the config like a one shot set would.
+ *
+ * Chunks are staged in pages of ECHO_CHUNKMAX bytes, allocated as the bytes
+ * for them arrive, so a session holds what was sent rather than what was
+ * announced.  Commit decodes a compact blob straight from the pages.  A
+ * packed nvlist has to be joined into one buffer for nvlist_unpack() unless
+ * it fits in one page, which doubles what such a session holds at commit.
+ * The pages and joined buffers of all open sessions together stay within
+ * echo_upload_budget bytes and a single blob within echo_maxsize.
+ *
+ * A compact blob is checked for structure byte by byte as its chunks
+ * arrive with echo_compact_check(), and a chunk that fails is refused like
+ * a misplaced one, so a bad blob is caught at the chunk that breaks it
+ * rather than at commit.  Of a packed nvlist only the header is checked
+ * early; its pairs are left to nvlist_unpack() at commit.
+ */
+#ifndef _ECHO_UPLOAD_H_
+#define _ECHO_UPLOAD_H_
+
+struct echo_compact_check;
+struct echo_nstab;
+struct echo_store;
+
+struct echo_upload {
+	echo_lock_t	 eu_lock;
+	bool		 eu_open;
+	char		 eu_ns[ECHO_NSNAMELEN];
+	uint64_t	 eu_hash;	/* expected hash of the blob */
+	uint64_t	 eu_sum;	/* hash of the chunks received */
+	size_t		 eu_size;
+	size_t		 eu_off;
+	size_t		 eu_reserved;	/* staging budget held */
+	void		**eu_pages;
+	size_t		 eu_npages;	/* pages allocated so far */
+	bool		 eu_compact;
+	struct echo_compact_check *eu_check;	/* the state and a scratch */
+};
+
+extern u_long	echo_upload_budget;
+
+void	echo_upload_init(struct echo_upload *up);
+void	echo_upload_fini(struct echo_upload *up);
+int	echo_upload_ioctl(struct echo_upload *up, struct echo_store *st,
+	    struct echo_nstab *tab, nvecho_upload_t *udata);
+
+#endif /* !_ECHO_UPLOAD_H_ */
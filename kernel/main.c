@@ -5,11 +5,20 @@
 #include <sys/sysctl.h>
 
 #include <sys/conf.h>
+#include <sys/event.h>
 #include <sys/malloc.h>
 #include <sys/nv.h>
+#include <sys/poll.h>
+#include <sys/selinfo.h>
 #include <sys/uio.h>
 #include <sys/ioccom.h>
 
+#include "echo_compat.h"
+#include "echo.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+
 #define BUFFER_SIZE 256
 MALLOC_DECLARE(M_ECHOBUF);
 MALLOC_DEFINE(M_ECHOBUF, "echobuffer", "buffer for echo module");
@@ -17,28 +26,57 @@ MALLOC_DEFINE(M_ECHOBUF, "echobuffer", "buffer for echo module");
 static d_open_t echo_open;
 static d_close_t echo_close;
 static d_ioctl_t echo_ioctl;
+static d_poll_t echo_poll;
+static d_kqfilter_t echo_kqfilter;
 static struct cdevsw echo_cdevsw = {
 	.d_version = D_VERSION,
 	.d_open = echo_open,
 	.d_close = echo_close,
 	.d_ioctl = echo_ioctl,
+	.d_poll = echo_poll,
+	.d_kqfilter = echo_kqfilter,
 	.d_name = "echo"
 };
-typedef struct nvecho {
-	void *buf;
-	size_t len;
-} nvecho_t;
 
-#define ECHO_IOCTL _IOWR('H', 1, nvecho_t)
+static void echo_kqdetach(struct knote *kn);
+static int echo_kqevent(struct knote *kn, long hint);
+static struct filterops echo_kqops = {
+	.f_isfd = 1,
+	.f_detach = echo_kqdetach,
+	.f_event = echo_kqevent
+};
 
 static struct cdev *dev = NULL;
-static nvlist_t *nvl = NULL;
+static struct echo_store store;
+static struct echo_nstab nstab;
 static struct sysctl_ctx_list clist = {0};
+static struct sysctl_oid *ns_poid = NULL;
+static struct selinfo sel;
+static struct mtx sel_mtx;
+
+/* Each open file carries its upload session and last seen generation. */
+static void
+echo_dtor(void *data)
+{
+	struct echo_file *fp = data;
+
+	echo_file_fini(fp);
+	free(fp, M_ECHOBUF);
+}
 
 static int
 echo_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
 {
-	return 0;
+	struct echo_file *fp = NULL;
+	int error = 0;
+
+	fp = malloc(sizeof(*fp), M_ECHOBUF, M_WAITOK);
+	echo_file_init(fp);
+	error = devfs_set_cdevpriv(fp, echo_dtor);
+	if (error) {
+		echo_dtor(fp);
+	}
+	return error;
 }
 
 static int
@@ -49,85 +87,214 @@ echo_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
 
 static int
 echo_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag, struct thread *td) {
+	struct echo_file *fp = NULL;
 	int error = 0;
-	nvecho_t *udata = (nvecho_t *)data;
-	nvecho_t kdata;
-
-	switch (cmd) {
-		case ECHO_IOCTL:
-			if (udata->buf == NULL) {
-				if (nvl == NULL) {
-					udata->len = 0;
-					return ENOMEM;
-				}
-				udata->len = nvlist_size(nvl);
-			} else if (udata->len == 0) {
-				if (nvl == NULL) {
-					return ENOMEM;
-				}
-				kdata.len = nvlist_size(nvl);
-				kdata.buf = nvlist_pack(nvl, &kdata.len);
-				error = copyout(kdata.buf, udata->buf, kdata.len);
-				if (error) {
-					return error;
-				}
-				udata->len = kdata.len;
-			} else {
-				kdata.len = udata->len;
-				kdata.buf = malloc(kdata.len, M_ECHOBUF, M_WAITOK);
-				error = copyin(udata->buf, kdata.buf, kdata.len);
-				if (error) {
-					free(kdata.buf, M_ECHOBUF);
-					return error;
-				}
-				if (nvl != NULL) {
-					nvlist_destroy(nvl);
-					nvl = NULL;
-				}
-				nvl = nvlist_unpack(kdata.buf, kdata.len, 0);
-				free(kdata.buf, M_ECHOBUF);
-			}
-			break;
-		default:
-			error = ENOTTY;
-			break;
+
+	error = devfs_get_cdevpriv((void **)&fp);
+	if (error) {
+		return error;
 	}
-	return error;
+	return echo_proto_ioctl(&store, &nstab, fp, cmd, data);
+}
+
+/*
+ * The device is readable once a generation newer than the last one the
+ * file was told about has been published.
+ */
+static int
+echo_poll(struct cdev *dev, int events, struct thread *td) {
+	struct echo_file *fp = NULL;
+	int revents = 0;
+
+	if (devfs_get_cdevpriv((void **)&fp) != 0) {
+		return POLLHUP;
+	}
+	if ((events & (POLLIN | POLLRDNORM)) == 0) {
+		return 0;
+	}
+	mtx_lock(&sel_mtx);
+	if (echo_core_gen() > fp->ef_seen) {
+		revents = events & (POLLIN | POLLRDNORM);
+	} else {
+		selrecord(td, &sel);
+	}
+	mtx_unlock(&sel_mtx);
+	return revents;
+}
+
+static int
+echo_kqfilter(struct cdev *dev, struct knote *kn) {
+	struct echo_file *fp = NULL;
+	int error = 0;
+
+	if (kn->kn_filter != EVFILT_READ) {
+		return EINVAL;
+	}
+	error = devfs_get_cdevpriv((void **)&fp);
+	if (error) {
+		return error;
+	}
+	kn->kn_fop = &echo_kqops;
+	kn->kn_hook = fp;
+	knlist_add(&sel.si_note, kn, 0);
+	return 0;
+}
+
+static void
+echo_kqdetach(struct knote *kn) {
+	knlist_remove(&sel.si_note, kn, 0);
+}
+
+static int
+echo_kqevent(struct knote *kn, long hint) {
+	struct echo_file *fp = kn->kn_hook;
+	uint64_t gen = echo_core_gen();
+
+	kn->kn_data = gen > fp->ef_seen ? gen - fp->ef_seen : 0;
+	return kn->kn_data > 0;
+}
+
+static void
+echo_notify(uint64_t gen) {
+	mtx_lock(&sel_mtx);
+	selwakeup(&sel);
+	KNOTE_LOCKED(&sel.si_note, 0);
+	mtx_unlock(&sel_mtx);
+}
+
+static int
+echo_gen_sysctl(SYSCTL_HANDLER_ARGS) {
+	uint64_t gen = echo_core_gen();
+
+	return sysctl_handle_64(oidp, &gen, 0, req);
 }
 
+/*
+ * Serves both kern.echo.config and the kern.echo.ns.* nodes, arg1 is the
+ * store behind the node.
+ */
 static int
 echo_sysctl(SYSCTL_HANDLER_ARGS) {
-	nvecho_t kdata = {0};
+	struct echo_store *st = arg1;
+	struct echo_snap *snap = NULL;
+	void *buf = NULL;
+	int error = 0;
 
 	if (req->newptr) {
-		kdata.len = req->newlen;
-		kdata.buf = malloc(kdata.len, M_ECHOBUF, M_WAITOK);
-		SYSCTL_IN(req, kdata.buf, kdata.len);
-		if (nvl != NULL) {
-			nvlist_destroy(nvl);
+		if (req->newlen > echo_maxsize) {
+			return EFBIG;
+		}
+		buf = malloc(req->newlen, M_ECHOBUF, M_WAITOK);
+		error = SYSCTL_IN(req, buf, req->newlen);
+		if (error == 0) {
+			error = echo_store_set(st, buf, req->newlen);
+			if (error) {
+				uprintf("Could not unpack nvlist!\n");
+			}
 		}
-		nvl = nvlist_unpack(kdata.buf, kdata.len, 0);
-		if (nvl == NULL) {
-			uprintf("Could not unpack nvlist!\n");
-			free(kdata.buf, M_ECHOBUF);
-			return EINVAL;
+		free(buf, M_ECHOBUF);
+		if (error) {
+			return error;
 		}
-		free(kdata.buf, M_ECHOBUF);
 	}
-	if (nvl == NULL) {
+	snap = echo_store_acquire(st);
+	if (snap == NULL) {
 		uprintf("No configuration set!\n");
 		return ENOMEM;
 	}
-	kdata.buf = nvlist_pack(nvl, &kdata.len);
-	if (kdata.buf == NULL) {
-		uprintf("Error packing data\n");
+	error = echo_snap_pack(snap);
+	if (error == 0) {
+		error = SYSCTL_OUT(req, snap->es_buf, snap->es_len);
+	}
+	echo_snap_release(snap);
+	return error;
+}
+
+/*
+ * Path queries on the global config: the path is written and the packed
+ * result read back in the same request.
+ */
+static int
+echo_query_sysctl(SYSCTL_HANDLER_ARGS) {
+	struct echo_snap *snap = NULL;
+	char *path = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+	int error = 0;
+
+	if (req->newptr == NULL || req->newlen == 0 ||
+	    req->newlen >= ECHO_PATHMAX) {
 		return EINVAL;
 	}
-	SYSCTL_OUT(req, kdata.buf, kdata.len);
-	free(kdata.buf, M_ECHOBUF);
+	path = malloc(req->newlen + 1, M_ECHOBUF, M_WAITOK | M_ZERO);
+	error = SYSCTL_IN(req, path, req->newlen);
+	if (error) {
+		goto out;
+	}
+	snap = echo_store_acquire(&store);
+	if (snap == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	error = echo_snap_query(snap, path, &buf, &len);
+	echo_snap_release(snap);
+	if (error == 0) {
+		error = SYSCTL_OUT(req, buf, len);
+		echo_nv_free(buf);
+	}
+out:
+	free(path, M_ECHOBUF);
+	return error;
+}
+
+/*
+ * Namespace hooks, called with the namespace table locked.  The nodes live in
+ * clist with the rest of the tree, so freeing it at unload removes them in
+ * one go or not at all.  Removing a node waits for running handlers, so the
+ * store outlives every sysctl request.
+ */
+static int
+echo_ns_attach(struct echo_ns *ns)
+{
+	struct sysctl_oid *oid = NULL;
+
+	oid = SYSCTL_ADD_PROC(
+		&clist,
+		SYSCTL_CHILDREN(ns_poid),
+		OID_AUTO,
+		ns->en_name,
+		CTLTYPE_OPAQUE | CTLFLAG_RW,
+		&ns->en_store,
+		0,
+		echo_sysctl,
+		"S,nvecho",
+		"Namespace configured using nvlist"
+	);
+	if (oid == NULL) {
+		return EEXIST;
+	}
+	ns->en_priv = oid;
 	return 0;
 }
 
+static void
+echo_ns_detach(struct echo_ns *ns)
+{
+	struct sysctl_oid *oid = ns->en_priv;
+
+	/* Already gone if clist was freed by an unload. */
+	if (sysctl_ctx_entry_del(&clist, oid) == 0) {
+		sysctl_remove_oid(oid, 1, 0);
+	}
+	ns->en_priv = NULL;
+}
+
+static int
+echo_sysctl_free(void *arg __unused)
+{
+	return sysctl_ctx_free(&clist);
+}
+
 static int
 modevent(module_t mod __unused, int event, void *arg __unused)
 {
@@ -136,6 +303,15 @@ modevent(module_t mod __unused, int event, void *arg __unused)
 
 	switch (event) {
 		case MOD_LOAD:
+			error = echo_core_init(echo_notify);
+			if (error) {
+				uprintf("echo_core_init failed.\n");
+				return error;
+			}
+			mtx_init(&sel_mtx, "echo sel", NULL, MTX_DEF);
+			knlist_init_mtx(&sel.si_note, &sel_mtx);
+			echo_store_init(&store);
+			echo_nstab_init(&nstab, echo_ns_attach, echo_ns_detach);
 			dev = make_dev(&echo_cdevsw, 0, UID_ROOT, GID_WHEEL, 0666, "echo");
 			sysctl_ctx_init(&clist);
 			poid = SYSCTL_ADD_NODE(
@@ -157,20 +333,102 @@ modevent(module_t mod __unused, int event, void *arg __unused)
 				OID_AUTO,
 				"config",
 				CTLTYPE_OPAQUE | CTLFLAG_RW,
-				NULL,
+				&store,
 				0,
 				echo_sysctl,
 				"S,nvecho",
 				"Configure using nvlist"
 			);
+			SYSCTL_ADD_PROC(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"query",
+				CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_ANYBODY,
+				NULL,
+				0,
+				echo_query_sysctl,
+				"S,nvecho",
+				"Get the value at the written path"
+			);
+			SYSCTL_ADD_ULONG(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"maxsize",
+				CTLFLAG_RW,
+				&echo_maxsize,
+				"Largest config accepted, in bytes"
+			);
+			SYSCTL_ADD_ULONG(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"upload_budget",
+				CTLFLAG_RW,
+				&echo_upload_budget,
+				"Bytes all chunked uploads may stage at once"
+			);
+			SYSCTL_ADD_UINT(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"history_depth",
+				CTLFLAG_RW,
+				&echo_history_depth,
+				0,
+				"Versions of each config kept for rollback"
+			);
+			SYSCTL_ADD_ULONG(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"history_nodes",
+				CTLFLAG_RD,
+				__DEVOLATILE(u_long *, &echo_history_nodes),
+				"Version tree nodes alive across all configs"
+			);
+			SYSCTL_ADD_PROC(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"generation",
+				CTLTYPE_U64 | CTLFLAG_RD,
+				NULL,
+				0,
+				echo_gen_sysctl,
+				"QU",
+				"Generation of the last config published"
+			);
+			ns_poid = SYSCTL_ADD_NODE(
+				&clist,
+				SYSCTL_CHILDREN(poid),
+				OID_AUTO,
+				"ns",
+				CTLFLAG_RW,
+				0,
+				"namespaces"
+			);
+			if (ns_poid == NULL) {
+				uprintf("SYSCTL_ADD_NODE failed.\n");
+				return EINVAL;
+			}
 			break;
 		case MOD_UNLOAD:
-			if (sysctl_ctx_free(&clist)) {
+			/* The last step that can fail, nothing is torn down yet. */
+			if (echo_nstab_close(&nstab, echo_sysctl_free, NULL)) {
 				uprintf("sysctl_ctx_free failed.\n");
 				return ENOTEMPTY;
 			}
+			echo_core_shutdown();
 			destroy_dev(dev);
-			nvlist_destroy(nvl);
+			echo_nstab_fini(&nstab);
+			echo_store_fini(&store);
+			echo_core_fini();
+			seldrain(&sel);
+			knlist_clear(&sel.si_note, 0);
+			knlist_destroy(&sel.si_note);
+			mtx_destroy(&sel_mtx);
 			break;
 		default:
 			error = EOPNOTSUPP;
@@ -0,0 +1,404 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxo/xo.h>
+
+#define ACCT_IMPL
+#include "acct.h"
+
+/*
+ * Every allocation made through the wrappers is recorded in a pointer table
+ * together with its size, call site and the pipeline stage current when it
+ * was made.  Counters are kept per stage and per site: allocations, frees,
+ * live bytes and the peak of live bytes.  Pointers the table does not know,
+ * such as buffers from libnv or libucl, are passed to libc untouched.
+ */
+
+struct acct_count {
+	uint64_t	ac_allocs;
+	uint64_t	ac_frees;
+	size_t		ac_live;
+	size_t		ac_peak;
+};
+
+struct acct_site {
+	const char		*as_file;
+	int			 as_line;
+	struct acct_count	 as_count;
+};
+
+struct acct_stage {
+	const char		*at_name;
+	struct acct_count	 at_count;
+};
+
+struct acct_ptr {
+	void		*ap_ptr;	/* NULL if free, ACCT_GONE if deleted */
+	size_t		 ap_size;
+	u_short		 ap_site;
+	u_short		 ap_stage;
+};
+
+#define ACCT_SITES	1024
+#define ACCT_STAGES	32
+#define ACCT_GONE	((void *)-1)
+
+static bool enabled = false;
+static struct acct_site sites[ACCT_SITES];
+static size_t nsites = 0;
+static struct acct_stage stages[ACCT_STAGES] = {{ "init" }};
+static size_t nstages = 1;
+static size_t stage = 0;
+static struct acct_count total;
+static struct acct_ptr *ptrs = NULL;
+static size_t nptrs = 0;	/* slots, a power of two */
+static size_t used = 0;		/* slots not free, deleted ones included */
+
+static size_t
+acct_hash(const void *ptr) {
+	uintptr_t h = (uintptr_t)ptr;
+
+	h ^= h >> 17;
+	h *= 0xed5ad4bbU;
+	h ^= h >> 11;
+	return h;
+}
+
+static void
+count_alloc(struct acct_count *c, size_t size) {
+	++c->ac_allocs;
+	c->ac_live += size;
+	if (c->ac_live > c->ac_peak) {
+		c->ac_peak = c->ac_live;
+	}
+}
+
+static void
+count_free(struct acct_count *c, size_t size) {
+	++c->ac_frees;
+	c->ac_live -= size;
+}
+
+static void
+uncount_free(struct acct_count *c, size_t size) {
+	--c->ac_frees;
+	c->ac_live += size;
+}
+
+static u_short
+acct_site(const char *file, int line) {
+	size_t i;
+
+	for (i = 0; i < nsites; ++i) {
+		if (sites[i].as_line == line && strcmp(sites[i].as_file, file) == 0) {
+			return i;
+		}
+	}
+	if (nsites == ACCT_SITES) {
+		errx(1, "acct: too many allocation sites");
+	}
+	sites[nsites].as_file = file;
+	sites[nsites].as_line = line;
+	return nsites++;
+}
+
+static void
+acct_grow(void) {
+	struct acct_ptr *old = ptrs;
+	size_t oldn = nptrs, i, j;
+
+	nptrs = nptrs == 0 ? 1024 : nptrs * 2;
+	ptrs = calloc(nptrs, sizeof(*ptrs));
+	if (ptrs == NULL) {
+		err(1, "acct: calloc");
+	}
+	used = 0;
+	for (i = 0; i < oldn; ++i) {
+		if (old[i].ap_ptr == NULL || old[i].ap_ptr == ACCT_GONE) {
+			continue;
+		}
+		for (j = acct_hash(old[i].ap_ptr) & (nptrs - 1); ptrs[j].ap_ptr != NULL;
+		    j = (j + 1) & (nptrs - 1)) {
+			;
+		}
+		ptrs[j] = old[i];
+		++used;
+	}
+	free(old);
+}
+
+/* A slot for ptr, counted as used. */
+static struct acct_ptr *
+acct_slot(const void *ptr) {
+	size_t i;
+
+	if ((used + 1) * 2 > nptrs) {
+		acct_grow();
+	}
+	for (i = acct_hash(ptr) & (nptrs - 1); ptrs[i].ap_ptr != NULL &&
+	    ptrs[i].ap_ptr != ACCT_GONE; i = (i + 1) & (nptrs - 1)) {
+		;
+	}
+	if (ptrs[i].ap_ptr == NULL) {
+		++used;
+	}
+	return &ptrs[i];
+}
+
+static void
+acct_insert(void *ptr, size_t size, const char *file, int line) {
+	struct acct_ptr *p = NULL;
+
+	if (ptr == NULL) {
+		return;
+	}
+	p = acct_slot(ptr);
+	p->ap_ptr = ptr;
+	p->ap_size = size;
+	p->ap_site = acct_site(file, line);
+	p->ap_stage = stage;
+	count_alloc(&total, size);
+	count_alloc(&sites[p->ap_site].as_count, size);
+	count_alloc(&stages[stage].at_count, size);
+}
+
+/*
+ * Forget ptr, returning whether it was known.  Its entry is copied to savep
+ * unless that is NULL, for acct_restore().
+ */
+static bool
+acct_remove(void *ptr, struct acct_ptr *savep) {
+	struct acct_ptr *p = NULL;
+	size_t i;
+
+	if (ptr == NULL || nptrs == 0) {
+		return false;
+	}
+	for (i = acct_hash(ptr) & (nptrs - 1); ptrs[i].ap_ptr != NULL;
+	    i = (i + 1) & (nptrs - 1)) {
+		p = &ptrs[i];
+		if (p->ap_ptr != ptr) {
+			continue;
+		}
+		count_free(&total, p->ap_size);
+		count_free(&sites[p->ap_site].as_count, p->ap_size);
+		count_free(&stages[p->ap_stage].at_count, p->ap_size);
+		if (savep != NULL) {
+			*savep = *p;
+		}
+		p->ap_ptr = ACCT_GONE;
+		return true;
+	}
+	return false;
+}
+
+/* Put back an entry acct_remove() saved, as if it was never freed. */
+static void
+acct_restore(const struct acct_ptr *save) {
+	struct acct_ptr *p = NULL;
+
+	p = acct_slot(save->ap_ptr);
+	*p = *save;
+	uncount_free(&total, p->ap_size);
+	uncount_free(&sites[p->ap_site].as_count, p->ap_size);
+	uncount_free(&stages[p->ap_stage].at_count, p->ap_size);
+}
+
+/*
+ * Start accounting.  Only allocations made from here on are seen.
+ */
+void
+acct_enable(void) {
+	enabled = true;
+}
+
+/*
+ * Attribute the allocations from here on to stage name, which must stay
+ * valid.
+ */
+void
+acct_stage(const char *name) {
+	size_t i;
+
+	for (i = 0; i < nstages; ++i) {
+		if (strcmp(stages[i].at_name, name) == 0) {
+			stage = i;
+			return;
+		}
+	}
+	if (nstages == ACCT_STAGES) {
+		errx(1, "acct: too many stages");
+	}
+	stages[nstages].at_name = name;
+	stage = nstages++;
+}
+
+/*
+ * The allocations made in stage name, how many bytes of them are still live
+ * and their peak, for benchmarks that hold a stage to a budget.  Returns
+ * false if no such stage was started.
+ */
+bool
+acct_stage_count(const char *name, uint64_t *allocsp, size_t *livep,
+    size_t *peakp) {
+	size_t i;
+
+	for (i = 0; i < nstages; ++i) {
+		if (strcmp(stages[i].at_name, name) == 0) {
+			*allocsp = stages[i].at_count.ac_allocs;
+			*livep = stages[i].at_count.ac_live;
+			*peakp = stages[i].at_count.ac_peak;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+emit_count(const struct acct_count *c) {
+	xo_emit("{:allocs/%ju} {:frees/%ju} {:live/%zu} {:peak/%zu}\n",
+	    (uintmax_t)c->ac_allocs, (uintmax_t)c->ac_frees, c->ac_live,
+	    c->ac_peak);
+}
+
+/*
+ * Totals per stage and per site, then every allocation still live.  The
+ * report goes into the caller's libxo document, so call this before
+ * xo_finish().
+ */
+void
+acct_report(void) {
+	size_t i;
+
+	if (!enabled) {
+		return;
+	}
+	xo_open_container("allocations");
+	xo_emit("{T:allocs frees live peak}\n");
+	xo_emit("{L:total} ");
+	xo_open_container("total");
+	emit_count(&total);
+	xo_close_container("total");
+	xo_open_list("stage");
+	for (i = 0; i < nstages; ++i) {
+		if (stages[i].at_count.ac_allocs == 0) {
+			continue;
+		}
+		xo_open_instance("stage");
+		xo_emit("{:name/%s} ", stages[i].at_name);
+		emit_count(&stages[i].at_count);
+		xo_close_instance("stage");
+	}
+	xo_close_list("stage");
+	xo_open_list("site");
+	for (i = 0; i < nsites; ++i) {
+		xo_open_instance("site");
+		xo_emit("{:file/%s}:{:line/%d} ", sites[i].as_file,
+		    sites[i].as_line);
+		emit_count(&sites[i].as_count);
+		xo_close_instance("site");
+	}
+	xo_close_list("site");
+	xo_open_list("leak");
+	for (i = 0; i < nptrs; ++i) {
+		if (ptrs[i].ap_ptr == NULL || ptrs[i].ap_ptr == ACCT_GONE) {
+			continue;
+		}
+		xo_open_instance("leak");
+		xo_emit("{Lwc:leaked}{:file/%s}:{:line/%d} {:stage/%s} {:size/%zu}\n",
+		    sites[ptrs[i].ap_site].as_file, sites[ptrs[i].ap_site].as_line,
+		    stages[ptrs[i].ap_stage].at_name, ptrs[i].ap_size);
+		xo_close_instance("leak");
+	}
+	xo_close_list("leak");
+	xo_close_container("allocations");
+}
+
+void *
+acct_malloc(size_t size, const char *file, int line) {
+	void *ptr = malloc(size);
+
+	if (enabled) {
+		acct_insert(ptr, size, file, line);
+	}
+	return ptr;
+}
+
+void *
+acct_calloc(size_t nmemb, size_t size, const char *file, int line) {
+	void *ptr = calloc(nmemb, size);
+
+	if (enabled) {
+		acct_insert(ptr, nmemb * size, file, line);
+	}
+	return ptr;
+}
+
+/*
+ * A grown block counts as a free of the old one and a new allocation at
+ * this site.  The old entry leaves the table before realloc() can free it
+ * and goes back if realloc() fails and the block is still there.
+ */
+void *
+acct_realloc(void *ptr, size_t size, const char *file, int line) {
+	struct acct_ptr save;
+	bool known = enabled && acct_remove(ptr, &save);
+	void *new = realloc(ptr, size);
+
+	if (new == NULL && size != 0) {
+		if (known) {
+			acct_restore(&save);
+		}
+	} else if (enabled) {
+		acct_insert(new, size, file, line);
+	}
+	return new;
+}
+
+void *
+acct_reallocarray(void *ptr, size_t nmemb, size_t size, const char *file,
+    int line) {
+	struct acct_ptr save;
+	bool known = enabled && acct_remove(ptr, &save);
+	void *new = reallocarray(ptr, nmemb, size);
+
+	if (new == NULL) {
+		if (known) {
+			acct_restore(&save);
+		}
+	} else if (enabled) {
+		acct_insert(new, nmemb * size, file, line);
+	}
+	return new;
+}
+
+char *
+acct_strdup(const char *str, const char *file, int line) {
+	char *new = strdup(str);
+
+	if (enabled) {
+		acct_insert(new, strlen(str) + 1, file, line);
+	}
+	return new;
+}
+
+/*
+ * Stop tracking ptr without freeing it, for memory handed over to a library
+ * that frees it itself.
+ */
+void
+acct_forget(void *ptr) {
+	if (enabled) {
+		acct_remove(ptr, NULL);
+	}
+}
+
+void
+acct_free(void *ptr) {
+	if (enabled) {
+		acct_remove(ptr, NULL);
+	}
+	free(ptr);
+}
@@ -0,0 +1,34 @@
+#ifndef _ACCT_H_
+#define _ACCT_H_
+
+/*
+ * Opt-in allocation accounting.  Include this after the system headers: it
+ * routes the allocator calls of the including file through the acct_*
+ * wrappers, which go straight to libc until acct_enable() is called.
+ */
+
+void acct_enable(void);
+void acct_stage(const char *name);
+void acct_report(void);
+void acct_forget(void *ptr);
+bool acct_stage_count(const char *name, uint64_t *allocsp, size_t *livep,
+    size_t *peakp);
+
+void *acct_malloc(size_t size, const char *file, int line);
+void *acct_calloc(size_t nmemb, size_t size, const char *file, int line);
+void *acct_realloc(void *ptr, size_t size, const char *file, int line);
+void *acct_reallocarray(void *ptr, size_t nmemb, size_t size, const char *file, int line);
+char *acct_strdup(const char *str, const char *file, int line);
+void acct_free(void *ptr);
+
+#ifndef ACCT_IMPL
+#define malloc(size)	acct_malloc((size), __FILE__, __LINE__)
+#define calloc(nmemb, size)	acct_calloc((nmemb), (size), __FILE__, __LINE__)
+#define realloc(ptr, size)	acct_realloc((ptr), (size), __FILE__, __LINE__)
+#define reallocarray(ptr, nmemb, size)					\
+	acct_reallocarray((ptr), (nmemb), (size), __FILE__, __LINE__)
+#define strdup(str)	acct_strdup((str), __FILE__, __LINE__)
+#define free(ptr)	acct_free(ptr)
+#endif
+
+#endif /* !_ACCT_H_ */
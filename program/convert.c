@@ -0,0 +1,173 @@
+#include <sys/nv.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ucl.h>
+
+#include "convert.h"
+#include "schema.h"
+#include "template.h"
+#include "acct.h"
+
+static void array_add(nvlist_t *nvl, const char *key, const ucl_object_t *obj, const struct tmpl_scope *scope, const struct schema *sch);
+
+/*
+ * obj has been checked against sch by the caller already.
+ */
+static void
+array_add(nvlist_t *nvl, const char *key, const ucl_object_t *obj, const struct tmpl_scope *scope, const struct schema *sch) {
+	bool bvalue;
+	uint64_t ivalue = 0;
+	const char *svalue = NULL;
+	nvlist_t *nested = NULL;
+	const ucl_object_t *cur = NULL;
+	ucl_object_iter_t it = NULL;
+	struct tmpl_scope inner = {0};
+
+	switch(obj->type) {
+		case UCL_OBJECT:
+			nested = nvlist_create(0);
+			inner.ts_obj = obj;
+			inner.ts_name = scope != NULL ? scope->ts_name : key;
+			inner.ts_up = scope;
+			while ((cur = ucl_iterate_object(obj, &it, true))) {
+				uclobj2nv(nested, cur, &inner, sch);
+			}
+			schema_required(sch, obj, key);
+			if (nvlist_exists_nvlist_array(nvl, key)) {
+				nvlist_append_nvlist_array(nvl, key, nested);
+			} else {
+				nvlist_add_nvlist_array(nvl, key, (const nvlist_t * const *)&nested, 1);
+			}
+			nvlist_destroy(nested);
+			break;
+		case UCL_INT:
+			ivalue = ucl_object_toint(obj);
+			if (nvlist_exists_number_array(nvl, key)) {
+				nvlist_append_number_array(nvl, key, ivalue);
+			} else {
+				nvlist_add_number_array(nvl, key, &ivalue, 1);
+			}
+			break;
+		case UCL_FLOAT:
+		case UCL_TIME:
+			/* nvlists cannot hold these; a typed schema key refuses them. */
+			break;
+		case UCL_STRING:
+			svalue = tmpl_expand(ucl_object_tostring(obj), scope);
+			if (nvlist_exists_string_array(nvl, key)) {
+				nvlist_append_string_array(nvl, key, svalue);
+			} else {
+				nvlist_add_string_array(nvl, key, &svalue, 1);
+			}
+			break;
+		case UCL_BOOLEAN:
+			bvalue = ucl_object_toboolean(obj);
+			if (nvlist_exists_bool_array(nvl, key)) {
+				nvlist_append_bool_array(nvl, key, bvalue);
+			} else {
+				nvlist_add_bool_array(nvl, key, &bvalue, 1);
+			}
+			break;
+	}
+}
+
+/*
+ * Strings have their ${var} references expanded against the blocks in scope
+ * on the way; see template.c.  sch is the schema of the object holding top,
+ * which is checked as it is converted; see schema.c.
+ */
+void
+uclobj2nv(nvlist_t *nvl, const ucl_object_t *top, const struct tmpl_scope *scope, const struct schema *sch) {
+	nvlist_t *nested = NULL;
+	const char *key = NULL, *svalue = NULL;
+	const ucl_object_t *obj = NULL, *cur = NULL;
+	ucl_object_iter_t it = NULL, itobj = NULL;
+	bool bvalue;
+	uint64_t ivalue = 0;
+	struct tmpl_scope inner = {0};
+	const struct schema *keysch = NULL, *valsch = NULL, *items = NULL;
+
+	if (nvl == NULL || top == NULL) {
+		err(1, "NVList or UCL object is NULL in uclobj2nv");
+	}
+
+	keysch = schema_key(sch, top);
+	while ((obj = ucl_iterate_object(top, &it, false))) {
+		key = ucl_object_key(obj);
+		valsch = schema_value(keysch, obj, key);
+		switch(obj->type) {
+			case UCL_OBJECT:
+				nested = nvlist_create(0);
+				inner.ts_obj = obj;
+				inner.ts_name = scope != NULL ? scope->ts_name : key;
+				inner.ts_up = scope;
+				itobj = NULL;
+				while ((cur = ucl_iterate_object(obj, &itobj, true))) {
+					uclobj2nv(nested, cur, &inner, valsch);
+				}
+				schema_required(valsch, obj, key);
+				if (nvlist_exists_nvlist_array(nvl, key)) {
+					nvlist_append_nvlist_array(nvl, key, nested);
+				} else if (obj->next != NULL) {
+					nvlist_add_nvlist_array(nvl, key, (const nvlist_t * const *)&nested, 1);
+				} else {
+					nvlist_add_nvlist(nvl, key, nested);
+				}
+				nvlist_destroy(nested);
+				break;
+			case UCL_ARRAY:
+				items = schema_items(valsch);
+				itobj = NULL;
+				while ((cur = ucl_iterate_object(obj, &itobj, true))) {
+					array_add(nvl, key, cur, scope, schema_value(items, cur, key));
+				}
+				break;
+			case UCL_INT:
+				ivalue = ucl_object_toint(obj);
+				if (nvlist_exists_number_array(nvl, key)) {
+					nvlist_append_number_array(nvl, key, ivalue);
+				} else if (obj->next != NULL) {
+					nvlist_add_number_array(nvl, key, &ivalue, 1);
+				} else {
+					nvlist_add_number(nvl, key, ivalue);
+				}
+				break;
+			case UCL_FLOAT:
+			case UCL_TIME:
+				/* nvlists cannot hold these; a typed schema key refuses them. */
+				break;
+			case UCL_STRING:
+				svalue = tmpl_expand(ucl_object_tostring_forced(obj), scope);
+				if (nvlist_exists_string_array(nvl, key)) {
+					nvlist_append_string_array(nvl, key, svalue);
+				} else if (obj->next != NULL) {
+					nvlist_add_string_array(nvl, key, &svalue, 1);
+				} else {
+					nvlist_add_string(nvl, key, svalue);
+				}
+				break;
+			case UCL_BOOLEAN:
+				bvalue = ucl_object_toboolean(obj);
+				if (nvlist_exists_bool_array(nvl, key)) {
+					nvlist_append_bool_array(nvl, key, bvalue);
+				} else if (obj->next != NULL) {
+					nvlist_add_bool_array(nvl, key, &bvalue, 1);
+				} else {
+					nvlist_add_bool(nvl, key, bvalue);
+				}
+				break;
+			case UCL_USERDATA:
+				nvlist_add_binary(nvl, key, obj->value.ud, obj->len);
+				break;
+			case UCL_NULL:
+				nvlist_add_null(nvl, key);
+				break;
+			default:
+				err(1, "unknown UCL type");
+				break;
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+struct schema;
+struct tmpl_scope;
+
+/*
+ * Add the value of top, and of any values repeating its key, to nvl under
+ * that key, checking them against the schema sch of the enclosing object.
+ */
+void uclobj2nv(nvlist_t *nvl, const ucl_object_t *top, const struct tmpl_scope *scope, const struct schema *sch);
+
+#endif /* !_CONVERT_H_ */
@@ -0,0 +1,358 @@
+#include <sys/nv.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "echo_patch.h"
+#include "acct.h"
+
+struct pathbuf {
+	char	*pb_str;
+	size_t	 pb_len;
+	size_t	 pb_size;
+};
+
+struct oplist {
+	nvlist_t	**ol_ops;
+	size_t		  ol_count;
+	size_t		  ol_size;
+};
+
+static bool nv_equal(const nvlist_t *a, const nvlist_t *b);
+static void diff_nvlist(struct oplist *ol, struct pathbuf *pb,
+    const nvlist_t *old, const nvlist_t *new);
+
+static void
+pathbuf_append(struct pathbuf *pb, const char *str, size_t len) {
+	if (pb->pb_len + len + 1 > pb->pb_size) {
+		pb->pb_size = (pb->pb_len + len + 1) * 2;
+		pb->pb_str = realloc(pb->pb_str, pb->pb_size);
+		if (pb->pb_str == NULL) {
+			err(1, "realloc");
+		}
+	}
+	memcpy(pb->pb_str + pb->pb_len, str, len);
+	pb->pb_len += len;
+	pb->pb_str[pb->pb_len] = '\0';
+}
+
+static size_t
+pathbuf_push(struct pathbuf *pb, const char *name) {
+	size_t len = pb->pb_len;
+
+	if (len > 0) {
+		pathbuf_append(pb, ".", 1);
+	}
+	for (; *name != '\0'; ++name) {
+		if (strchr(".[]\\", *name) != NULL) {
+			pathbuf_append(pb, "\\", 1);
+		}
+		pathbuf_append(pb, name, 1);
+	}
+	return len;
+}
+
+static size_t
+pathbuf_index(struct pathbuf *pb, size_t index) {
+	size_t len = pb->pb_len;
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "[%zu]", index);
+	pathbuf_append(pb, buf, strlen(buf));
+	return len;
+}
+
+static void
+pathbuf_pop(struct pathbuf *pb, size_t len) {
+	pb->pb_len = len;
+	pb->pb_str[len] = '\0';
+}
+
+static nvlist_t *
+op_new(struct oplist *ol, uint64_t kind, const struct pathbuf *pb) {
+	nvlist_t *op = nvlist_create(0);
+
+	if (op == NULL) {
+		err(1, "nvlist_create");
+	}
+	if (ol->ol_count == ol->ol_size) {
+		ol->ol_size = ol->ol_size == 0 ? 16 : ol->ol_size * 2;
+		ol->ol_ops = realloc(ol->ol_ops, ol->ol_size * sizeof(*ol->ol_ops));
+		if (ol->ol_ops == NULL) {
+			err(1, "realloc");
+		}
+	}
+	nvlist_add_number(op, ECHO_PATCH_OP, kind);
+	nvlist_add_string(op, ECHO_PATCH_PATH, pb->pb_str);
+	ol->ol_ops[ol->ol_count++] = op;
+	return op;
+}
+
+static void
+copy_pair(nvlist_t *dst, const char *dname, const nvlist_t *src,
+    const char *sname, int type) {
+	size_t items = 0;
+
+	switch (type) {
+		case NV_TYPE_NULL:
+			nvlist_add_null(dst, dname);
+			break;
+		case NV_TYPE_BOOL:
+			nvlist_add_bool(dst, dname, nvlist_get_bool(src, sname));
+			break;
+		case NV_TYPE_NUMBER:
+			nvlist_add_number(dst, dname, nvlist_get_number(src, sname));
+			break;
+		case NV_TYPE_STRING:
+			nvlist_add_string(dst, dname, nvlist_get_string(src, sname));
+			break;
+		case NV_TYPE_NVLIST:
+			nvlist_add_nvlist(dst, dname, nvlist_get_nvlist(src, sname));
+			break;
+		case NV_TYPE_BINARY: {
+			const void *data = nvlist_get_binary(src, sname, &items);
+
+			nvlist_add_binary(dst, dname, data, items);
+			break;
+		}
+		case NV_TYPE_BOOL_ARRAY: {
+			const bool *array = nvlist_get_bool_array(src, sname, &items);
+
+			nvlist_add_bool_array(dst, dname, array, items);
+			break;
+		}
+		case NV_TYPE_NUMBER_ARRAY: {
+			const uint64_t *array = nvlist_get_number_array(src, sname, &items);
+
+			nvlist_add_number_array(dst, dname, array, items);
+			break;
+		}
+		case NV_TYPE_STRING_ARRAY: {
+			const char * const *array = nvlist_get_string_array(src, sname, &items);
+
+			nvlist_add_string_array(dst, dname, array, items);
+			break;
+		}
+		case NV_TYPE_NVLIST_ARRAY: {
+			const nvlist_t * const *array = nvlist_get_nvlist_array(src, sname, &items);
+
+			nvlist_add_nvlist_array(dst, dname, array, items);
+			break;
+		}
+		default:
+			errx(1, "cannot diff pair '%s' of type %d", sname, type);
+	}
+}
+
+static const void *
+get_array(const nvlist_t *nvl, const char *name, int type, size_t *items) {
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			return nvlist_get_bool_array(nvl, name, items);
+		case NV_TYPE_NUMBER_ARRAY:
+			return nvlist_get_number_array(nvl, name, items);
+		case NV_TYPE_STRING_ARRAY:
+			return nvlist_get_string_array(nvl, name, items);
+		case NV_TYPE_NVLIST_ARRAY:
+			return nvlist_get_nvlist_array(nvl, name, items);
+	}
+	*items = 0;
+	return NULL;
+}
+
+static bool
+elem_equal(int type, const void *a, size_t i, const void *b, size_t j) {
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			return ((const bool *)a)[i] == ((const bool *)b)[j];
+		case NV_TYPE_NUMBER_ARRAY:
+			return ((const uint64_t *)a)[i] == ((const uint64_t *)b)[j];
+		case NV_TYPE_STRING_ARRAY:
+			return strcmp(((const char * const *)a)[i],
+			    ((const char * const *)b)[j]) == 0;
+		case NV_TYPE_NVLIST_ARRAY:
+			return nv_equal(((const nvlist_t * const *)a)[i],
+			    ((const nvlist_t * const *)b)[j]);
+	}
+	return false;
+}
+
+static bool
+pair_equal(const nvlist_t *a, const nvlist_t *b, const char *name, int type) {
+	const void *da = NULL, *db = NULL;
+	size_t na = 0, nb = 0;
+
+	switch (type) {
+		case NV_TYPE_NULL:
+			return true;
+		case NV_TYPE_BOOL:
+			return nvlist_get_bool(a, name) == nvlist_get_bool(b, name);
+		case NV_TYPE_NUMBER:
+			return nvlist_get_number(a, name) == nvlist_get_number(b, name);
+		case NV_TYPE_STRING:
+			return strcmp(nvlist_get_string(a, name), nvlist_get_string(b, name)) == 0;
+		case NV_TYPE_NVLIST:
+			return nv_equal(nvlist_get_nvlist(a, name), nvlist_get_nvlist(b, name));
+		case NV_TYPE_BINARY:
+			da = nvlist_get_binary(a, name, &na);
+			db = nvlist_get_binary(b, name, &nb);
+			return na == nb && memcmp(da, db, na) == 0;
+	}
+	da = get_array(a, name, type, &na);
+	db = get_array(b, name, type, &nb);
+	if (da == NULL || na != nb) {
+		return false;
+	}
+	for (size_t i = 0; i < na; ++i) {
+		if (!elem_equal(type, da, i, db, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+nv_equal(const nvlist_t *a, const nvlist_t *b) {
+	const char *name = NULL;
+	void *cookie = NULL;
+	int type = 0;
+	size_t na = 0, nb = 0;
+
+	while ((name = nvlist_next(a, &type, &cookie)) != NULL) {
+		if (!nvlist_exists_type(b, name, type) || !pair_equal(a, b, name, type)) {
+			return false;
+		}
+		++na;
+	}
+	cookie = NULL;
+	while (nvlist_next(b, &type, &cookie) != NULL) {
+		++nb;
+	}
+	return na == nb;
+}
+
+static void
+diff_array(struct oplist *ol, struct pathbuf *pb, const nvlist_t *old,
+    const nvlist_t *new, const char *name, int type) {
+	const void *a = NULL, *b = NULL;
+	size_t na = 0, nb = 0, prefix = 0, suffix = 0, len = 0;
+	nvlist_t *op = NULL;
+
+	a = get_array(old, name, type, &na);
+	b = get_array(new, name, type, &nb);
+	while (prefix < na && prefix < nb && elem_equal(type, a, prefix, b, prefix)) {
+		++prefix;
+	}
+	while (suffix < na - prefix && suffix < nb - prefix &&
+	    elem_equal(type, a, na - 1 - suffix, b, nb - 1 - suffix)) {
+		++suffix;
+	}
+	if (prefix == na && prefix == nb) {
+		return;
+	}
+	if (type == NV_TYPE_NVLIST_ARRAY && na == nb) {
+		const nvlist_t * const *olds = a;
+		const nvlist_t * const *news = b;
+
+		for (size_t i = prefix; i < na - suffix; ++i) {
+			len = pathbuf_index(pb, i);
+			diff_nvlist(ol, pb, olds[i], news[i]);
+			pathbuf_pop(pb, len);
+		}
+		return;
+	}
+	op = op_new(ol, ECHO_PATCH_SPLICE, pb);
+	nvlist_add_number(op, ECHO_PATCH_INDEX, prefix);
+	nvlist_add_number(op, ECHO_PATCH_COUNT, na - prefix - suffix);
+	if (nb - prefix - suffix == 0) {
+		return;
+	}
+	switch (type) {
+		case NV_TYPE_BOOL_ARRAY:
+			nvlist_add_bool_array(op, ECHO_PATCH_VALUE,
+			    (const bool *)b + prefix, nb - prefix - suffix);
+			break;
+		case NV_TYPE_NUMBER_ARRAY:
+			nvlist_add_number_array(op, ECHO_PATCH_VALUE,
+			    (const uint64_t *)b + prefix, nb - prefix - suffix);
+			break;
+		case NV_TYPE_STRING_ARRAY:
+			nvlist_add_string_array(op, ECHO_PATCH_VALUE,
+			    (const char * const *)b + prefix, nb - prefix - suffix);
+			break;
+		case NV_TYPE_NVLIST_ARRAY:
+			nvlist_add_nvlist_array(op, ECHO_PATCH_VALUE,
+			    (const nvlist_t * const *)b + prefix, nb - prefix - suffix);
+			break;
+	}
+}
+
+static void
+diff_nvlist(struct oplist *ol, struct pathbuf *pb, const nvlist_t *old,
+    const nvlist_t *new) {
+	const char *name = NULL;
+	void *cookie = NULL;
+	int type = 0;
+	size_t len = 0;
+	nvlist_t *op = NULL;
+
+	while ((name = nvlist_next(old, &type, &cookie)) != NULL) {
+		if (!nvlist_exists(new, name)) {
+			len = pathbuf_push(pb, name);
+			op_new(ol, ECHO_PATCH_REMOVE, pb);
+			pathbuf_pop(pb, len);
+		}
+	}
+	cookie = NULL;
+	while ((name = nvlist_next(new, &type, &cookie)) != NULL) {
+		len = pathbuf_push(pb, name);
+		if (!nvlist_exists_type(old, name, type)) {
+			op = op_new(ol, ECHO_PATCH_SET, pb);
+			copy_pair(op, ECHO_PATCH_VALUE, new, name, type);
+		} else if (type == NV_TYPE_NVLIST) {
+			diff_nvlist(ol, pb, nvlist_get_nvlist(old, name),
+			    nvlist_get_nvlist(new, name));
+		} else if (type == NV_TYPE_BOOL_ARRAY || type == NV_TYPE_NUMBER_ARRAY ||
+		    type == NV_TYPE_STRING_ARRAY || type == NV_TYPE_NVLIST_ARRAY) {
+			diff_array(ol, pb, old, new, name, type);
+		} else if (!pair_equal(old, new, name, type)) {
+			op = op_new(ol, ECHO_PATCH_SET, pb);
+			copy_pair(op, ECHO_PATCH_VALUE, new, name, type);
+		}
+		pathbuf_pop(pb, len);
+	}
+}
+
+/*
+ * Build the patch (see echo_patch.h) that turns old into new.  A patch
+ * without an "ops" array means the configs are equal.
+ */
+nvlist_t *
+nv_diff(const nvlist_t *old, const nvlist_t *new) {
+	struct pathbuf pb = {0};
+	struct oplist ol = {0};
+	nvlist_t *patch = NULL;
+
+	pathbuf_append(&pb, "", 0);
+	diff_nvlist(&ol, &pb, old, new);
+	free(pb.pb_str);
+	patch = nvlist_create(0);
+	if (patch == NULL) {
+		err(1, "nvlist_create");
+	}
+	if (ol.ol_count > 0) {
+		acct_forget(ol.ol_ops);
+		nvlist_move_nvlist_array(patch, ECHO_PATCH_OPS, ol.ol_ops, ol.ol_count);
+	} else {
+		free(ol.ol_ops);
+	}
+	if (nvlist_error(patch)) {
+		errc(1, nvlist_error(patch), "building patch");
+	}
+	return patch;
+}
@@ -0,0 +1,6 @@
+#ifndef _DIFF_H_
+#define _DIFF_H_
+
+nvlist_t *nv_diff(const nvlist_t *old, const nvlist_t *new);
+
+#endif /* !_DIFF_H_ */
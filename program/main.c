@@ -5,30 +5,73 @@
 
 #include <libxo/xo.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ucl.h>
 #include <unistd.h>
 
+#include "convert.h"
+#include "diff.h"
+#include "echo.h"
+#include "echo_compact.h"
+#include "echo_patch.h"
+#include "schema.h"
+#include "template.h"
+#include "acct.h"
+
 static void print_nv(const nvlist_t *nvl);
-static void print_nvlist(const nvlist_t *nvl);
-static void array_add(nvlist_t *nvl, const char *key, const ucl_object_t *obj);
-static void uclobj2nv(nvlist_t *nvl, const ucl_object_t *top);
 static nvlist_t * ucl2nv(struct ucl_parser *parser);
-
-typedef struct nvecho {
-	void *buf;
-	size_t len;
-} nvecho_t;
-#define ECHO_IOCTL _IOWR('H', 1, nvecho_t)
+static void * getbuf_grow(size_t size);
+static int ioctl_fetch(int fd, const char *name, size_t *lenp, uint64_t *genp);
+static nvlist_t * ioctl_get(int fd);
+static nvlist_t * ioctl_ns_get(int fd, const char *name);
+static nvlist_t * cache_load(uint64_t *genp);
+static void cache_save(const void *buf, size_t len, uint64_t gen);
+static bool ioctl_diff(int fd, const nvlist_t *nvl);
+static void ioctl_batch(int fd, nvecho_op_t *ops, size_t count);
+static void ioctl_query(int fd, const char *name, const char * const *paths, size_t count);
+static void ioctl_ns_set_all(int fd, const nvlist_t *nvl);
+static void ioctl_upload(int fd, const char *name, const void *buf, size_t len);
+static void watch(int fd);
+static nvlist_t * ioctl_history(int fd, int op, const char *name, uint64_t gen);
+static uint64_t parse_gen(const char *arg);
+static size_t sysctl_fetch(const char *oid, const void *new, size_t newlen);
+static nvlist_t * sysctl_query(const char *path);
+static void ioctl_ns_set(int fd, const char *name, const nvlist_t *nvl);
+static void pack(const nvlist_t *nvl, void **bufp, size_t *lenp);
 
 static char *program;
-static enum {IOCTL_GET, IOCTL_SET, SYSCTL_GET, SYSCTL_SET} action = IOCTL_GET;
+static enum {IOCTL_GET, IOCTL_SET, IOCTL_DIFF, IOCTL_NSDEL, IOCTL_WATCH, IOCTL_HISTORY, SYSCTL_GET, SYSCTL_SET} action = IOCTL_GET;
+static bool compact = false;
+static bool allns = false;
+static const char *ns = NULL;
+static const char *paths[ECHO_BATCHMAX];
+static size_t npaths = 0;
+static struct {
+	void	*gb_buf;
+	size_t	 gb_cap;
+} getbuf;
+static const char *schemafile = NULL;
+static struct schema *schema = NULL;
+static int histop = 0;
+static uint64_t histgen = 0;
+static const char *cachefile = NULL;
+
+/* First guess at the size of a path query result. */
+#define QUERY_BUFSIZE	1024
+/* First size of the buffer gets are read into. */
+#define GET_BUFSIZE	(64 * 1024)
+/* Configs larger than this are sent as a chunked upload. */
+#define UPLOAD_THRESHOLD	(1024 * 1024)
 
 static void
 usage() {
-	printf("Usage: %s [-ghs] [-i config file]\n", program);
+	printf("Usage: %s [-acghlms] [-C cache file] [-d config file] [-i config file] [-n namespace] [-p path] [-r namespace] [-S schema] [-u generation] [-v generation] [-w]\n", program);
 }
 
 static void
@@ -130,182 +173,580 @@ print_nv(const nvlist_t *nvl) {
 	}
 }
 
-static void
-print_nvlist(const nvlist_t *nvl) {
-	print_nv(nvl);
-	xo_finish();
+static nvlist_t *
+ucl2nv(struct ucl_parser *parser) {
+	nvlist_t *nvl;
+	ucl_object_t *top;
+	const ucl_object_t *obj;
+	ucl_object_iter_t it = NULL;
+
+	top = ucl_parser_get_object(parser);
+	if (top == NULL) {
+		err(1, "UCL get object");
+	}
+	nvl = nvlist_create(0);
+	if (nvl == NULL) {
+		err(1, "nvlist_create");
+	}
+	while ((obj = ucl_iterate_object(top, &it, true))) {
+		uclobj2nv(nvl, obj, NULL, schema);
+	}
+	schema_required(schema, top, "config");
+	ucl_object_unref(top);
+	tmpl_free();
+	
+	return nvl;
 }
 
-static void
-array_add(nvlist_t *nvl, const char *key, const ucl_object_t *obj) {
-	bool bvalue;
-	uint64_t ivalue = 0;
-	const char *svalue = NULL;
-	nvlist_t *nested = NULL;
-	const ucl_object_t *cur = NULL;
-	ucl_object_iter_t it = NULL;
+/*
+ * Make the get buffer hold at least size bytes.  It is kept across gets and
+ * only ever grows.
+ */
+static void *
+getbuf_grow(size_t size) {
+	size_t cap = getbuf.gb_cap == 0 ? GET_BUFSIZE : getbuf.gb_cap;
 
-	switch(obj->type) {
-		case UCL_OBJECT:
-			nested = nvlist_create(0);
-			while ((cur = ucl_iterate_object(obj, &it, true))) {
-				uclobj2nv(nested, cur);
-			}
-			if (nvlist_exists_nvlist_array(nvl, key)) {
-				nvlist_append_nvlist_array(nvl, key, nested);
-			} else {
-				nvlist_add_nvlist_array(nvl, key, (const nvlist_t * const *)&nested, 1);
+	while (cap < size) {
+		cap *= 2;
+	}
+	if (cap != getbuf.gb_cap) {
+		getbuf.gb_buf = realloc(getbuf.gb_buf, cap);
+		if (getbuf.gb_buf == NULL) {
+			err(1, "realloc");
+		}
+		getbuf.gb_cap = cap;
+	}
+	return getbuf.gb_buf;
+}
+
+/*
+ * Read the packed config of namespace name, or the global one if name is
+ * NULL, into the get buffer.  That takes one call unless the buffer has to
+ * grow first.  *genp is set to the generation of what was read.  If it is
+ * nonzero on entry and still current, nothing is read and EALREADY is
+ * returned.  Returns ENOENT if there is no such config.
+ *
+ * A retry after growing the buffer asks for the same thing again, not for
+ * the generation whose size was reported: the config may have been replaced
+ * in between, and the retry then reads the newer one or grows again.
+ */
+static int
+ioctl_fetch(int fd, const char *name, size_t *lenp, uint64_t *genp) {
+	nvecho_get_t get = {0};
+
+	if (name != NULL && strlcpy(get.ns, name, sizeof(get.ns)) >= sizeof(get.ns)) {
+		errx(1, "namespace name too long: %s", name);
+	}
+	get.buf = getbuf_grow(0);
+	get.cap = getbuf.gb_cap;
+	for (;;) {
+		get.gen = *genp;
+		if (ioctl(fd, ECHO_IOCTL_GET, &get) < 0) {
+			if (errno == ENOENT) {
+				return ENOENT;
 			}
+			err(1, "ioctl(/dev/echo) get");
+		}
+		if (get.error != ERANGE) {
 			break;
-		case UCL_INT:
-			ivalue = ucl_object_toint(obj);
-			if (nvlist_exists_number_array(nvl, key)) {
-				nvlist_append_number_array(nvl, key, ivalue);
-			} else {
-				nvlist_add_number_array(nvl, key, &ivalue, 1);
+		}
+		get.buf = getbuf_grow(get.len);
+		get.cap = getbuf.gb_cap;
+	}
+	if (get.error == EALREADY) {
+		return EALREADY;
+	}
+	if (get.error != 0) {
+		errc(1, get.error, "ioctl(/dev/echo) get");
+	}
+	*lenp = get.len;
+	*genp = get.gen;
+	return 0;
+}
+
+static nvlist_t *
+ioctl_get(int fd) {
+	nvlist_t *nvl = NULL;
+	uint64_t gen = 0;
+	size_t len = 0;
+
+	if (ioctl_fetch(fd, NULL, &len, &gen) == ENOENT) {
+		return NULL;
+	}
+	nvl = nvlist_unpack(getbuf.gb_buf, len, 0);
+	if (nvl == NULL) {
+		err(1, "unpacking nvlist data");
+	}
+	return nvl;
+}
+
+static nvlist_t *
+ioctl_ns_get(int fd, const char *name) {
+	nvlist_t *nvl = NULL;
+	uint64_t gen = 0;
+	size_t len = 0;
+
+	if (ioctl_fetch(fd, name, &len, &gen) == ENOENT) {
+		errc(1, ENOENT, "ioctl(/dev/echo) namespace %s", name);
+	}
+	nvl = nvlist_unpack(getbuf.gb_buf, len, 0);
+	if (nvl == NULL) {
+		err(1, "unpacking nvlist data");
+	}
+	return nvl;
+}
+
+/*
+ * Read the config kept in the cache file and the generation it was current
+ * at.  Returns NULL, with *genp 0, if there is no usable cache.
+ */
+static nvlist_t *
+cache_load(uint64_t *genp) {
+	nvlist_t *nvl = NULL;
+	FILE *fp = NULL;
+	void *buf = NULL;
+	long len = 0;
+
+	*genp = 0;
+	if (cachefile == NULL || (fp = fopen(cachefile, "r")) == NULL) {
+		return NULL;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > (long)sizeof(*genp) &&
+	    fseek(fp, 0, SEEK_SET) == 0 && (buf = malloc(len)) != NULL &&
+	    fread(buf, 1, len, fp) == (size_t)len) {
+		nvl = nvlist_unpack((char *)buf + sizeof(*genp), len - sizeof(*genp), 0);
+		if (nvl != NULL) {
+			memcpy(genp, buf, sizeof(*genp));
+		}
+	}
+	free(buf);
+	fclose(fp);
+	return nvl;
+}
+
+/*
+ * Replace the cache file with the packed config in buf, current at gen.  It
+ * is written aside and renamed into place, so a reader never sees half of
+ * it.  A cache that cannot be written is only worth a warning.
+ */
+static void
+cache_save(const void *buf, size_t len, uint64_t gen) {
+	char tmp[PATH_MAX];
+	FILE *fp = NULL;
+	bool ok = false;
+
+	if (cachefile == NULL) {
+		return;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", cachefile) >= (int)sizeof(tmp)) {
+		warnx("cache file name too long: %s", cachefile);
+		return;
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		warn("%s", tmp);
+		return;
+	}
+	ok = fwrite(&gen, sizeof(gen), 1, fp) == 1 && fwrite(buf, 1, len, fp) == len;
+	if (fclose(fp) != 0 || !ok || rename(tmp, cachefile) != 0) {
+		warn("writing %s", cachefile);
+		unlink(tmp);
+	}
+}
+
+/*
+ * Send nvl as a patch against the global config.  The config it is diffed
+ * against is the cached one if that is still current, so an unchanged
+ * config is not read back at all, and the one read from the kernel
+ * otherwise.  The patch only applies to the generation it was made
+ * against; if another publish gets in first it is made again.  The cache
+ * then holds nvl at the generation it was published as.  Returns false,
+ * sending nothing, if there is no config to patch.
+ */
+static bool
+ioctl_diff(int fd, const nvlist_t *nvl) {
+	nvecho_patch_t data = {0};
+	nvlist_t *old = NULL;
+	nvlist_t *patch = NULL;
+	uint64_t gen = 0;
+	size_t len = 0;
+	int error = 0;
+
+	old = cache_load(&gen);
+	for (;;) {
+		error = ioctl_fetch(fd, NULL, &len, &gen);
+		if (error == ENOENT) {
+			nvlist_destroy(old);
+			return false;
+		}
+		if (error == 0) {
+			nvlist_destroy(old);
+			old = nvlist_unpack(getbuf.gb_buf, len, 0);
+			if (old == NULL) {
+				err(1, "unpacking nvlist data");
 			}
+			cache_save(getbuf.gb_buf, len, gen);
+		}
+		acct_stage("diff");
+		patch = nv_diff(old, nvl);
+		acct_stage("send");
+		pack(patch, &data.buf, &data.len);
+		nvlist_destroy(patch);
+		data.base = gen;
+		if (ioctl(fd, ECHO_IOCTL_PATCHGEN, &data) == 0) {
 			break;
-		case UCL_FLOAT:
-			break;
-		case UCL_STRING:
-			svalue = ucl_object_tostring(obj);
-			if (nvlist_exists_string_array(nvl, key)) {
-				nvlist_append_string_array(nvl, key, svalue);
-			} else {
-				nvlist_add_string_array(nvl, key, &svalue, 1);
+		}
+		if (errno != ESTALE) {
+			err(1, "ioctl(/dev/echo) patch");
+		}
+		free(data.buf);
+	}
+	free(data.buf);
+	nvlist_destroy(old);
+	if (cachefile != NULL) {
+		data.buf = nvlist_pack(nvl, &data.len);
+		if (data.buf == NULL) {
+			err(1, "nvlist_pack");
+		}
+		cache_save(data.buf, data.len, data.gen);
+		free(data.buf);
+	}
+	return true;
+}
+
+static void
+ioctl_batch(int fd, nvecho_op_t *ops, size_t count) {
+	nvecho_batch_t batch = {0};
+
+	batch.ops = ops;
+	batch.count = count;
+	if (ioctl(fd, ECHO_IOCTL_BATCH, &batch) < 0) {
+		err(1, "ioctl(/dev/echo) batch");
+	}
+}
+
+/*
+ * Run all queries in one batch and print the results in order.  Results that
+ * did not fit get a buffer of the size reported and the batch is run again.
+ */
+static void
+ioctl_query(int fd, const char *name, const char * const *paths, size_t count) {
+	nvecho_op_t *ops = NULL;
+	nvlist_t *nvl = NULL;
+	bool retry = false;
+	size_t i;
+
+	ops = calloc(count, sizeof(*ops));
+	if (ops == NULL) {
+		err(1, "calloc");
+	}
+	for (i = 0; i < count; ++i) {
+		ops[i].op = ECHO_OP_QUERY;
+		if (name != NULL) {
+			strlcpy(ops[i].ns, name, sizeof(ops[i].ns));
+		}
+		ops[i].path = paths[i];
+		ops[i].pathlen = strlen(paths[i]);
+		ops[i].len = QUERY_BUFSIZE;
+		ops[i].buf = malloc(ops[i].len);
+		if (ops[i].buf == NULL) {
+			err(1, "malloc");
+		}
+	}
+	do {
+		ioctl_batch(fd, ops, count);
+		retry = false;
+		for (i = 0; i < count; ++i) {
+			if (ops[i].error != ERANGE) {
+				continue;
 			}
-			break;
-		case UCL_BOOLEAN:
-			bvalue = ucl_object_toboolean(obj);
-			if (nvlist_exists_bool_array(nvl, key)) {
-				nvlist_append_bool_array(nvl, key, bvalue);
-			} else {
-				nvlist_add_bool_array(nvl, key, &bvalue, 1);
+			free(ops[i].buf);
+			ops[i].buf = malloc(ops[i].len);
+			if (ops[i].buf == NULL) {
+				err(1, "malloc");
 			}
-			break;
-		case UCL_TIME:
-			break;
+			retry = true;
+		}
+	} while (retry);
+	for (i = 0; i < count; ++i) {
+		if (ops[i].error != 0) {
+			errc(1, ops[i].error, "query %s", paths[i]);
+		}
+		nvl = nvlist_unpack(ops[i].buf, ops[i].len, 0);
+		if (nvl == NULL) {
+			err(1, "unpacking nvlist data");
+		}
+		print_nv(nvl);
+		nvlist_destroy(nvl);
+		free(ops[i].buf);
 	}
+	free(ops);
 }
 
+/*
+ * Print every new generation as it is published, along with the values at
+ * the paths asked for.  Runs until interrupted.
+ */
 static void
-uclobj2nv(nvlist_t *nvl, const ucl_object_t *top) {
-	nvlist_t *nested = NULL;
-	const char *key = NULL, *svalue = NULL;
-	const ucl_object_t *obj = NULL, *cur = NULL;
-	ucl_object_iter_t it = NULL, itobj = NULL;
-	bool bvalue;
-	uint64_t ivalue = 0;
-
-	if (nvl == NULL || top == NULL) {
-		err(1, "NVList or UCL object is NULL in uclobj2nv");
-	}
-
-	while ((obj = ucl_iterate_object(top, &it, false))) {
-		key = ucl_object_key(obj);
-		switch(obj->type) {
-			case UCL_OBJECT:
-				nested = nvlist_create(0);
-				while ((cur = ucl_iterate_object(obj, &itobj, true))) {
-					uclobj2nv(nested, cur);
-				}
-				if (nvlist_exists_nvlist_array(nvl, key)) {
-					nvlist_append_nvlist_array(nvl, key, nested);
-				} else if (obj->next != NULL) {
-					nvlist_add_nvlist_array(nvl, key, (const nvlist_t * const *)&nested, 1);
-				} else {
-					nvlist_add_nvlist(nvl, key, nested);
-				}
-				break;
-			case UCL_ARRAY:
-				while ((cur = ucl_iterate_object(obj, &itobj, true))) {
-					array_add(nvl, key, cur);
-				}
-				break;
-			case UCL_INT:
-				ivalue = ucl_object_toint(obj);
-				if (nvlist_exists_number_array(nvl, key)) {
-					nvlist_append_number_array(nvl, key, ivalue);
-				} else if (obj->next != NULL) {
-					nvlist_add_number_array(nvl, key, &ivalue, 1);
-				} else {
-					nvlist_add_number(nvl, key, ivalue);
-				}
-				break;
-			case UCL_FLOAT:
-				break;
-			case UCL_STRING:
-				svalue = ucl_object_tostring_forced(obj);
-				if (nvlist_exists_string_array(nvl, key)) {
-					nvlist_append_string_array(nvl, key, svalue);
-				} else if (obj->next != NULL) {
-					nvlist_add_string_array(nvl, key, &svalue, 1);
-				} else {
-					nvlist_add_string(nvl, key, svalue);
-				}
-				break;
-			case UCL_BOOLEAN:
-				bvalue = ucl_object_toboolean(obj);
-				if (nvlist_exists_bool_array(nvl, key)) {
-					nvlist_append_bool_array(nvl, key, bvalue);
-				} else if (obj->next != NULL) {
-					nvlist_add_bool_array(nvl, key, &bvalue, 1);
-				} else {
-					nvlist_add_bool(nvl, key, bvalue);
-				}
-				break;
-			case UCL_TIME:
-				break;
-			case UCL_USERDATA:
-				nvlist_add_binary(nvl, key, obj->value.ud, obj->len);
-				break;
-			case UCL_NULL:
-				nvlist_add_null(nvl, key);
-				break;
-			default:
-				err(1, "unknown UCL type");
-				break;
+watch(int fd) {
+	nvecho_wait_t wait = {0};
+
+	if (ioctl(fd, ECHO_IOCTL_GEN, &wait.gen) < 0) {
+		err(1, "ioctl(/dev/echo) generation");
+	}
+	xo_open_list("generation");
+	for (;;) {
+		xo_open_instance("generation");
+		xo_emit("{:generation/%ju}\n", (uintmax_t)wait.gen);
+		if (npaths > 0) {
+			ioctl_query(fd, ns, paths, npaths);
+		}
+		xo_close_instance("generation");
+		xo_flush();
+		if (ioctl(fd, ECHO_IOCTL_WAIT, &wait) < 0) {
+			err(1, "ioctl(/dev/echo) wait");
 		}
 	}
 }
 
+/*
+ * Run a history request on namespace name, or on the global config if name
+ * is NULL.  Returns the nvlist sent back, or NULL for a rollback.
+ */
 static nvlist_t *
-ucl2nv(struct ucl_parser *parser) {
-	nvlist_t *nvl;
-	ucl_object_t *top;
-	const ucl_object_t *obj;
-	ucl_object_iter_t it = NULL;
+ioctl_history(int fd, int op, const char *name, uint64_t gen) {
+	nvecho_history_t hist = {0};
+	nvlist_t *nvl = NULL;
 
-	top = ucl_parser_get_object(parser);
-	if (top == NULL) {
-		err(1, "UCL get object");
+	hist.op = op;
+	hist.gen = gen;
+	if (name != NULL) {
+		strlcpy(hist.ns, name, sizeof(hist.ns));
 	}
-	nvl = nvlist_create(0);
+	if (op == ECHO_HISTORY_ROLLBACK) {
+		if (ioctl(fd, ECHO_IOCTL_HISTORY, &hist) < 0) {
+			err(1, "ioctl(/dev/echo) rollback to %ju", (uintmax_t)gen);
+		}
+		return NULL;
+	}
+	hist.len = QUERY_BUFSIZE;
+	for (;;) {
+		hist.buf = malloc(hist.len);
+		if (hist.buf == NULL) {
+			err(1, "malloc");
+		}
+		if (ioctl(fd, ECHO_IOCTL_HISTORY, &hist) < 0) {
+			err(1, "ioctl(/dev/echo) history");
+		}
+		if (hist.error != ERANGE) {
+			break;
+		}
+		/* len is now the size needed. */
+		free(hist.buf);
+	}
+	nvl = nvlist_unpack(hist.buf, hist.len, 0);
 	if (nvl == NULL) {
-		err(1, "nvlist_create");
+		err(1, "unpacking nvlist data");
 	}
-	while ((obj = ucl_iterate_object(top, &it, true))) {
-		uclobj2nv(nvl, obj);
+	free(hist.buf);
+	return nvl;
+}
+
+static uint64_t
+parse_gen(const char *arg) {
+	char *end = NULL;
+	uint64_t gen;
+
+	errno = 0;
+	gen = strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0') {
+		errx(1, "invalid generation: %s", arg);
+	}
+	return gen;
+}
+
+/*
+ * Read sysctl oid into the get buffer, writing new first if not NULL.  The
+ * size is only asked for when the buffer turns out too small.
+ */
+static size_t
+sysctl_fetch(const char *oid, const void *new, size_t newlen) {
+	size_t len = 0;
+
+	getbuf_grow(0);
+	for (;;) {
+		len = getbuf.gb_cap;
+		if (sysctlbyname(oid, getbuf.gb_buf, &len, new, newlen) == 0) {
+			return len;
+		}
+		if (errno != ENOMEM) {
+			err(1, "sysctl %s", oid);
+		}
+		if (sysctlbyname(oid, NULL, &len, new, newlen) != 0) {
+			err(1, "sysctl %s", oid);
+		}
+		getbuf_grow(len);
+	}
+}
+
+static nvlist_t *
+sysctl_query(const char *path) {
+	size_t len = 0;
+	nvlist_t *nvl = NULL;
+
+	len = sysctl_fetch("kern.echo.query", path, strlen(path));
+	nvl = nvlist_unpack(getbuf.gb_buf, len, 0);
+	if (nvl == NULL) {
+		err(1, "unpacking nvlist data");
 	}
-	ucl_object_unref(top);
-	
 	return nvl;
 }
 
+/*
+ * Send buf in ECHO_CHUNKMAX sized chunks, to namespace name or to the global
+ * config if name is NULL.
+ */
+static void
+ioctl_upload(int fd, const char *name, const void *buf, size_t len) {
+	nvecho_upload_t up = {0};
+	size_t off;
+
+	if (name != NULL) {
+		strlcpy(up.ns, name, sizeof(up.ns));
+	}
+	up.op = ECHO_UPLOAD_BEGIN;
+	up.size = len;
+	up.hash = echo_hash(ECHO_HASH_INIT, buf, len);
+	if (ioctl(fd, ECHO_IOCTL_UPLOAD, &up) < 0) {
+		err(1, "ioctl(/dev/echo) upload begin");
+	}
+	up.op = ECHO_UPLOAD_CHUNK;
+	for (off = 0; off < len; off += up.len) {
+		up.off = off;
+		up.buf = (const char *)buf + off;
+		up.len = len - off < ECHO_CHUNKMAX ? len - off : ECHO_CHUNKMAX;
+		if (ioctl(fd, ECHO_IOCTL_UPLOAD, &up) < 0) {
+			err(1, "ioctl(/dev/echo) upload chunk at %zu", off);
+		}
+	}
+	up.op = ECHO_UPLOAD_COMMIT;
+	if (ioctl(fd, ECHO_IOCTL_UPLOAD, &up) < 0) {
+		err(1, "ioctl(/dev/echo) upload commit");
+	}
+}
+
+/*
+ * Set every top level block of nvl as the namespace of the same name, up to
+ * ECHO_BATCHMAX namespaces per call.
+ */
+static void
+ioctl_ns_set_all(int fd, const nvlist_t *nvl) {
+	nvecho_op_t *ops = NULL;
+	const char *name = NULL;
+	void *cookie = NULL;
+	int type = 0, failed = 0;
+	size_t count = 0, i;
+
+	ops = calloc(ECHO_BATCHMAX, sizeof(*ops));
+	if (ops == NULL) {
+		err(1, "calloc");
+	}
+	do {
+		name = nvlist_next(nvl, &type, &cookie);
+		if (name != NULL && type == NV_TYPE_NVLIST) {
+			ops[count].op = ECHO_OP_SET;
+			if (strlcpy(ops[count].ns, name, sizeof(ops[count].ns)) >= sizeof(ops[count].ns)) {
+				errx(1, "namespace name too long: %s", name);
+			}
+			pack(nvlist_get_nvlist(nvl, name), &ops[count].buf, &ops[count].len);
+			if (ops[count].len > UPLOAD_THRESHOLD) {
+				ioctl_upload(fd, name, ops[count].buf, ops[count].len);
+				free(ops[count].buf);
+				memset(&ops[count], 0, sizeof(ops[count]));
+			} else {
+				++count;
+			}
+		}
+		if (count == ECHO_BATCHMAX || (name == NULL && count > 0)) {
+			ioctl_batch(fd, ops, count);
+			for (i = 0; i < count; ++i) {
+				if (ops[i].error != 0) {
+					warnc(ops[i].error, "namespace %s", ops[i].ns);
+					failed = 1;
+				}
+				free(ops[i].buf);
+			}
+			memset(ops, 0, count * sizeof(*ops));
+			count = 0;
+		}
+	} while (name != NULL);
+	free(ops);
+	if (failed) {
+		exit(1);
+	}
+}
+
+static void
+ioctl_ns_set(int fd, const char *name, const nvlist_t *nvl) {
+	nvecho_ns_t data = {0};
+
+	if (strlcpy(data.name, name, sizeof(data.name)) >= sizeof(data.name)) {
+		errx(1, "namespace name too long: %s", name);
+	}
+	pack(nvl, &data.buf, &data.len);
+	if (data.len > UPLOAD_THRESHOLD) {
+		ioctl_upload(fd, name, data.buf, data.len);
+	} else if (ioctl(fd, ECHO_IOCTL_NSSET, &data) < 0) {
+		err(1, "ioctl(/dev/echo) namespace %s", name);
+	}
+	free(data.buf);
+}
+
+static void
+pack(const nvlist_t *nvl, void **bufp, size_t *lenp) {
+	int error;
+
+	if (compact) {
+		error = echo_compact_encode(nvl, bufp, lenp);
+		if (error) {
+			errc(1, error, "compact encoding");
+		}
+	} else {
+		*bufp = nvlist_pack(nvl, lenp);
+		if (*bufp == NULL) {
+			err(1, "nvlist_pack");
+		}
+	}
+}
+
 int
 main(int argc, char **argv) {
 	size_t size;
 	int ch, r = 0, fd, rc;
 	nvecho_t data = {0};
 	const char *config;
+	char oid[sizeof("kern.echo.ns.") + ECHO_NSNAMELEN] = "kern.echo.config";
 
 	program = argv[0];
 	argc = xo_parse_args(argc, argv);
 	if (argc < 0) {
 		exit(1);
 	}
-	while ((ch = getopt(argc, argv, "ghi:s:q")) != -1) {
+	while ((ch = getopt(argc, argv, "acC:d:ghi:lmn:p:r:s:S:qu:v:w")) != -1) {
 		switch (ch) {
+			case 'a':
+				allns = true;
+				break;
+			case 'c':
+				compact = true;
+				break;
+			case 'C':
+				cachefile = optarg;
+				break;
+			case 'd':
+				action = IOCTL_DIFF;
+				config = optarg;
+				break;
 			case 'g':
 				action = IOCTL_GET;
 				break;
@@ -316,13 +757,49 @@ main(int argc, char **argv) {
 				action = IOCTL_SET;
 				config = optarg;
 				break;
+			case 'l':
+				action = IOCTL_HISTORY;
+				histop = ECHO_HISTORY_LIST;
+				break;
+			case 'm':
+				acct_enable();
+				break;
+			case 'n':
+				ns = optarg;
+				break;
+			case 'p':
+				if (npaths == ECHO_BATCHMAX) {
+					errx(1, "too many paths");
+				}
+				paths[npaths++] = optarg;
+				break;
+			case 'r':
+				action = IOCTL_NSDEL;
+				ns = optarg;
+				break;
 			case 's':
 				action = SYSCTL_SET;
 				config = optarg;
 				break;
+			case 'S':
+				schemafile = optarg;
+				break;
 			case 'q':
 				action = SYSCTL_GET;
 				break;
+			case 'u':
+				action = IOCTL_HISTORY;
+				histop = ECHO_HISTORY_ROLLBACK;
+				histgen = parse_gen(optarg);
+				break;
+			case 'v':
+				action = IOCTL_HISTORY;
+				histop = ECHO_HISTORY_GET;
+				histgen = parse_gen(optarg);
+				break;
+			case 'w':
+				action = IOCTL_WATCH;
+				break;
 			case '?':
 			default:
 				usage();
@@ -331,38 +808,97 @@ main(int argc, char **argv) {
 	}
 	argc -= optind;
 	argv += optind;
+	if (ns != NULL) {
+		if (action == IOCTL_DIFF) {
+			errx(1, "-d does not work on namespaces");
+		}
+		snprintf(oid, sizeof(oid), "kern.echo.ns.%s", ns);
+	}
+	if (cachefile != NULL && action != IOCTL_DIFF) {
+		errx(1, "-C only works with -d");
+	}
+	if (allns && action != IOCTL_SET) {
+		errx(1, "-a only works with -i");
+	}
+	if (npaths > 0) {
+		if (action != IOCTL_GET && action != SYSCTL_GET &&
+		    action != IOCTL_WATCH) {
+			errx(1, "-p only works with -g, -q and -w");
+		}
+		if (action == SYSCTL_GET && ns != NULL) {
+			errx(1, "-p does not work on namespaces with -q");
+		}
+	}
 
-	if (action == IOCTL_SET || action == SYSCTL_SET) {
+	if (action == IOCTL_SET || action == IOCTL_DIFF || action == SYSCTL_SET) {
 		nvlist_t *nvl = NULL;
-		struct ucl_parser *parser = ucl_parser_new(0);
+		struct ucl_parser *parser = NULL;
 
+		acct_stage("parse");
+		if (schemafile != NULL) {
+			schema = schema_load(schemafile);
+		}
+		parser = ucl_parser_new(0);
 		if (!ucl_parser_add_file(parser, config)) {
 			err(1, "Parsing %s", config);
 		}
 		if (ucl_parser_get_error(parser)) {
 			err(1, "UCL parser");
 		}
+		acct_stage("convert");
 		nvl = ucl2nv(parser);
 		ucl_parser_free(parser);
+		schema_free(schema);
 		if (nvl == NULL) {
 			err(1, "empty config nvlist");
 		}
-		print_nvlist(nvl);
-		data.buf = nvlist_pack(nvl, &data.len);
-		nvlist_destroy(nvl);
+		if (ns != NULL) {
+			nvlist_t *block = NULL;
 
-		if (action == IOCTL_SET) {
+			if (!nvlist_exists_nvlist(nvl, ns)) {
+				errx(1, "%s has no %s block", config, ns);
+			}
+			block = nvlist_take_nvlist(nvl, ns);
+			nvlist_destroy(nvl);
+			nvl = block;
+		}
+		acct_stage("print");
+		print_nv(nvl);
+		xo_flush();
+		acct_stage("send");
+		if (action != SYSCTL_SET) {
 			fd = open("/dev/echo", O_RDWR);
 			if (fd < 0) {
 				err(1, "open(/dev/echo)");
 			}
-			rc = ioctl(fd, ECHO_IOCTL, &data);
-			if (rc < 0) {
-				err(1, "ioctl(/dev/echo)");
+		}
+		if (action == IOCTL_DIFF && ioctl_diff(fd, nvl)) {
+			nvlist_destroy(nvl);
+			close(fd);
+		} else if (allns) {
+			ioctl_ns_set_all(fd, nvl);
+			nvlist_destroy(nvl);
+			close(fd);
+		} else if (ns != NULL && action == IOCTL_SET) {
+			ioctl_ns_set(fd, ns, nvl);
+			nvlist_destroy(nvl);
+			close(fd);
+		} else if (action != SYSCTL_SET) {
+			pack(nvl, &data.buf, &data.len);
+			nvlist_destroy(nvl);
+			if (data.len > UPLOAD_THRESHOLD) {
+				ioctl_upload(fd, NULL, data.buf, data.len);
+			} else {
+				rc = ioctl(fd, ECHO_IOCTL, &data);
+				if (rc < 0) {
+					err(1, "ioctl(/dev/echo)");
+				}
 			}
 			close (fd);
 		} else {
-			rc = sysctlbyname("kern.echo.config", NULL, NULL, data.buf, data.len);
+			pack(nvl, &data.buf, &data.len);
+			nvlist_destroy(nvl);
+			rc = sysctlbyname(oid, NULL, NULL, data.buf, data.len);
 			if (rc != 0) {
 				err(1, "Set sysctl value");
 			}
@@ -370,51 +906,98 @@ main(int argc, char **argv) {
 	} else if (action == IOCTL_GET) {
 		nvlist_t *nvl = NULL;
 
+		acct_stage("get");
 		fd = open("/dev/echo", O_RDWR);
 		if (fd < 0) {
 			err(1, "open(/dev/echo)");
 		}
-		rc = ioctl(fd, ECHO_IOCTL, &data);
-		if (rc < 0) {
-			err(1, "ioctl(/dev/echo)");
+		if (npaths > 0) {
+			ioctl_query(fd, ns, paths, npaths);
+		} else if (ns != NULL) {
+			nvl = ioctl_ns_get(fd, ns);
+			xo_open_container(ns);
+			print_nv(nvl);
+			xo_close_container(ns);
+		} else {
+			nvl = ioctl_get(fd);
+			if (nvl == NULL) {
+				err(1, "ioctl(/dev/echo)");
+			}
+			print_nv(nvl);
 		}
-		data.buf = malloc(data.len);
-		data.len = 0;
-		rc = ioctl(fd, ECHO_IOCTL, &data);
-		if (rc < 0) {
-			err(1, "ioctl(/dev/echo)");
+		nvlist_destroy(nvl);
+		close (fd);
+	} else if (action == SYSCTL_GET && npaths > 0) {
+		nvlist_t *nvl = NULL;
+
+		acct_stage("get");
+		for (size_t i = 0; i < npaths; ++i) {
+			nvl = sysctl_query(paths[i]);
+			print_nv(nvl);
+			nvlist_destroy(nvl);
+		}
+	} else if (action == SYSCTL_GET) {
+		nvlist_t *nvl = NULL;
+
+		acct_stage("get");
+		size = sysctl_fetch(oid, NULL, 0);
+		if (size == 0) {
+			errx(1, "no config available");
 		}
-		nvl = nvlist_unpack(data.buf, data.len, 0);
+		nvl = nvlist_unpack(getbuf.gb_buf, size, 0);
 		if (nvl == NULL) {
 			err(1, "unpacking nvlist data");
 		}
-		print_nvlist(nvl);
+		print_nv(nvl);
 		nvlist_destroy(nvl);
-		close (fd);
-	} else if (action == SYSCTL_GET) {
+	} else if (action == IOCTL_WATCH) {
+		fd = open("/dev/echo", O_RDONLY);
+		if (fd < 0) {
+			err(1, "open(/dev/echo)");
+		}
+		watch(fd);
+	} else if (action == IOCTL_HISTORY) {
 		nvlist_t *nvl = NULL;
+		const uint64_t *gens = NULL;
+		size_t count = 0;
 
-		rc = sysctlbyname("kern.echo.config", NULL, &data.len, NULL, 0);
-		if (rc != 0) {
-			err(1, "Get sysctl size");
+		fd = open("/dev/echo", O_RDWR);
+		if (fd < 0) {
+			err(1, "open(/dev/echo)");
 		}
-		if (data.len == 0) {
-			err(1, "no config available");
+		nvl = ioctl_history(fd, histop, ns, histgen);
+		if (histop == ECHO_HISTORY_LIST) {
+			if (nvlist_exists_number_array(nvl, ECHO_HISTORY_GENS)) {
+				gens = nvlist_get_number_array(nvl, ECHO_HISTORY_GENS, &count);
+			}
+			xo_open_list("generation");
+			for (size_t i = 0; i < count; ++i) {
+				xo_emit("{l:generation/%ju}\n", (uintmax_t)gens[i]);
+			}
+			xo_close_list("generation");
+		} else if (nvl != NULL) {
+			print_nv(nvl);
 		}
-		data.buf = malloc(data.len);
-		rc = sysctlbyname("kern.echo.config", data.buf, &data.len, NULL, 0);
-		if (rc != 0) {
-			err(1, "Get sysctl value");
+		nvlist_destroy(nvl);
+		close(fd);
+	} else if (action == IOCTL_NSDEL) {
+		nvecho_ns_t nsdata = {0};
+
+		strlcpy(nsdata.name, ns, sizeof(nsdata.name));
+		fd = open("/dev/echo", O_RDWR);
+		if (fd < 0) {
+			err(1, "open(/dev/echo)");
 		}
-		nvl = nvlist_unpack(data.buf, data.len, 0);
-		if (nvl == NULL) {
-			err(1, "unpacking nvlist data");
+		if (ioctl(fd, ECHO_IOCTL_NSDEL, &nsdata) < 0) {
+			err(1, "ioctl(/dev/echo) namespace %s", ns);
 		}
-		print_nvlist(nvl);
-		nvlist_destroy(nvl);
+		close(fd);
 	}
 	if (data.buf != NULL) {
 		free(data.buf);
 	}
+	free(getbuf.gb_buf);
+	acct_report();
+	xo_finish();
 	return 0;
 }
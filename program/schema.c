@@ -0,0 +1,306 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucl.h>
+
+#include "echo.h"
+#include "schema.h"
+#include "acct.h"
+
+/*
+ * Config schemas, in the JSON schema subset of "type", "properties",
+ * "additionalProperties", "items" and "required".  A schema is compiled
+ * once into a tree of nodes, each with a type mask and its property names
+ * interned in a hash table, and the config is checked against it while it
+ * is converted: every key is one hash lookup and every value one mask test.
+ *
+ * nvlists have no floating point, so "number" means the same as "integer".
+ */
+
+#define SCH_OBJECT	0x01
+#define SCH_ARRAY	0x02
+#define SCH_STRING	0x04
+#define SCH_INTEGER	0x08
+#define SCH_BOOLEAN	0x10
+#define SCH_NULL	0x20
+#define SCH_ANY		0x3f
+
+struct schema_prop {
+	const char	*sp_key;
+	size_t		 sp_len;
+	uint64_t	 sp_hash;
+	struct schema	*sp_schema;
+};
+
+struct schema {
+	u_int			 s_types;
+	struct schema_prop	*s_props;	/* open addressed, s_nprops slots */
+	size_t			 s_nprops;
+	bool			 s_closed;	/* no additional properties */
+	struct schema		*s_additional;
+	struct schema		*s_items;
+	const char		**s_required;
+	size_t			 s_nrequired;
+	ucl_object_t		*s_src;		/* parsed file, root only */
+};
+
+static const struct {
+	const char	*name;
+	u_int		 type;
+} schema_types[] = {
+	{ "object",	SCH_OBJECT },
+	{ "array",	SCH_ARRAY },
+	{ "string",	SCH_STRING },
+	{ "integer",	SCH_INTEGER },
+	{ "number",	SCH_INTEGER },
+	{ "boolean",	SCH_BOOLEAN },
+	{ "null",	SCH_NULL },
+};
+
+static struct schema *schema_compile(const ucl_object_t *obj);
+
+static u_int
+schema_type_name(const char *name) {
+	size_t i;
+
+	for (i = 0; i < sizeof(schema_types) / sizeof(schema_types[0]); ++i) {
+		if (strcmp(name, schema_types[i].name) == 0) {
+			return schema_types[i].type;
+		}
+	}
+	errx(1, "schema: unknown type %s", name);
+}
+
+static u_int
+schema_type_of(const ucl_object_t *obj) {
+	switch (obj->type) {
+		case UCL_OBJECT:
+			return SCH_OBJECT;
+		case UCL_ARRAY:
+			return SCH_ARRAY;
+		case UCL_STRING:
+		case UCL_USERDATA:
+			return SCH_STRING;
+		case UCL_INT:
+			return SCH_INTEGER;
+		case UCL_BOOLEAN:
+			return SCH_BOOLEAN;
+		case UCL_NULL:
+			return SCH_NULL;
+		default:
+			return 0;
+	}
+}
+
+static void
+schema_compile_props(struct schema *s, const ucl_object_t *props) {
+	const ucl_object_t *cur = NULL;
+	ucl_object_iter_t it = NULL;
+	struct schema_prop *prop = NULL;
+	size_t count = 0, len = 0, i;
+	const char *key = NULL;
+	uint64_t hash;
+
+	while (ucl_iterate_object(props, &it, true) != NULL) {
+		++count;
+	}
+	/* Keep the table at most half full. */
+	for (s->s_nprops = 4; s->s_nprops < count * 2; s->s_nprops *= 2) {
+		;
+	}
+	s->s_props = calloc(s->s_nprops, sizeof(*s->s_props));
+	if (s->s_props == NULL) {
+		err(1, "calloc");
+	}
+	it = NULL;
+	while ((cur = ucl_iterate_object(props, &it, true)) != NULL) {
+		key = ucl_object_keyl(cur, &len);
+		hash = echo_hash(ECHO_HASH_INIT, key, len);
+		for (i = hash & (s->s_nprops - 1); s->s_props[i].sp_key != NULL;
+		    i = (i + 1) & (s->s_nprops - 1)) {
+			;
+		}
+		prop = &s->s_props[i];
+		prop->sp_key = key;
+		prop->sp_len = len;
+		prop->sp_hash = hash;
+		prop->sp_schema = schema_compile(cur);
+	}
+}
+
+static struct schema *
+schema_compile(const ucl_object_t *obj) {
+	struct schema *s = NULL;
+	const ucl_object_t *cur = NULL, *elem = NULL;
+	ucl_object_iter_t it = NULL;
+
+	if (obj->type != UCL_OBJECT) {
+		errx(1, "schema: %s is not an object", ucl_object_key(obj));
+	}
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		err(1, "calloc");
+	}
+	s->s_types = SCH_ANY;
+	if ((cur = ucl_object_lookup(obj, "type")) != NULL) {
+		if (cur->type == UCL_ARRAY) {
+			s->s_types = 0;
+			while ((elem = ucl_iterate_object(cur, &it, true)) != NULL) {
+				s->s_types |= schema_type_name(ucl_object_tostring_forced(elem));
+			}
+		} else {
+			s->s_types = schema_type_name(ucl_object_tostring_forced(cur));
+		}
+	}
+	if ((cur = ucl_object_lookup(obj, "properties")) != NULL) {
+		schema_compile_props(s, cur);
+	}
+	if ((cur = ucl_object_lookup(obj, "additionalProperties")) != NULL) {
+		if (cur->type == UCL_BOOLEAN) {
+			s->s_closed = !ucl_object_toboolean(cur);
+		} else {
+			s->s_additional = schema_compile(cur);
+		}
+	}
+	if ((cur = ucl_object_lookup(obj, "items")) != NULL) {
+		s->s_items = schema_compile(cur);
+	}
+	if ((cur = ucl_object_lookup(obj, "required")) != NULL) {
+		it = NULL;
+		while ((elem = ucl_iterate_object(cur, &it, true)) != NULL) {
+			s->s_required = reallocarray(s->s_required, s->s_nrequired + 1,
+			    sizeof(*s->s_required));
+			if (s->s_required == NULL) {
+				err(1, "reallocarray");
+			}
+			s->s_required[s->s_nrequired++] = ucl_object_tostring_forced(elem);
+		}
+	}
+	return s;
+}
+
+/*
+ * The compiled schema points into the parsed file, which is kept until
+ * schema_free().
+ */
+struct schema *
+schema_load(const char *path) {
+	struct ucl_parser *parser = ucl_parser_new(0);
+	ucl_object_t *top = NULL;
+	struct schema *s = NULL;
+
+	if (!ucl_parser_add_file(parser, path)) {
+		errx(1, "Parsing %s: %s", path, ucl_parser_get_error(parser));
+	}
+	top = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+	if (top == NULL) {
+		errx(1, "%s: empty schema", path);
+	}
+	s = schema_compile(top);
+	s->s_src = top;
+	return s;
+}
+
+void
+schema_free(struct schema *s) {
+	size_t i;
+
+	if (s == NULL) {
+		return;
+	}
+	for (i = 0; i < s->s_nprops; ++i) {
+		schema_free(s->s_props[i].sp_schema);
+	}
+	schema_free(s->s_additional);
+	schema_free(s->s_items);
+	free(s->s_props);
+	free(s->s_required);
+	if (s->s_src != NULL) {
+		ucl_object_unref(s->s_src);
+	}
+	free(s);
+}
+
+/*
+ * Return the schema for the value of key obj in an object with schema s,
+ * NULL if anything goes.  A key given more than once becomes an array, so
+ * its schema has to allow one.
+ */
+const struct schema *
+schema_key(const struct schema *s, const ucl_object_t *obj) {
+	const struct schema_prop *prop = NULL;
+	const char *key = NULL;
+	size_t len = 0, i;
+	uint64_t hash;
+
+	if (s == NULL) {
+		return NULL;
+	}
+	key = ucl_object_keyl(obj, &len);
+	if (s->s_nprops > 0) {
+		hash = echo_hash(ECHO_HASH_INIT, key, len);
+		for (i = hash & (s->s_nprops - 1); s->s_props[i].sp_key != NULL;
+		    i = (i + 1) & (s->s_nprops - 1)) {
+			prop = &s->s_props[i];
+			if (prop->sp_hash == hash && prop->sp_len == len &&
+			    memcmp(prop->sp_key, key, len) == 0) {
+				s = prop->sp_schema;
+				goto found;
+			}
+		}
+	}
+	if (s->s_closed) {
+		errx(1, "%.*s: unknown key", (int)len, key);
+	}
+	s = s->s_additional;
+found:
+	if (s != NULL && obj->next != NULL && (s->s_types & SCH_ARRAY) == 0) {
+		errx(1, "%.*s: given more than once", (int)len, key);
+	}
+	return s;
+}
+
+/*
+ * Check the type of obj against s and return the schema its contents are
+ * checked against.  A value that is not an array where s allows one is
+ * taken as an element of it.
+ */
+const struct schema *
+schema_value(const struct schema *s, const ucl_object_t *obj, const char *key) {
+	u_int type = schema_type_of(obj);
+
+	if (s == NULL) {
+		return NULL;
+	}
+	if ((s->s_types & type) == 0 && (s->s_types & SCH_ARRAY) != 0 &&
+	    s->s_items != NULL) {
+		s = s->s_items;
+	}
+	if ((s->s_types & type) == 0) {
+		errx(1, "%s: %s not allowed", key,
+		    ucl_object_type_to_string(obj->type));
+	}
+	return s;
+}
+
+const struct schema *
+schema_items(const struct schema *s) {
+	return s != NULL ? s->s_items : NULL;
+}
+
+void
+schema_required(const struct schema *s, const ucl_object_t *obj, const char *key) {
+	size_t i;
+
+	if (s == NULL) {
+		return;
+	}
+	for (i = 0; i < s->s_nrequired; ++i) {
+		if (ucl_object_lookup(obj, s->s_required[i]) == NULL) {
+			errx(1, "%s: missing %s", key, s->s_required[i]);
+		}
+	}
+}
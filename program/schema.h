@@ -0,0 +1,13 @@
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+struct schema;
+
+struct schema *schema_load(const char *path);
+void schema_free(struct schema *s);
+const struct schema *schema_key(const struct schema *s, const ucl_object_t *obj);
+const struct schema *schema_value(const struct schema *s, const ucl_object_t *obj, const char *key);
+const struct schema *schema_items(const struct schema *s);
+void schema_required(const struct schema *s, const ucl_object_t *obj, const char *key);
+
+#endif /* !_SCHEMA_H_ */
@@ -8,7 +8,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <libxo/xo.h>
+
+#if defined(__amd64__) || defined(__x86_64__)
+#include <immintrin.h>
+#define NUL_SCAN_SIMD
+#endif
+
+#include "acct.h"
 
 #define ATTR_RO		0x001
 #define ATTR_NODELETE	0x002
@@ -24,6 +33,13 @@
 #define	NVLIST_HEADER_MAGIC	0x6c
 #define	NVLIST_HEADER_VERSION	0x00
 
+#define PARAMS_MAXDEPTH	64
+
+/* glibc does not have it. */
+#ifndef __packed
+#define __packed	__attribute__((__packed__))
+#endif
+
 struct array_t;
 struct params_t;
 
@@ -35,12 +51,19 @@ typedef union {
 	struct array_t *array;
 } value_t;
 
+/*
+ * namesize and len are the sizes of name and of a string value including
+ * the NUL, computed once when the attribute is created so packing never
+ * scans a string again.
+ */
 typedef struct attr_t {
 	TAILQ_ENTRY(attr_t) next;
 	RB_ENTRY(attr_t) entry;
 	char *name;
+	size_t namesize;
 	size_t type;
 	value_t value;
+	size_t len;
 } attr_t;
 
 typedef TAILQ_HEAD(array_t, attr_t) array_t;
@@ -83,13 +106,19 @@ params_t *params_init() {
 	return params;
 }
 
-attr_t *new_param(char *name) {
+static attr_t *attr_alloc(char *name, size_t namesize, size_t type) {
 	attr_t *node = malloc(sizeof(attr_t));
 	memset(node, 0, sizeof(attr_t));
 	node->name = name;
+	node->namesize = namesize;
+	node->type = type;
 	return node;
 }
 
+attr_t *new_param(char *name) {
+	return attr_alloc(name, name != NULL ? strlen(name) + 1 : 0, 0);
+}
+
 attr_t *new_number(char *name, uint64_t value) {
 	attr_t *node = new_param(name);
 	node->type = ATTR_NUMBER;
@@ -108,6 +137,7 @@ attr_t *new_string(char *name, char *value) {
 	attr_t *node = new_param(name);
 	node->type = ATTR_STRING;
 	node->value.string = value;
+	node->len = strlen(value) + 1;
 	return node;
 }
 
@@ -140,6 +170,34 @@ attr_t *new_nested(char *name) {
 	return node;
 }
 
+void params_free(params_t *p);
+
+/* Names and string values belong to the caller. */
+void attr_free(attr_t *attr) {
+	attr_t *node = NULL;
+
+	if (attr->type & ATTR_ARRAY) {
+		while ((node = TAILQ_FIRST(attr->value.array)) != NULL) {
+			TAILQ_REMOVE(attr->value.array, node, next);
+			attr_free(node);
+		}
+		free(attr->value.array);
+	} else if (attr->type & ATTR_NESTED) {
+		params_free(attr->value.params);
+	}
+	free(attr);
+}
+
+void params_free(params_t *p) {
+	attr_t *attr = NULL;
+
+	while ((attr = RB_MIN(params_t, p)) != NULL) {
+		RB_REMOVE(params_t, p, attr);
+		attr_free(attr);
+	}
+	free(p);
+}
+
 size_t params_size(params_t *p) {
 	attr_t *attr = NULL;
 	attr_t *node = NULL;
@@ -147,10 +205,8 @@ size_t params_size(params_t *p) {
 	size_t size = sizeof(struct nvlist_header);
 
 	RB_FOREACH(attr, params_t, p) {
-		size += sizeof(struct nvpair_header);
-		if (attr->name != NULL) {
-			size += strlen(attr->name) + 1;
-		}
+		size += sizeof(struct nvpair_header) + attr->namesize;
+		nitems = 0;
 		if (attr->type & ATTR_ARRAY) {
 			switch(attr->type & ~ATTR_ARRAY) {
 				case ATTR_BOOL: {
@@ -169,7 +225,7 @@ size_t params_size(params_t *p) {
 				}
 				case ATTR_STRING: {
 					TAILQ_FOREACH(node, attr->value.array, next) {
-						size += strlen(node->value.string) + 1;
+						size += node->len;
 					}
 					break;
 				}
@@ -191,7 +247,7 @@ size_t params_size(params_t *p) {
 					break;
 				}
 				case ATTR_STRING: {
-					size += strlen(attr->value.string) + 1;
+					size += attr->len;
 					break;
 				}
 				case ATTR_NESTED: {
@@ -229,7 +285,7 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 	memcpy(buf, &nvl, sizeof(nvl));
 	ptr = buf + sizeof(nvl);
 	RB_FOREACH(attr, params_t, p) {
-		nvp.nvph_namesize = strlen(attr->name) + 1;
+		nvp.nvph_namesize = attr->namesize;
 		nvp.nvph_nitems = 0;
 		if (attr->type & ATTR_ARRAY) {
 			attr_t *node = NULL;
@@ -248,8 +304,8 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 					ptr += nvp.nvph_namesize;
 					node = NULL;
 					TAILQ_FOREACH(node, attr->value.array, next) {
-						memcpy(ptr, &(node->value.b), nvp.nvph_datasize);
-						ptr += nvp.nvph_datasize;
+						memcpy(ptr, &(node->value.b), sizeof(bool));
+						ptr += sizeof(bool);
 					}
 					break;
 				}
@@ -265,15 +321,15 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 					ptr += nvp.nvph_namesize;
 					node = NULL;
 					TAILQ_FOREACH(node, attr->value.array, next) {
-						memcpy(ptr, &(node->value.num), nvp.nvph_datasize);
-						ptr += nvp.nvph_datasize;
+						memcpy(ptr, &(node->value.num), sizeof(uint64_t));
+						ptr += sizeof(uint64_t);
 					}
 					break;
 				}
 				case ATTR_STRING: {
 					TAILQ_FOREACH(node, attr->value.array, next) {
 						++nvp.nvph_nitems;
-						nvp.nvph_datasize += strlen(node->value.string) + 1;
+						nvp.nvph_datasize += node->len;
 					}
 					nvp.nvph_type = NV_TYPE_STRING_ARRAY;
 					memcpy(ptr, &nvp, sizeof(nvp));
@@ -282,9 +338,8 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 					ptr += nvp.nvph_namesize;
 					node = NULL;
 					TAILQ_FOREACH(node, attr->value.array, next) {
-						size = strlen(node->value.string) + 1;
-						memcpy(ptr, node->value.string, size);
-						ptr += size;
+						memcpy(ptr, node->value.string, node->len);
+						ptr += node->len;
 					}
 					break;
 				}
@@ -352,7 +407,7 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 				}
 				case ATTR_STRING: {
 					nvp.nvph_type = NV_TYPE_STRING;
-					nvp.nvph_datasize = strlen(attr->value.string) + 1;
+					nvp.nvph_datasize = attr->len;
 					memcpy(ptr, &nvp, sizeof(nvp));
 					ptr += sizeof(nvp);
 					memcpy(ptr, attr->name, nvp.nvph_namesize);
@@ -364,82 +419,479 @@ void * params_pack(params_t *p, uint8_t *buf, size_t *sz) {
 			}
 		}
 	}
-	buf[size] = 0;
 	return buf;
 }
 
-int main() {
-	size_t size = 0;
-	void *buf = NULL;
+/*
+ * Find the first NUL in len bytes, like memchr(buf, 0, len).  Decoding runs
+ * this over every name and string, so it is vectorized where the CPU allows
+ * it; nul_scan picks the widest version on first use.
+ */
+static const uint8_t *nul_scan_init(const uint8_t *buf, size_t len);
+static const uint8_t *(*nul_scan)(const uint8_t *, size_t) = nul_scan_init;
+
+static const uint8_t *nul_scan_scalar(const uint8_t *buf, size_t len) {
+	for (; len > 0; ++buf, --len) {
+		if (*buf == '\0') {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+#ifdef NUL_SCAN_SIMD
+static const uint8_t *nul_scan_sse2(const uint8_t *buf, size_t len) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i chunk;
+	int mask = 0;
+
+	for (; len >= 16; buf += 16, len -= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)buf);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+		if (mask != 0) {
+			return buf + __builtin_ctz(mask);
+		}
+	}
+	return nul_scan_scalar(buf, len);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *nul_scan_avx2(const uint8_t *buf, size_t len) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i chunk;
+	int mask = 0;
+
+	for (; len >= 32; buf += 32, len -= 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)buf);
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, zero));
+		if (mask != 0) {
+			return buf + __builtin_ctz((unsigned int)mask);
+		}
+	}
+	return nul_scan_sse2(buf, len);
+}
+#endif
+
+static const uint8_t *nul_scan_init(const uint8_t *buf, size_t len) {
+	nul_scan = nul_scan_scalar;
+#ifdef NUL_SCAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		nul_scan = nul_scan_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		nul_scan = nul_scan_sse2;
+	}
+#endif
+	return nul_scan(buf, len);
+}
+
+/* A NUL terminated string filling exactly size bytes. */
+static bool string_valid(const uint8_t *buf, size_t size) {
+	return size > 0 && nul_scan(buf, size) == buf + size - 1;
+}
+
+/* An array attribute whose elements have type type. */
+static attr_t *array_alloc(char *name, size_t namesize, size_t type) {
+	attr_t *node = attr_alloc(name, namesize, ATTR_ARRAY | type);
+	node->value.array = malloc(sizeof(array_t));
+	TAILQ_INIT(node->value.array);
+	return node;
+}
+
+static attr_t *array_add(attr_t *array, size_t type) {
+	attr_t *node = attr_alloc(NULL, 0, type);
+	TAILQ_INSERT_TAIL(array->value.array, node, next);
+	return node;
+}
+
+static params_t *params_decode(uint8_t *buf, size_t size, int depth,
+    size_t *lenp);
+
+/* Decode the value of the pair described by nvp, whose data is at data. */
+static attr_t *attr_decode(const struct nvpair_header *nvp, char *name,
+    uint8_t *data, uint8_t **ptrp, const uint8_t *end, int depth) {
+	attr_t *attr = NULL;
 	attr_t *node = NULL;
-	attr_t *tmpnode = NULL;
+	params_t *nested = NULL;
+	uint8_t *nul = NULL;
+	size_t left = 0, len = 0;
+
+	switch (nvp->nvph_type) {
+		case NV_TYPE_NULL:
+			if (nvp->nvph_datasize != 0) {
+				return NULL;
+			}
+			return attr_alloc(name, nvp->nvph_namesize, ATTR_NULL);
+		case NV_TYPE_BOOL:
+			if (nvp->nvph_datasize != sizeof(bool) || *data > 1) {
+				return NULL;
+			}
+			attr = attr_alloc(name, nvp->nvph_namesize, ATTR_BOOL);
+			attr->value.b = *data != 0;
+			return attr;
+		case NV_TYPE_NUMBER:
+			if (nvp->nvph_datasize != sizeof(uint64_t)) {
+				return NULL;
+			}
+			attr = attr_alloc(name, nvp->nvph_namesize, ATTR_NUMBER);
+			memcpy(&attr->value.num, data, sizeof(uint64_t));
+			return attr;
+		case NV_TYPE_STRING:
+			if (!string_valid(data, nvp->nvph_datasize)) {
+				return NULL;
+			}
+			attr = attr_alloc(name, nvp->nvph_namesize, ATTR_STRING);
+			attr->value.string = (char *)data;
+			attr->len = nvp->nvph_datasize;
+			return attr;
+		case NV_TYPE_NVLIST:
+			nested = params_decode(data, nvp->nvph_datasize, depth + 1,
+			    &len);
+			if (nested == NULL) {
+				return NULL;
+			}
+			if (len != nvp->nvph_datasize) {
+				params_free(nested);
+				return NULL;
+			}
+			attr = attr_alloc(name, nvp->nvph_namesize, ATTR_NESTED);
+			attr->value.params = nested;
+			return attr;
+		case NV_TYPE_BOOL_ARRAY:
+			if (nvp->nvph_datasize != nvp->nvph_nitems * sizeof(bool)) {
+				return NULL;
+			}
+			attr = array_alloc(name, nvp->nvph_namesize, ATTR_BOOL);
+			for (uint64_t i = 0; i < nvp->nvph_nitems; ++i) {
+				if (data[i] > 1) {
+					attr_free(attr);
+					return NULL;
+				}
+				array_add(attr, ATTR_BOOL)->value.b = data[i] != 0;
+			}
+			return attr;
+		case NV_TYPE_NUMBER_ARRAY:
+			if (nvp->nvph_datasize / sizeof(uint64_t) != nvp->nvph_nitems ||
+			    nvp->nvph_datasize % sizeof(uint64_t) != 0) {
+				return NULL;
+			}
+			attr = array_alloc(name, nvp->nvph_namesize, ATTR_NUMBER);
+			for (uint64_t i = 0; i < nvp->nvph_nitems; ++i) {
+				node = array_add(attr, ATTR_NUMBER);
+				memcpy(&node->value.num, data + i * sizeof(uint64_t),
+				    sizeof(uint64_t));
+			}
+			return attr;
+		case NV_TYPE_STRING_ARRAY:
+			attr = array_alloc(name, nvp->nvph_namesize, ATTR_STRING);
+			left = nvp->nvph_datasize;
+			for (uint64_t i = 0; i < nvp->nvph_nitems; ++i) {
+				nul = left > 0 ? (uint8_t *)nul_scan(data, left) : NULL;
+				if (nul == NULL) {
+					attr_free(attr);
+					return NULL;
+				}
+				node = array_add(attr, ATTR_STRING);
+				node->value.string = (char *)data;
+				node->len = nul + 1 - data;
+				left -= node->len;
+				data = nul + 1;
+			}
+			if (left != 0) {
+				attr_free(attr);
+				return NULL;
+			}
+			return attr;
+		case NV_TYPE_NVLIST_ARRAY:
+			/* The elements follow the pair, each with its own header. */
+			if (nvp->nvph_datasize != 0) {
+				return NULL;
+			}
+			attr = array_alloc(name, nvp->nvph_namesize, ATTR_NESTED);
+			for (uint64_t i = 0; i < nvp->nvph_nitems; ++i) {
+				nested = params_decode(*ptrp, end - *ptrp, depth + 1, &len);
+				if (nested == NULL) {
+					attr_free(attr);
+					return NULL;
+				}
+				array_add(attr, ATTR_NESTED)->value.params = nested;
+				*ptrp += len;
+			}
+			return attr;
+		default:
+			return NULL;
+	}
+}
+
+static params_t *params_decode(uint8_t *buf, size_t size, int depth,
+    size_t *lenp) {
+	struct nvlist_header nvl = {0};
+	struct nvpair_header nvp = {0};
 	params_t *params = NULL;
-	nvlist_t *nvl = NULL;
-	nvlist_t *tmpnvl = NULL;
-	uint8_t *byte = NULL;
+	attr_t *attr = NULL;
+	uint8_t *ptr = NULL, *end = NULL, *data = NULL;
+	char *name = NULL;
 
+	if (depth > PARAMS_MAXDEPTH || size < sizeof(nvl)) {
+		return NULL;
+	}
+	memcpy(&nvl, buf, sizeof(nvl));
+	if (nvl.nvlh_magic != NVLIST_HEADER_MAGIC ||
+	    nvl.nvlh_version != NVLIST_HEADER_VERSION ||
+	    nvl.nvlh_size > size - sizeof(nvl)) {
+		return NULL;
+	}
 	params = params_init();
-	// node = new_number("a", 4);
-	// if (RB_INSERT(params_t, params, node) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", node->name);
-	// }
-	// node = new_bool("b", true);
-	// if (RB_INSERT(params_t, params, node) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", node->name);
-	// }
-	// node = new_string("c", "c");
-	// if (RB_INSERT(params_t, params, node) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", node->name);
-	// }
-	// node = new_null("x");
-	// if (RB_INSERT(params_t, params, node) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", node->name);
-	// }
-	// node = new_nested("z");
-	// tmpnode = new_number("nested", 5);
-	// if (RB_INSERT(params_t, node->value.params, tmpnode) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", tmpnode->name);
-	// }
-	// if (RB_INSERT(params_t, params, node) != NULL) {
-	// 	free(node);
-	// 	err(1, "node with name '%s' already exists\n", node->name);
-	// }
-	node = new_array("n");
-	node->type |= ATTR_NESTED;
-	tmpnode = new_params(NULL);
-	TAILQ_INSERT_TAIL(node->value.array, tmpnode, next);
-	tmpnode = new_params(NULL);
-	TAILQ_INSERT_TAIL(node->value.array, tmpnode, next);
-	if (RB_INSERT(params_t, params, node) != NULL) {
-		free(node);
-		err(1, "node with name '%s' already exists\n", node->name);
+	ptr = buf + sizeof(nvl);
+	end = ptr + nvl.nvlh_size;
+	while (ptr < end) {
+		if ((size_t)(end - ptr) < sizeof(nvp)) {
+			goto fail;
+		}
+		memcpy(&nvp, ptr, sizeof(nvp));
+		ptr += sizeof(nvp);
+		if ((size_t)(end - ptr) < nvp.nvph_namesize ||
+		    !string_valid(ptr, nvp.nvph_namesize)) {
+			goto fail;
+		}
+		name = (char *)ptr;
+		ptr += nvp.nvph_namesize;
+		if ((size_t)(end - ptr) < nvp.nvph_datasize) {
+			goto fail;
+		}
+		data = ptr;
+		ptr += nvp.nvph_datasize;
+		attr = attr_decode(&nvp, name, data, &ptr, end, depth);
+		if (attr == NULL) {
+			goto fail;
+		}
+		if (RB_INSERT(params_t, params, attr) != NULL) {
+			attr_free(attr);
+			goto fail;
+		}
+	}
+	*lenp = sizeof(nvl) + nvl.nvlh_size;
+	return params;
+fail:
+	params_free(params);
+	return NULL;
+}
+
+/*
+ * Decode a buffer produced by params_pack(), checking it on the way: every
+ * pair stays within its nvlist, names and strings are terminated exactly at
+ * their size, fixed size values have the size of their type and names are
+ * unique.  Names and strings point into buf, which has to outlive the
+ * result, and keep the sizes the scan found.  The length of the nvlist
+ * read is stored in *lenp.  Returns NULL if buf is malformed.
+ */
+params_t *params_unpack(uint8_t *buf, size_t size, size_t *lenp) {
+	return params_decode(buf, size, 0, lenp);
+}
+
+#define BENCH_PAIRS	4096
+#define BENCH_NAMELEN	16
+
+/*
+ * Decoding allocates one attr per element plus the head of every nested
+ * list and array; more than this per element is a regression.
+ */
+#define BENCH_ALLOCS_PER_ELEMENT	1.25
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * A string heavy config of pairs pairs: strings of 16 to 256 bytes, string
+ * arrays and nested lists of strings, with a few other types mixed in.
+ * names and strings hold the names and string values it points to.
+ */
+static params_t *bench_params(char *names, char *strings, int pairs) {
+	params_t *params = params_init();
+	attr_t *node = NULL;
+	attr_t *elem = NULL;
+	char *name = NULL;
+	char *str = NULL;
+	size_t len = 0;
+
+	for (int i = 0; i < pairs; ++i) {
+		snprintf(names + i * BENCH_NAMELEN, BENCH_NAMELEN, "key%05d", i);
+	}
+	for (int i = 0; i < pairs; ++i) {
+		name = names + i * BENCH_NAMELEN;
+		str = strings + i * 257;
+		len = 16 + (i * 61) % 241;
+		memset(str, 'a' + i % 26, len);
+		str[len] = '\0';
+		switch (i % 8) {
+			case 0:
+				node = new_number(name, i);
+				break;
+			case 1:
+				node = new_bool(name, i % 3 == 0);
+				break;
+			case 2:
+				node = new_array(name);
+				node->type |= ATTR_STRING;
+				for (int j = 0; j < 4; ++j) {
+					elem = new_string(NULL, str + j * len / 4);
+					TAILQ_INSERT_TAIL(node->value.array, elem, next);
+				}
+				break;
+			case 3:
+				node = new_nested(name);
+				for (int j = 0; j < 4; ++j) {
+					elem = new_string(names + ((i + j + 1) % pairs) *
+					    BENCH_NAMELEN, str);
+					RB_INSERT(params_t, node->value.params, elem);
+				}
+				break;
+			case 4:
+				node = new_array(name);
+				node->type |= ATTR_NUMBER;
+				for (int j = 0; j < 4; ++j) {
+					elem = new_number(NULL, j);
+					TAILQ_INSERT_TAIL(node->value.array, elem, next);
+				}
+				break;
+			default:
+				node = new_string(name, str);
+				break;
+		}
+		RB_INSERT(params_t, params, node);
+	}
+	return params;
+}
+
+/* Every attr, array elements and nested ones included. */
+static size_t params_count(params_t *p) {
+	attr_t *attr = NULL;
+	attr_t *node = NULL;
+	size_t count = 0;
+
+	RB_FOREACH(attr, params_t, p) {
+		++count;
+		if (attr->type & ATTR_ARRAY) {
+			TAILQ_FOREACH(node, attr->value.array, next) {
+				++count;
+				if (node->type & ATTR_NESTED) {
+					count += params_count(node->value.params);
+				}
+			}
+		} else if (attr->type & ATTR_NESTED) {
+			count += params_count(attr->value.params);
+		}
 	}
+	return count;
+}
 
+/*
+ * Every damaged copy of a small config either fails to decode or decodes
+ * to params that pack to as many bytes as were read.
+ */
+static void damage(char *names, char *strings, int rounds) {
+	params_t *params = bench_params(names, strings, 64);
+	uint8_t *buf = NULL;
+	uint8_t *copy = NULL;
+	unsigned seed = 1;
+	size_t size = 0, len = 0, cut = 0, packed = 0;
+	void *repacked = NULL;
+
+	buf = params_pack(params, NULL, &size);
+	params_free(params);
+	copy = malloc(size);
+	for (int i = 0; i < rounds; ++i) {
+		memcpy(copy, buf, size);
+		cut = size;
+		if (rand_r(&seed) % 4 == 0) {
+			cut = rand_r(&seed) % size;
+		} else {
+			copy[rand_r(&seed) % size] ^= 1 << rand_r(&seed) % 8;
+		}
+		params = params_unpack(copy, cut, &len);
+		if (params == NULL) {
+			continue;
+		}
+		repacked = params_pack(params, NULL, &packed);
+		if (packed != len) {
+			errx(1, "damaged params decoded to %zu bytes, not %zu",
+			    packed, len);
+		}
+		free(repacked);
+		params_free(params);
+	}
+	free(copy);
+	free(buf);
+}
 
+/*
+ * Check that a string heavy config survives a round trip through
+ * params_pack() and params_unpack() and that damaged buffers are refused
+ * or decoded consistently, then print the encode and decode throughput.
+ * Fails if decoding allocates more than BENCH_ALLOCS_PER_ELEMENT times per
+ * element or leaks.  The optional argument is how long to measure each, in
+ * seconds.
+ */
+int main(int argc, char **argv) {
+	double duration = argc > 1 ? strtod(argv[1], NULL) : 1.0;
+	char *names = malloc(BENCH_PAIRS * BENCH_NAMELEN);
+	char *strings = malloc(BENCH_PAIRS * 257);
+	params_t *params = NULL;
+	params_t *decoded = NULL;
+	uint8_t *buf = NULL;
+	void *copy = NULL;
+	size_t size = 0, len = 0, bytes = 0, live = 0, peak = 0;
+	uint64_t allocs = 0;
+	double start = 0, elapsed = 0;
+
+	damage(names, strings, 20000);
+	params = bench_params(names, strings, BENCH_PAIRS);
 	buf = params_pack(params, NULL, &size);
-	nvl = nvlist_unpack(buf, size, 0);
-	nvlist_dump(nvl, STDOUT_FILENO);
-	for (size_t index = sizeof(struct nvlist_header); index < size; ++index) {
-		byte = buf + index;
-		printf("%x ", *byte);
+	decoded = params_unpack(buf, size, &len);
+	if (decoded == NULL || len != size) {
+		errx(1, "packed params failed to decode");
+	}
+	copy = params_pack(decoded, NULL, &len);
+	if (len != size || memcmp(copy, buf, size) != 0) {
+		errx(1, "params changed in a round trip");
+	}
+	free(copy);
+	params_free(decoded);
+	printf("structure: ok\n");
+
+	start = now();
+	for (bytes = 0; (elapsed = now() - start) < duration; bytes += size) {
+		params_pack(params, buf, &len);
+	}
+	printf("encode: %zu bytes GB/s: %.2f\n", size, bytes / elapsed / 1e9);
+	start = now();
+	for (bytes = 0; (elapsed = now() - start) < duration; bytes += size) {
+		params_free(params_unpack(buf, size, &len));
+	}
+	printf("decode: %zu bytes GB/s: %.2f\n", size, bytes / elapsed / 1e9);
+
+	acct_enable();
+	acct_stage("unpack");
+	decoded = params_unpack(buf, size, &len);
+	len = params_count(decoded);
+	params_free(decoded);
+	acct_report();
+	xo_finish();
+	acct_stage_count("unpack", &allocs, &live, &peak);
+	if (allocs > BENCH_ALLOCS_PER_ELEMENT * len) {
+		errx(1, "decoding made %ju allocations for %zu elements",
+		    (uintmax_t)allocs, len);
 	}
-	printf("\n");
-
-	nvl = nvlist_create(0);
-	tmpnvl = nvlist_create(0);
-	nvlist_add_nvlist_array(nvl, "n", (const nvlist_t * const *)&tmpnvl, 1);
-	tmpnvl = nvlist_create(0);
-	nvlist_append_nvlist_array(nvl, "n", tmpnvl);
-	buf = nvlist_pack(nvl, &size);
-	for (size_t index = sizeof(struct nvlist_header); index < size; ++index) {
-		byte = buf + index;
-		printf("%x ", *byte);
+	if (live != 0) {
+		errx(1, "decoding leaked %zu bytes", live);
 	}
-	printf("\n");
+	free(buf);
+	params_free(params);
+	free(strings);
+	free(names);
 	return 0;
 }
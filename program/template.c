@@ -0,0 +1,211 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucl.h>
+
+#include "echo.h"
+#include "template.h"
+#include "acct.h"
+
+/*
+ * ${var} references in config strings.  A string is compiled once into
+ * literal and variable segments and kept in a cache keyed by its contents,
+ * so every jail sharing the same template only pays for copying the
+ * segments.  A variable is the scalar of that name in the nearest enclosing
+ * block, used as is.  References that resolve to nothing are kept verbatim
+ * for whoever consumes the config.
+ */
+
+struct tmpl_seg {
+	const char	*tg_str;	/* literal text or variable name */
+	size_t		 tg_len;
+	bool		 tg_var;
+};
+
+struct tmpl {
+	struct tmpl	*t_next;
+	uint64_t	 t_hash;
+	char		*t_src;
+	size_t		 t_len;
+	struct tmpl_seg	*t_segs;
+	size_t		 t_nsegs;
+};
+
+#define TMPL_HASHSIZE	256
+
+static struct tmpl *cache[TMPL_HASHSIZE];
+
+static struct {
+	char	*ob_str;
+	size_t	 ob_len;
+	size_t	 ob_size;
+} out;
+
+static void
+out_append(const char *str, size_t len) {
+	if (out.ob_len + len + 1 > out.ob_size) {
+		out.ob_size = (out.ob_len + len + 1) * 2;
+		out.ob_str = realloc(out.ob_str, out.ob_size);
+		if (out.ob_str == NULL) {
+			err(1, "realloc");
+		}
+	}
+	memcpy(out.ob_str + out.ob_len, str, len);
+	out.ob_len += len;
+	out.ob_str[out.ob_len] = '\0';
+}
+
+static bool
+tmpl_varchar(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    (c >= '0' && c <= '9') || c == '_';
+}
+
+static void
+tmpl_add(struct tmpl *t, const char *str, size_t len, bool var) {
+	if (len == 0) {
+		return;
+	}
+	t->t_segs = reallocarray(t->t_segs, t->t_nsegs + 1, sizeof(*t->t_segs));
+	if (t->t_segs == NULL) {
+		err(1, "reallocarray");
+	}
+	t->t_segs[t->t_nsegs].tg_str = str;
+	t->t_segs[t->t_nsegs].tg_len = len;
+	t->t_segs[t->t_nsegs].tg_var = var;
+	++t->t_nsegs;
+}
+
+static struct tmpl *
+tmpl_compile(const char *str, size_t len, uint64_t hash) {
+	struct tmpl *t = NULL;
+	const char *p = NULL, *lit = NULL, *name = NULL, *end = NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		err(1, "calloc");
+	}
+	t->t_hash = hash;
+	t->t_len = len;
+	t->t_src = strdup(str);
+	if (t->t_src == NULL) {
+		err(1, "strdup");
+	}
+	lit = t->t_src;
+	end = t->t_src + len;
+	for (p = t->t_src; (p = strstr(p, "${")) != NULL;) {
+		for (name = p + 2; name < end && tmpl_varchar(*name); ++name) {
+			;
+		}
+		if (name == p + 2 || *name != '}') {
+			p += 2;
+			continue;
+		}
+		tmpl_add(t, lit, p - lit, false);
+		tmpl_add(t, p + 2, name - (p + 2), true);
+		lit = p = name + 1;
+	}
+	tmpl_add(t, lit, end - lit, false);
+	return t;
+}
+
+static const struct tmpl *
+tmpl_lookup(const char *str) {
+	struct tmpl *t = NULL;
+	size_t len = strlen(str);
+	uint64_t hash = echo_hash(ECHO_HASH_INIT, str, len);
+
+	for (t = cache[hash % TMPL_HASHSIZE]; t != NULL; t = t->t_next) {
+		if (t->t_hash == hash && t->t_len == len &&
+		    memcmp(t->t_src, str, len) == 0) {
+			return t;
+		}
+	}
+	t = tmpl_compile(str, len, hash);
+	t->t_next = cache[hash % TMPL_HASHSIZE];
+	cache[hash % TMPL_HASHSIZE] = t;
+	return t;
+}
+
+static const char *
+tmpl_resolve(const struct tmpl_scope *scope, const char *name, size_t len,
+    size_t *vlenp) {
+	const struct tmpl_scope *s = NULL;
+	const ucl_object_t *obj = NULL;
+	const char *value = NULL;
+
+	for (s = scope; s != NULL; s = s->ts_up) {
+		obj = ucl_object_lookup_len(s->ts_obj, name, len);
+		if (obj == NULL) {
+			continue;
+		}
+		switch (obj->type) {
+			case UCL_STRING:
+				return ucl_object_tolstring(obj, vlenp);
+			case UCL_INT:
+			case UCL_FLOAT:
+			case UCL_BOOLEAN:
+				value = ucl_object_tostring_forced(obj);
+				*vlenp = strlen(value);
+				return value;
+			default:
+				return NULL;
+		}
+	}
+	if (scope != NULL && scope->ts_name != NULL && len == 4 &&
+	    memcmp(name, "name", 4) == 0) {
+		*vlenp = strlen(scope->ts_name);
+		return scope->ts_name;
+	}
+	return NULL;
+}
+
+/*
+ * Expand the references in str.  Strings without any are returned as is,
+ * others in a buffer that stays valid until the next call.
+ */
+const char *
+tmpl_expand(const char *str, const struct tmpl_scope *scope) {
+	const struct tmpl *t = NULL;
+	const struct tmpl_seg *seg = NULL;
+	const char *value = NULL;
+	size_t vlen = 0, i;
+
+	if (strstr(str, "${") == NULL) {
+		return str;
+	}
+	t = tmpl_lookup(str);
+	out.ob_len = 0;
+	out_append("", 0);
+	for (i = 0; i < t->t_nsegs; ++i) {
+		seg = &t->t_segs[i];
+		if (!seg->tg_var) {
+			out_append(seg->tg_str, seg->tg_len);
+		} else if ((value = tmpl_resolve(scope, seg->tg_str, seg->tg_len,
+		    &vlen)) != NULL) {
+			out_append(value, vlen);
+		} else {
+			out_append(seg->tg_str - 2, seg->tg_len + 3);
+		}
+	}
+	return out.ob_str;
+}
+
+void
+tmpl_free(void) {
+	struct tmpl *t = NULL;
+	size_t i;
+
+	for (i = 0; i < TMPL_HASHSIZE; ++i) {
+		while ((t = cache[i]) != NULL) {
+			cache[i] = t->t_next;
+			free(t->t_segs);
+			free(t->t_src);
+			free(t);
+		}
+	}
+	free(out.ob_str);
+	memset(&out, 0, sizeof(out));
+}
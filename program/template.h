@@ -0,0 +1,18 @@
+#ifndef _TEMPLATE_H_
+#define _TEMPLATE_H_
+
+/*
+ * Blocks enclosing the value being converted, innermost first.  ts_name is
+ * the key of the outermost one, the jail name, which ${name} stands for
+ * unless a block sets name itself.
+ */
+struct tmpl_scope {
+	const ucl_object_t		*ts_obj;
+	const char			*ts_name;
+	const struct tmpl_scope	*ts_up;
+};
+
+const char *tmpl_expand(const char *str, const struct tmpl_scope *scope);
+void tmpl_free(void);
+
+#endif /* !_TEMPLATE_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Allocation accounting: the counters of a stage add up, and the diff
+ * stage stays within its budget of allocations per op and leaks nothing.
+ */
+#include "echo_compat.h"
+
+#include "echo_patch.h"
+#include "diff.h"
+#include "test.h"
+#include "acct.h"
+
+#define GROUPS		64
+#define KEYS		64
+#define CHANGES		512
+
+/*
+ * nv_diff() only allocates to grow its path buffer and op list; anything
+ * near one allocation per op is a regression.
+ */
+#define DIFF_ALLOCS_PER_OP	0.125
+
+static void
+check_stage(const char *name, uint64_t allocs, size_t live, size_t peak)
+{
+	uint64_t a = 0;
+	size_t l = 0, p = 0;
+
+	CHECK(acct_stage_count(name, &a, &l, &p));
+	CHECK(a == allocs && l == live && p == peak);
+}
+
+static void
+test_counts(void)
+{
+	char *a = NULL, *b = NULL, *c = NULL;
+	uint64_t allocs = 0;
+	size_t live = 0, peak = 0;
+
+	CHECK(!acct_stage_count("counts", &allocs, &live, &peak));
+	acct_stage("counts");
+	a = malloc(100);
+	b = calloc(10, 10);
+	check_stage("counts", 2, 200, 200);
+	free(a);
+	check_stage("counts", 2, 100, 200);
+	b = realloc(b, 300);
+	check_stage("counts", 3, 300, 300);
+	c = strdup("abc");
+	check_stage("counts", 4, 304, 304);
+	free(b);
+	free(c);
+	check_stage("counts", 4, 0, 304);
+	acct_stage("other");
+	a = malloc(1);
+	acct_stage("counts");
+	free(a);
+	check_stage("counts", 4, 0, 304);
+	check_stage("other", 1, 0, 1);
+}
+
+static nvlist_t *
+config(unsigned *seed, bool change)
+{
+	nvlist_t *nvl = NULL, *group = NULL;
+	char name[16];
+	int g = 0, k = 0;
+
+	nvl = nvlist_create(0);
+	for (g = 0; g < GROUPS; ++g) {
+		group = nvlist_create(0);
+		for (k = 0; k < KEYS; ++k) {
+			snprintf(name, sizeof(name), "k%d", k);
+			nvlist_add_number(group, name,
+			    change && rand_r(seed) % (GROUPS * KEYS / CHANGES) == 0);
+		}
+		snprintf(name, sizeof(name), "g%d", g);
+		nvlist_move_nvlist(nvl, name, group);
+	}
+	return nvl;
+}
+
+static void
+test_diff(void)
+{
+	nvlist_t *old = NULL, *new = NULL, *patch = NULL;
+	uint64_t allocs = 0;
+	size_t live = 0, peak = 0, ops = 0;
+	unsigned seed = 1;
+
+	old = config(&seed, false);
+	new = config(&seed, true);
+	acct_stage("diff");
+	patch = nv_diff(old, new);
+	acct_stage("test");
+	nvlist_get_nvlist_array(patch, ECHO_PATCH_OPS, &ops);
+	CHECK(ops > CHANGES / 2);
+	CHECK(acct_stage_count("diff", &allocs, &live, &peak));
+	printf("diff: ops: %zu allocs: %ju live: %zu peak: %zu\n", ops,
+	    (uintmax_t)allocs, live, peak);
+	CHECK(allocs <= DIFF_ALLOCS_PER_OP * ops);
+	CHECK(live == 0);
+	nvlist_destroy(patch);
+	nvlist_destroy(old);
+	nvlist_destroy(new);
+}
+
+int
+main(void)
+{
+	acct_enable();
+	test_counts();
+	test_diff();
+	printf("acct: ok\n");
+	return 0;
+}
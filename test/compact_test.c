@@ -0,0 +1,205 @@
+/*
+ * The compact format: random configs and a synthetic fleet survive an
+ * encode and decode unchanged, from one buffer or cut into pages, and
+ * truncated or damaged blobs are refused or decode to something else
+ * without crashing.  Then prints the size of the fleet in both formats and
+ * the encode and decode speed of each.
+ */
+#include "echo_compat.h"
+
+#include "echo_compact.h"
+#include "test.h"
+#include "testnv.h"
+
+#define ROUNDS		20000
+#define JAILS		1000
+#define FLIPS		20000
+
+/* A fleet of jails shaped like the ones program converts from UCL. */
+static nvlist_t *
+fleet(int jails)
+{
+	nvlist_t *nvl = NULL, *jail = NULL;
+	nvlist_t *ifaces[2];
+	const char *create[2] = {"ifconfig epair create up",
+	    "ifconfig ${bridge} addm ${interface}a"};
+	uint64_t ports[3] = {22, 80, 443};
+	bool flags[9] = {true, false, true, true, false, false, false, false,
+	    true};
+	char name[32];
+	int j = 0, i = 0;
+
+	nvl = nvlist_create(0);
+	for (j = 0; j < jails; ++j) {
+		jail = nvlist_create(0);
+		snprintf(name, sizeof(name), "jail%d.example.org", j);
+		nvlist_add_string(jail, "host.hostname", name);
+		nvlist_add_string(jail, "bridge", "bridge0");
+		nvlist_add_string(jail, "path", "/usr/local/jails/${name}");
+		nvlist_add_bool(jail, "persist", true);
+		nvlist_add_number(jail, "devfs_ruleset", 8);
+		nvlist_add_number(jail, "jid", j);
+		nvlist_add_number_array(jail, "ports", ports, 3);
+		nvlist_add_bool_array(jail, "flags", flags, 9);
+		for (i = 0; i < 2; ++i) {
+			ifaces[i] = nvlist_create(0);
+			nvlist_add_string_array(ifaces[i], "create", create, 2);
+			nvlist_add_string(ifaces[i], "destroy",
+			    "ifconfig ${interface}a destroy");
+		}
+		nvlist_add_nvlist_array(jail, "interface",
+		    (const nvlist_t * const *)ifaces, 2);
+		nvlist_destroy(ifaces[0]);
+		nvlist_destroy(ifaces[1]);
+		snprintf(name, sizeof(name), "jail%d", j);
+		nvlist_move_nvlist(nvl, name, jail);
+	}
+	return nvl;
+}
+
+/* buf cut into pages of pagesize bytes, each allocated on its own. */
+static void
+check_pages(const void *buf, size_t len, size_t pagesize, const nvlist_t *nvl)
+{
+	nvlist_t *decoded = NULL;
+	void **pages = NULL;
+	size_t npages = (len + pagesize - 1) / pagesize, i = 0, n = 0;
+
+	pages = calloc(npages, sizeof(*pages));
+	CHECK(pages != NULL);
+	for (i = 0; i < npages; ++i) {
+		n = len - i * pagesize < pagesize ? len - i * pagesize : pagesize;
+		pages[i] = malloc(n);
+		CHECK(pages[i] != NULL);
+		memcpy(pages[i], (const char *)buf + i * pagesize, n);
+	}
+	CHECK(echo_compact_decode_pages(pages, pagesize, len, &decoded) == 0);
+	CHECK(test_nvlist_same(decoded, nvl));
+	nvlist_destroy(decoded);
+	CHECK(echo_compact_decode_pages(pages, pagesize, len - 1, &decoded) != 0);
+	for (i = 0; i < npages; ++i) {
+		free(pages[i]);
+	}
+	free(pages);
+}
+
+static void
+check_round_trip(const nvlist_t *nvl)
+{
+	nvlist_t *decoded = NULL;
+	void *buf = NULL;
+	size_t len = 0;
+
+	CHECK(echo_compact_encode(nvl, &buf, &len) == 0);
+	CHECK(echo_compact_is(buf, len));
+	CHECK(echo_compact_decode(buf, len, &decoded) == 0);
+	CHECK(test_nvlist_same(decoded, nvl));
+	nvlist_destroy(decoded);
+	check_pages(buf, len, 1, nvl);
+	check_pages(buf, len, 7, nvl);
+	echo_free(buf);
+}
+
+static void
+test_round_trip(unsigned *seed)
+{
+	nvlist_t *nvl = NULL;
+	int i = 0;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		nvl = test_nvlist(seed, 0);
+		check_round_trip(nvl);
+		nvlist_destroy(nvl);
+	}
+	nvl = fleet(16);
+	check_round_trip(nvl);
+	nvlist_destroy(nvl);
+}
+
+static void
+test_damage(unsigned *seed)
+{
+	nvlist_t *nvl = NULL, *decoded = NULL;
+	unsigned char *buf = NULL, *copy = NULL;
+	size_t len = 0, i = 0;
+
+	nvl = fleet(2);
+	CHECK(echo_compact_encode(nvl, (void **)&buf, &len) == 0);
+	nvlist_destroy(nvl);
+	for (i = 0; i < len; ++i) {
+		CHECK(echo_compact_decode(buf, i, &decoded) != 0);
+	}
+	copy = malloc(len);
+	CHECK(copy != NULL);
+	for (i = 0; i < FLIPS; ++i) {
+		memcpy(copy, buf, len);
+		copy[rand_r(seed) % len] ^= 1 << rand_r(seed) % 8;
+		if (echo_compact_decode(copy, len, &decoded) == 0) {
+			nvlist_destroy(decoded);
+		}
+	}
+	free(copy);
+	echo_free(buf);
+}
+
+static void
+bench(double duration)
+{
+	nvlist_t *nvl = NULL, *decoded = NULL;
+	void *packed = NULL, *compact = NULL;
+	size_t plen = 0, clen = 0;
+	double start = 0, penc = 0, pdec = 0, cenc = 0, cdec = 0;
+	uint64_t n = 0;
+
+	nvl = fleet(JAILS);
+	packed = nvlist_pack(nvl, &plen);
+	CHECK(packed != NULL);
+	CHECK(echo_compact_encode(nvl, &compact, &clen) == 0);
+	printf("jails: %d packed: %zu bytes compact: %zu bytes ratio: %.2f\n",
+	    JAILS, plen, clen, (double)clen / plen);
+
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		free(nvlist_pack(nvl, &plen));
+	}
+	penc = n * plen / (test_now() - start) / 1e6;
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		decoded = nvlist_unpack(packed, plen, 0);
+		CHECK(decoded != NULL);
+		nvlist_destroy(decoded);
+	}
+	pdec = n * plen / (test_now() - start) / 1e6;
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		echo_free(compact);
+		CHECK(echo_compact_encode(nvl, &compact, &clen) == 0);
+	}
+	cenc = n * plen / (test_now() - start) / 1e6;
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		CHECK(echo_compact_decode(compact, clen, &decoded) == 0);
+		nvlist_destroy(decoded);
+	}
+	cdec = n * plen / (test_now() - start) / 1e6;
+
+	/* Both speeds count the bytes of the config as packed. */
+	printf("packed: encode MB/s: %.1f decode MB/s: %.1f\n", penc, pdec);
+	printf("compact: encode MB/s: %.1f decode MB/s: %.1f\n", cenc, cdec);
+	echo_free(compact);
+	free(packed);
+	nvlist_destroy(nvl);
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	unsigned seed = 1;
+
+	test_round_trip(&seed);
+	test_damage(&seed);
+	printf("compact: ok\n");
+	bench(duration);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * The userland stand-ins of echo_compat.h: the epoch never lets a waiter
+ * past a reader that entered before it, and references are neither lost
+ * nor released early under contention.
+ */
+#include "echo_compat.h"
+
+#include <unistd.h>
+
+#include "test.h"
+
+#define THREADS		8
+#define ROUNDS		100000
+#define RETIRES		2000
+
+struct object {
+	int	 o_dead;
+};
+
+static echo_epoch_t epoch;
+static struct object *current;
+static u_int refs;
+static int stop;
+static int inside;
+
+/* Readers must never see an object the writer has retired. */
+static void *
+epoch_reader(void *arg __unused)
+{
+	echo_epoch_tracker_t et;
+	struct object *obj = NULL;
+	int i = 0;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		echo_epoch_enter(epoch, &et);
+		obj = echo_load_ptr(&current);
+		for (i = 0; i < 16; ++i) {
+			CHECK(!__atomic_load_n(&obj->o_dead, __ATOMIC_RELAXED));
+		}
+		echo_epoch_exit(epoch, &et);
+	}
+	return NULL;
+}
+
+static void
+test_epoch_retire(void)
+{
+	pthread_t threads[THREADS];
+	struct object *old = NULL, *obj = NULL;
+	struct object *retired[RETIRES];
+	int i = 0;
+
+	current = calloc(1, sizeof(*current));
+	for (i = 0; i < THREADS; ++i) {
+		CHECK(pthread_create(&threads[i], NULL, epoch_reader, NULL) == 0);
+	}
+	for (i = 0; i < RETIRES; ++i) {
+		obj = calloc(1, sizeof(*obj));
+		CHECK(obj != NULL);
+		old = current;
+		echo_store_ptr(&current, obj);
+		echo_epoch_wait(epoch);
+		__atomic_store_n(&old->o_dead, 1, __ATOMIC_RELAXED);
+		retired[i] = old;
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (i = 0; i < RETIRES; ++i) {
+		free(retired[i]);
+	}
+	free(current);
+	stop = 0;
+}
+
+static void *
+epoch_sleeper(void *arg __unused)
+{
+	echo_epoch_tracker_t et;
+
+	echo_epoch_enter(epoch, &et);
+	__atomic_store_n(&inside, 1, __ATOMIC_SEQ_CST);
+	usleep(50000);
+	__atomic_store_n(&inside, 2, __ATOMIC_SEQ_CST);
+	echo_epoch_exit(epoch, &et);
+	return NULL;
+}
+
+/* A wait started while a reader is inside returns only after it left. */
+static void
+test_epoch_wait(void)
+{
+	pthread_t thread;
+
+	echo_epoch_wait(epoch);
+	CHECK(pthread_create(&thread, NULL, epoch_sleeper, NULL) == 0);
+	while (__atomic_load_n(&inside, __ATOMIC_SEQ_CST) == 0) {
+		sched_yield();
+	}
+	echo_epoch_wait(epoch);
+	CHECK(__atomic_load_n(&inside, __ATOMIC_SEQ_CST) == 2);
+	pthread_join(thread, NULL);
+}
+
+static void *
+ref_worker(void *arg __unused)
+{
+	int i = 0;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		echo_refcount_acquire(&refs);
+		CHECK(!echo_refcount_release(&refs));
+	}
+	for (i = 0; i < ROUNDS; ++i) {
+		echo_refcount_acquire(&refs);
+	}
+	return NULL;
+}
+
+/* Only the release that drops the last reference reports it. */
+static void
+test_refcount(void)
+{
+	pthread_t threads[THREADS];
+	int i = 0, last = 0;
+
+	echo_refcount_init(&refs, 1);
+	for (i = 0; i < THREADS; ++i) {
+		CHECK(pthread_create(&threads[i], NULL, ref_worker, NULL) == 0);
+	}
+	for (i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	CHECK(refs == 1 + THREADS * ROUNDS);
+	for (i = 0; i < 1 + THREADS * ROUNDS; ++i) {
+		last += echo_refcount_release(&refs);
+	}
+	CHECK(last == 1 && refs == 0);
+}
+
+static void
+test_cv_timeout(void)
+{
+	echo_mtx_t mtx;
+	echo_cv_t cv;
+	double start = 0;
+
+	echo_mtx_init(&mtx, "test");
+	echo_cv_init(&cv, "test");
+	echo_mtx_lock(&mtx);
+	start = test_now();
+	CHECK(echo_cv_wait(&cv, &mtx, 20) == EWOULDBLOCK);
+	CHECK(test_now() - start >= 0.015);
+	echo_mtx_unlock(&mtx);
+	echo_cv_destroy(&cv);
+	echo_mtx_destroy(&mtx);
+}
+
+int
+main(void)
+{
+	epoch = echo_epoch_alloc("test");
+	CHECK(epoch != NULL);
+	test_epoch_wait();
+	test_epoch_retire();
+	test_refcount();
+	test_cv_timeout();
+	echo_epoch_free(epoch);
+	printf("compat: ok\n");
+	return 0;
+}
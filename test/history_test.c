@@ -0,0 +1,147 @@
+/*
+ * What a version costs.  A config of GROUPS nested nvlists of KEYS numbers
+ * each gets VERSIONS versions that each change a few keys, made both the
+ * way a set makes them, by rebuilding against the previous tree, and the
+ * way a patch does.  Every version must cost at most the changed leaves
+ * and their parents, and roll back to the config it was made from.  Prints
+ * the nodes per version for each change size next to the nodes of a full
+ * copy.
+ */
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_history.h"
+#include "echo_patch.h"
+#include "test.h"
+#include "testnv.h"
+
+#define GROUPS		64
+#define KEYS		64
+#define VERSIONS	ECHO_HISTORY_MAX
+
+static const int changes[] = {1, 4, 16, 64, 256};
+
+static nvlist_t *
+config(void)
+{
+	nvlist_t *nvl = NULL, *group = NULL;
+	char name[16];
+	int g = 0, k = 0;
+
+	nvl = nvlist_create(0);
+	for (g = 0; g < GROUPS; ++g) {
+		group = nvlist_create(0);
+		for (k = 0; k < KEYS; ++k) {
+			snprintf(name, sizeof(name), "k%d", k);
+			nvlist_add_number(group, name, 0);
+		}
+		snprintf(name, sizeof(name), "g%d", g);
+		nvlist_move_nvlist(nvl, name, group);
+	}
+	return nvl;
+}
+
+/*
+ * Change count random keys of nvl in place and return the same changes as
+ * a patch.  Keys may repeat, so at most count leaves change.
+ */
+static nvlist_t *
+change(nvlist_t *nvl, int count, uint64_t value, unsigned *seed)
+{
+	nvlist_t *patch = NULL, *op = NULL, *group = NULL;
+	char gname[16], kname[16], path[32];
+	int i = 0;
+
+	patch = nvlist_create(0);
+	for (i = 0; i < count; ++i) {
+		snprintf(gname, sizeof(gname), "g%d", rand_r(seed) % GROUPS);
+		snprintf(kname, sizeof(kname), "k%d", rand_r(seed) % KEYS);
+		snprintf(path, sizeof(path), "%s.%s", gname, kname);
+		group = __DECONST(nvlist_t *, nvlist_get_nvlist(nvl, gname));
+		nvlist_free_number(group, kname);
+		nvlist_add_number(group, kname, value);
+
+		op = nvlist_create(0);
+		nvlist_add_number(op, ECHO_PATCH_OP, ECHO_PATCH_SET);
+		nvlist_add_string(op, ECHO_PATCH_PATH, path);
+		nvlist_add_number(op, ECHO_PATCH_VALUE, value);
+		nvlist_append_nvlist_array(patch, ECHO_PATCH_OPS, op);
+		nvlist_destroy(op);
+	}
+	return patch;
+}
+
+/*
+ * Keep the config and VERSIONS - 1 versions of it changing count keys each
+ * and return the nodes they added per version.
+ */
+static double
+run(int count, bool patched, unsigned *seed)
+{
+	struct echo_history hist;
+	struct echo_vnode *root = NULL, *next = NULL;
+	nvlist_t *nvl = NULL, *patch = NULL, *exported = NULL;
+	nvlist_t *versions[VERSIONS];
+	u_long before = 0, nodes = 0;
+	int v = 0;
+
+	echo_history_init(&hist);
+	nvl = config();
+	CHECK(echo_vtree_build(nvl, NULL, &root) == 0);
+	before = echo_history_nodes;
+	echo_history_push(&hist, echo_vnode_hold(root), 0, VERSIONS);
+	versions[0] = nvlist_clone(nvl);
+	for (v = 1; v < VERSIONS; ++v) {
+		nodes = echo_history_nodes;
+		patch = change(nvl, count, v, seed);
+		if (patched) {
+			CHECK(echo_vtree_patch(root, patch, &next) == 0);
+		} else {
+			CHECK(echo_vtree_build(nvl, root, &next) == 0);
+		}
+		CHECK(echo_history_nodes - nodes <= (u_long)2 * count + 1);
+		nvlist_destroy(patch);
+		echo_history_push(&hist, echo_vnode_hold(next), v, VERSIONS);
+		echo_vnode_release(root);
+		root = next;
+		versions[v] = nvlist_clone(nvl);
+	}
+	nodes = echo_history_nodes - before;
+	for (v = 0; v < VERSIONS; ++v) {
+		CHECK(echo_history_hold(&hist, v, &next) == 0);
+		exported = echo_vtree_export(next);
+		CHECK(test_nvlist_same(exported, versions[v]));
+		nvlist_destroy(exported);
+		echo_vnode_release(next);
+		nvlist_destroy(versions[v]);
+	}
+	echo_vnode_release(root);
+	echo_history_fini(&hist);
+	nvlist_destroy(nvl);
+	return (double)nodes / (VERSIONS - 1);
+}
+
+int
+main(void)
+{
+	struct echo_vnode *root = NULL;
+	nvlist_t *nvl = NULL;
+	u_long full = 0;
+	unsigned seed = 1;
+	size_t i = 0;
+
+	nvl = config();
+	CHECK(echo_vtree_build(nvl, NULL, &root) == 0);
+	full = echo_history_nodes;
+	echo_vnode_release(root);
+	nvlist_destroy(nvl);
+	CHECK(echo_history_nodes == 0);
+	for (i = 0; i < sizeof(changes) / sizeof(changes[0]); ++i) {
+		printf("changed: %d nodes/version set: %.1f patch: %.1f "
+		    "full copy: %lu\n", changes[i], run(changes[i], false, &seed),
+		    run(changes[i], true, &seed), full);
+	}
+	CHECK(echo_history_nodes == 0);
+	printf("history: ok\n");
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Paths, patches and their application, both to a plain nvlist with
+ * echo_patch_apply() and to a version tree with echo_vtree_patch(), which
+ * must agree on every patch, well formed or not.
+ */
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+#include "echo_patch.h"
+#include "echo_path.h"
+#include "diff.h"
+#include "test.h"
+#include "testnv.h"
+
+#define ROUNDS		20000
+
+/* Paths for hostile patches, malformed and dangling ones included. */
+static const char *test_paths[] = {
+	"a", "c\\.d", "b.a", "b[0].a", "e\\[1\\]", "a[1]", "h[9]", "", ".",
+	"a..b", "b[0]", "x[", "f\\\\g", "b", "h", "b.b.a", "h[0].b",
+};
+
+#define TEST_NPATHS	(sizeof(test_paths) / sizeof(test_paths[0]))
+
+static void
+check_resolve(const nvlist_t *nvl, const char *path, int error, int type)
+{
+	struct echo_path_ref ref;
+
+	CHECK(echo_path_resolve(nvl, path, &ref) == error);
+	if (error == 0) {
+		CHECK(ref.epr_type == type);
+		echo_path_release(&ref);
+	}
+}
+
+static void
+test_path(void)
+{
+	nvlist_t *nvl = NULL, *jail = NULL, *dst = NULL;
+	nvlist_t *ifaces[2];
+	struct echo_path_ref ref;
+	uint64_t nums[3] = {1, 2, 3};
+
+	ifaces[0] = nvlist_create(0);
+	nvlist_add_bool(ifaces[0], "destroy", true);
+	ifaces[1] = nvlist_create(0);
+	nvlist_add_bool(ifaces[1], "destroy", false);
+	jail = nvlist_create(0);
+	nvlist_add_nvlist_array(jail, "interface",
+	    (const nvlist_t * const *)ifaces, 2);
+	nvlist_add_number(jail, "c.d", 4);
+	nvlist_add_number_array(jail, "ports", nums, 3);
+	nvl = nvlist_create(0);
+	nvlist_move_nvlist(nvl, "jail0", jail);
+	nvlist_add_string(nvl, "f\\g", "escaped");
+
+	check_resolve(nvl, "jail0", 0, NV_TYPE_NVLIST);
+	check_resolve(nvl, "jail0.interface[1].destroy", 0, NV_TYPE_BOOL);
+	check_resolve(nvl, "jail0.interface[1]", 0, NV_TYPE_NVLIST_ARRAY);
+	check_resolve(nvl, "jail0.c\\.d", 0, NV_TYPE_NUMBER);
+	check_resolve(nvl, "jail0.ports[2]", 0, NV_TYPE_NUMBER_ARRAY);
+	check_resolve(nvl, "f\\\\g", 0, NV_TYPE_STRING);
+	check_resolve(nvl, "jail0.missing", 0, NV_TYPE_NONE);
+	check_resolve(nvl, "jail0.interface[2].destroy", ENOENT, 0);
+	check_resolve(nvl, "jail1.x", ENOENT, 0);
+	check_resolve(nvl, "jail0..x", EINVAL, 0);
+	check_resolve(nvl, "jail0.interface[", EINVAL, 0);
+	check_resolve(nvl, "", EINVAL, 0);
+
+	CHECK(echo_path_resolve(nvl, "jail0.interface[0].destroy", &ref) == 0);
+	dst = nvlist_create(0);
+	CHECK(echo_path_copy(&ref, dst) == 0);
+	CHECK(nvlist_get_bool(dst, "destroy"));
+	echo_path_release(&ref);
+	nvlist_destroy(dst);
+
+	CHECK(echo_path_resolve(nvl, "jail0.ports[1]", &ref) == 0);
+	dst = nvlist_create(0);
+	CHECK(echo_path_copy(&ref, dst) == 0);
+	CHECK(nvlist_get_number(dst, "ports") == 2);
+	echo_path_release(&ref);
+	nvlist_destroy(dst);
+
+	nvlist_destroy(ifaces[0]);
+	nvlist_destroy(ifaces[1]);
+	nvlist_destroy(nvl);
+}
+
+/* A diff applied to the old config gives the new one. */
+static void
+test_diff_apply(unsigned *seed)
+{
+	nvlist_t *old = NULL, *new = NULL, *patch = NULL;
+	int i = 0;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		old = test_nvlist(seed, 0);
+		new = test_nvlist(seed, 0);
+		patch = nv_diff(old, new);
+		CHECK(echo_patch_apply(old, patch) == 0);
+		nvlist_destroy(patch);
+		patch = nv_diff(old, new);
+		CHECK(!nvlist_exists(patch, ECHO_PATCH_OPS));
+		nvlist_destroy(patch);
+		nvlist_destroy(old);
+		nvlist_destroy(new);
+	}
+}
+
+static nvlist_t *
+hostile_patch(unsigned *seed)
+{
+	nvlist_t *patch = NULL, *op = NULL;
+	nvlist_t *values[2];
+	uint64_t nums[2] = {7, 8};
+	int count = 0, i = 0;
+
+	patch = nvlist_create(0);
+	count = 1 + rand_r(seed) % 3;
+	for (i = 0; i < count; ++i) {
+		op = nvlist_create(0);
+		nvlist_add_number(op, ECHO_PATCH_OP, rand_r(seed) % 4);
+		nvlist_add_string(op, ECHO_PATCH_PATH,
+		    test_paths[rand_r(seed) % TEST_NPATHS]);
+		if (rand_r(seed) % 2) {
+			nvlist_add_number(op, ECHO_PATCH_INDEX, rand_r(seed) % 3);
+		}
+		if (rand_r(seed) % 2) {
+			nvlist_add_number(op, ECHO_PATCH_COUNT, rand_r(seed) % 3);
+		}
+		switch (rand_r(seed) % 4) {
+			case 0:
+				nvlist_add_number(op, ECHO_PATCH_VALUE, 1);
+				break;
+			case 1:
+				nvlist_add_number_array(op, ECHO_PATCH_VALUE, nums, 2);
+				break;
+			case 2:
+				nvlist_move_nvlist(op, ECHO_PATCH_VALUE,
+				    test_nvlist(seed, 1));
+				break;
+			case 3:
+				values[0] = test_nvlist(seed, 1);
+				values[1] = test_nvlist(seed, 1);
+				nvlist_add_nvlist_array(op, ECHO_PATCH_VALUE,
+				    (const nvlist_t * const *)values, 2);
+				nvlist_destroy(values[0]);
+				nvlist_destroy(values[1]);
+				break;
+		}
+		nvlist_append_nvlist_array(patch, ECHO_PATCH_OPS, op);
+		nvlist_destroy(op);
+	}
+	return patch;
+}
+
+/*
+ * Every patch does the same to a tree as to an nvlist.  The tree it was
+ * applied to never changes, even when a later op fails after earlier ones
+ * were applied.
+ */
+static void
+test_tree_patch(unsigned *seed)
+{
+	struct echo_vnode *root = NULL, *patched = NULL;
+	nvlist_t *nvl = NULL, *copy = NULL, *patch = NULL, *tpatch = NULL;
+	nvlist_t *exported = NULL;
+	int i = 0, error = 0;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		nvl = test_nvlist(seed, 0);
+		patch = hostile_patch(seed);
+		tpatch = nvlist_clone(patch);
+		CHECK(echo_vtree_build(nvl, NULL, &root) == 0);
+		copy = nvlist_clone(nvl);
+		error = echo_patch_apply(copy, patch);
+		CHECK(echo_vtree_patch(root, tpatch, &patched) == error);
+		exported = echo_vtree_export(root);
+		CHECK(test_nvlist_same(exported, nvl));
+		nvlist_destroy(exported);
+		if (error == 0) {
+			exported = echo_vtree_export(patched);
+			CHECK(test_nvlist_same(exported, copy));
+			nvlist_destroy(exported);
+			echo_vnode_release(patched);
+		}
+		echo_vnode_release(root);
+		nvlist_destroy(copy);
+		nvlist_destroy(tpatch);
+		nvlist_destroy(patch);
+		nvlist_destroy(nvl);
+	}
+}
+
+/* A patch made against an older generation is refused. */
+static void
+test_store_base(void)
+{
+	struct echo_store store;
+	nvlist_t *nvl = NULL;
+	uint64_t gen = 0, base = 0;
+	size_t len = 0;
+	void *buf = NULL;
+
+	CHECK(echo_core_init(NULL) == 0);
+	echo_store_init(&store);
+	nvl = nvlist_create(0);
+	nvlist_add_number(nvl, "a", 1);
+	CHECK(echo_store_publish(&store, nvl) == 0);
+	base = store.est_snap->es_gen;
+	nvl = nvlist_create(0);
+	buf = nvlist_pack(nvl, &len);
+	nvlist_destroy(nvl);
+	CHECK(echo_store_patch(&store, buf, len, base + 1, &gen) == ESTALE);
+	CHECK(gen == 0 && store.est_snap->es_gen == base);
+	CHECK(echo_store_patch(&store, buf, len, base, &gen) == 0);
+	CHECK(gen == base + 1 && store.est_snap->es_gen == gen);
+	CHECK(echo_store_patch(&store, buf, len, base, &gen) == ESTALE);
+	CHECK(echo_store_patch(&store, buf, len, 0, NULL) == 0);
+	free(buf);
+	echo_store_fini(&store);
+	echo_core_fini();
+}
+
+int
+main(void)
+{
+	unsigned seed = 1;
+
+	test_path();
+	test_diff_apply(&seed);
+	test_tree_patch(&seed);
+	test_store_base();
+	printf("patch: ok\n");
+	return 0;
+}
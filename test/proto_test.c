@@ -0,0 +1,849 @@
+/*
+ * The ioctl protocol as echo_proto_ioctl() serves it, with plain pointers
+ * standing in for user addresses.  Gets copy the packed snapshot cached by
+ * the last set and only a set or a patch replaces it.  Namespaces are
+ * kept apart: setting or deleting one leaves the others and the global
+ * config alone.  Queries return just the value at their path.  A batch runs
+ * every op and reports each one's error on its own.  A single call get
+ * fills a large enough buffer, reports the size and generation otherwise
+ * and copies nothing when the caller already has the current generation;
+ * history requests report the size they need the same way.  A waiter on the
+ * generation wakes up to the next publish and one nobody publishes for
+ * times out.
+ *
+ * Prints the gets per second of a size probe and a fetch, the way program
+ * -g does them, next to packing the config for every get as the module used
+ * to, and the same for a query of one value.  Then prints the ops per
+ * second of queries run in batches next to the same queries run one call
+ * each; without a syscall in between, that only measures what a batch
+ * saves in the dispatcher.  Then come the sets per second of one namespace
+ * among more and more of them, which should not drop, next to setting all
+ * of them as blocks of the global config.  Last, the calls per get of a
+ * client that keeps and grows one buffer, as program does, while the
+ * config changes size between gets.
+ */
+#include "echo_compat.h"
+#include <unistd.h>
+
+#include "echo.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+#include "test.h"
+
+#define GROUPS		256
+#define KEYS		32
+#define NSGROUPS	16
+#define MAXNS		256
+#define BATCH		64
+#define GETS		200
+#define GET_BUFSIZE	(64 * 1024)
+#define WAIT_MS		100
+
+/* A client's get buffer, kept across gets and only ever grown. */
+struct client {
+	void		*c_buf;
+	size_t		 c_cap;
+	uint64_t	 c_calls;
+};
+
+static struct echo_store store;
+static struct echo_nstab tab;
+static struct echo_file file;
+
+static int
+proto(u_long cmd, void *data)
+{
+	return echo_proto_ioctl(&store, &tab, &file, cmd, data);
+}
+
+static nvlist_t *
+config(int groups, uint64_t value)
+{
+	nvlist_t *nvl = NULL, *group = NULL;
+	char name[16];
+	int g = 0, k = 0;
+
+	nvl = nvlist_create(0);
+	for (g = 0; g < groups; ++g) {
+		group = nvlist_create(0);
+		for (k = 0; k < KEYS; ++k) {
+			snprintf(name, sizeof(name), "k%d", k);
+			nvlist_add_number(group, name, value);
+		}
+		nvlist_add_string(group, "name", "echo proto_test");
+		snprintf(name, sizeof(name), "g%d", g);
+		nvlist_move_nvlist(nvl, name, group);
+	}
+	return nvl;
+}
+
+/* Set the global config to nvl, which is consumed. */
+static void
+set(nvlist_t *nvl)
+{
+	nvecho_t data = {0};
+
+	data.buf = nvlist_pack(nvl, &data.len);
+	CHECK(data.buf != NULL);
+	CHECK(proto(ECHO_IOCTL, &data) == 0);
+	free(data.buf);
+	nvlist_destroy(nvl);
+}
+
+/* Get the global config with a size probe and a fetch. */
+static void *
+get(size_t *lenp)
+{
+	nvecho_t data = {0};
+
+	CHECK(proto(ECHO_IOCTL, &data) == 0 && data.len > 0);
+	data.buf = malloc(data.len);
+	CHECK(data.buf != NULL);
+	*lenp = data.len;
+	data.len = 0;
+	CHECK(proto(ECHO_IOCTL, &data) == 0 && data.len == *lenp);
+	return data.buf;
+}
+
+/* Set namespace name to nvl, which is consumed. */
+static int
+nsset(const char *name, nvlist_t *nvl)
+{
+	nvecho_ns_t data = {{0}};
+	int error = 0;
+
+	snprintf(data.name, sizeof(data.name), "%s", name);
+	data.buf = nvlist_pack(nvl, &data.len);
+	CHECK(data.buf != NULL);
+	error = proto(ECHO_IOCTL_NSSET, &data);
+	free(data.buf);
+	nvlist_destroy(nvl);
+	return error;
+}
+
+/* Get namespace name, which must be as big as nvl, and compare. */
+static int
+nsget(const char *name, const nvlist_t *nvl)
+{
+	nvecho_ns_t data = {{0}};
+	void *packed = NULL;
+	size_t plen = 0;
+	int error = 0;
+
+	snprintf(data.name, sizeof(data.name), "%s", name);
+	error = proto(ECHO_IOCTL_NSGET, &data);
+	if (error) {
+		return error;
+	}
+	packed = nvlist_pack(nvl, &plen);
+	CHECK(packed != NULL && data.len == plen);
+	data.buf = malloc(plen);
+	CHECK(data.buf != NULL);
+	CHECK(proto(ECHO_IOCTL_NSGET, &data) == 0 && data.len == plen);
+	CHECK(memcmp(data.buf, packed, plen) == 0);
+	free(data.buf);
+	free(packed);
+	return 0;
+}
+
+static int
+nsdel(const char *name)
+{
+	nvecho_ns_t data = {{0}};
+
+	snprintf(data.name, sizeof(data.name), "%s", name);
+	return proto(ECHO_IOCTL_NSDEL, &data);
+}
+
+static struct echo_snap *
+nssnap(const char *name)
+{
+	struct echo_ns *ns = NULL;
+	struct echo_snap *snap = NULL;
+
+	CHECK(echo_nstab_lookup(&tab, name, &ns) == 0);
+	snap = ns->en_store.est_snap;
+	echo_ns_release(ns);
+	return snap;
+}
+
+/*
+ * Query path in namespace ns, or in the global config if ns is empty, with a
+ * size probe and a fetch.  The result goes in *nvlp.
+ */
+static int
+query(const char *ns, const char *path, nvlist_t **nvlp)
+{
+	nvecho_query_t data = {{0}};
+	size_t len = 0;
+	int error = 0;
+
+	snprintf(data.ns, sizeof(data.ns), "%s", ns);
+	data.path = path;
+	data.pathlen = strlen(path);
+	error = proto(ECHO_IOCTL_QUERY, &data);
+	if (error) {
+		return error;
+	}
+	len = data.len;
+	data.buf = malloc(len);
+	CHECK(data.buf != NULL);
+	CHECK(proto(ECHO_IOCTL_QUERY, &data) == 0 && data.len == len);
+	*nvlp = nvlist_unpack(data.buf, len, 0);
+	CHECK(*nvlp != NULL);
+	free(data.buf);
+	return 0;
+}
+
+/* What program's getbuf_grow() does. */
+static void
+client_grow(struct client *c, size_t size)
+{
+	size_t cap = c->c_cap == 0 ? GET_BUFSIZE : c->c_cap;
+
+	while (cap < size) {
+		cap *= 2;
+	}
+	if (cap != c->c_cap) {
+		c->c_buf = realloc(c->c_buf, cap);
+		CHECK(c->c_buf != NULL);
+		c->c_cap = cap;
+	}
+}
+
+/* What program's ioctl_fetch() does, counting the calls. */
+static int
+client_fetch(struct client *c, const char *ns, size_t *lenp, uint64_t *genp)
+{
+	nvecho_get_t get = {{0}};
+	int error = 0;
+
+	snprintf(get.ns, sizeof(get.ns), "%s", ns);
+	client_grow(c, 0);
+	for (;;) {
+		get.buf = c->c_buf;
+		get.cap = c->c_cap;
+		get.gen = *genp;
+		c->c_calls++;
+		error = proto(ECHO_IOCTL_GET, &get);
+		if (error) {
+			return error;
+		}
+		if (get.error != ERANGE) {
+			break;
+		}
+		client_grow(c, get.len);
+	}
+	if (get.error == 0) {
+		*lenp = get.len;
+		*genp = get.gen;
+	}
+	return get.error;
+}
+
+static void
+test_get(void)
+{
+	nvlist_t *nvl = NULL, *patch = NULL;
+	nvecho_t data = {0};
+	void *buf = NULL, *packed = NULL, *cached = NULL;
+	size_t len = 0, plen = 0;
+	uint64_t gen = 0;
+
+	nvl = config(4, 1);
+	packed = nvlist_pack(nvl, &plen);
+	set(nvl);
+	cached = store.est_snap->es_buf;
+	gen = store.est_snap->es_gen;
+	CHECK(cached != NULL);
+	buf = get(&len);
+	CHECK(len == plen && memcmp(buf, packed, len) == 0);
+	free(buf);
+	buf = get(&len);
+	CHECK(store.est_snap->es_buf == cached && store.est_snap->es_gen == gen);
+	free(buf);
+	free(packed);
+
+	/* A set replaces the snapshot along with its buffer. */
+	nvl = config(4, 2);
+	packed = nvlist_pack(nvl, &plen);
+	set(nvl);
+	CHECK(store.est_snap->es_gen > gen);
+	buf = get(&len);
+	CHECK(len == plen && memcmp(buf, packed, len) == 0);
+	free(buf);
+	free(packed);
+
+	/* A patch is only packed by the first get after it. */
+	patch = nvlist_create(0);
+	data.buf = nvlist_pack(patch, &data.len);
+	nvlist_destroy(patch);
+	CHECK(proto(ECHO_IOCTL_PATCH, &data) == 0);
+	free(data.buf);
+	CHECK(store.est_snap->es_buf == NULL);
+	buf = get(&len);
+	cached = store.est_snap->es_buf;
+	CHECK(cached != NULL && len == store.est_snap->es_len);
+	free(buf);
+	buf = get(&len);
+	CHECK(store.est_snap->es_buf == cached);
+	free(buf);
+}
+
+static void
+test_ns(void)
+{
+	nvlist_t *a = NULL, *b = NULL, *c = NULL;
+	struct echo_snap *snap = NULL, *global = NULL;
+	nvecho_ns_t data = {{0}};
+	char name[ECHO_NSNAMELEN];
+
+	a = config(1, 1);
+	b = config(2, 2);
+	c = config(3, 3);
+	global = store.est_snap;
+	CHECK(nsget("jail0", a) == ENOENT);
+	CHECK(nsset("jail0", nvlist_clone(a)) == 0);
+	CHECK(nsset("jail1", nvlist_clone(b)) == 0);
+	CHECK(nsget("jail0", a) == 0);
+	CHECK(nsget("jail1", b) == 0);
+
+	/* Setting one namespace keeps the snapshots of the others. */
+	snap = nssnap("jail1");
+	CHECK(nsset("jail0", nvlist_clone(c)) == 0);
+	CHECK(nsget("jail0", c) == 0);
+	CHECK(nssnap("jail1") == snap && store.est_snap == global);
+	CHECK(nsdel("jail0") == 0);
+	CHECK(nsget("jail0", c) == ENOENT && nsdel("jail0") == ENOENT);
+	CHECK(nsget("jail1", b) == 0);
+	CHECK(nssnap("jail1") == snap && store.est_snap == global);
+
+	/* Names are nonempty, short and from a safe alphabet. */
+	CHECK(nsset("", nvlist_clone(a)) == EINVAL);
+	CHECK(nsset("jail.0", nvlist_clone(a)) == EINVAL);
+	CHECK(nsset("jail/0", nvlist_clone(a)) == EINVAL);
+	memset(name, 'x', sizeof(name));
+	name[ECHO_NSNAMELEN - 1] = '\0';
+	CHECK(nsset(name, nvlist_clone(a)) == 0);
+	CHECK(nsget(name, a) == 0 && nsdel(name) == 0);
+	memset(data.name, 'x', sizeof(data.name));
+	CHECK(proto(ECHO_IOCTL_NSGET, &data) == EINVAL);
+	CHECK(proto(ECHO_IOCTL_NSDEL, &data) == EINVAL);
+
+	/* A broken config leaves the namespace as it was. */
+	snprintf(data.name, sizeof(data.name), "jail1");
+	data.buf = "broken";
+	data.len = 6;
+	CHECK(proto(ECHO_IOCTL_NSSET, &data) == EINVAL);
+	CHECK(nssnap("jail1") == snap);
+	CHECK(nsdel("jail1") == 0);
+	nvlist_destroy(a);
+	nvlist_destroy(b);
+	nvlist_destroy(c);
+}
+
+static void
+test_query(void)
+{
+	nvlist_t *nvl = NULL, *jail = NULL, *host = NULL, *result = NULL;
+	nvlist_t *ifaces[2];
+	nvecho_query_t data = {{0}};
+	char buf[8];
+	int i = 0;
+
+	jail = nvlist_create(0);
+	host = nvlist_create(0);
+	nvlist_add_string(host, "hostname", "jail0.example.org");
+	nvlist_move_nvlist(jail, "host", host);
+	for (i = 0; i < 2; ++i) {
+		ifaces[i] = nvlist_create(0);
+		nvlist_add_number(ifaces[i], "mtu", 1500 + i);
+	}
+	nvlist_add_nvlist_array(jail, "interface",
+	    (const nvlist_t * const *)ifaces, 2);
+	nvlist_destroy(ifaces[0]);
+	nvlist_destroy(ifaces[1]);
+	nvl = nvlist_create(0);
+	nvlist_move_nvlist(nvl, "jail0", jail);
+	CHECK(nsset("jails", nvlist_clone(nvl)) == 0);
+	set(nvl);
+
+	CHECK(query("", "jail0.host.hostname", &result) == 0);
+	CHECK(strcmp(nvlist_get_string(result, "hostname"),
+	    "jail0.example.org") == 0);
+	nvlist_destroy(result);
+	CHECK(query("jails", "jail0.host", &result) == 0);
+	CHECK(strcmp(nvlist_get_string(nvlist_get_nvlist(result, "host"),
+	    "hostname"), "jail0.example.org") == 0);
+	nvlist_destroy(result);
+	CHECK(query("", "jail0.interface[1].mtu", &result) == 0);
+	CHECK(nvlist_get_number(result, "mtu") == 1501);
+	nvlist_destroy(result);
+	CHECK(query("", "jail0.interface[1]", &result) == 0);
+	CHECK(nvlist_get_number(nvlist_get_nvlist(result, "interface"),
+	    "mtu") == 1501);
+	nvlist_destroy(result);
+
+	CHECK(query("", "jail0.host.domain", &result) == ENOENT);
+	CHECK(query("", "jail1.host", &result) == ENOENT);
+	CHECK(query("", "jail0.interface[2].mtu", &result) == ENOENT);
+	CHECK(query("nojails", "jail0", &result) == ENOENT);
+	CHECK(query("", "jail0..host", &result) == EINVAL);
+	CHECK(query("", "", &result) == EINVAL);
+
+	/* The path must not hold a NUL and the result must fit. */
+	data.path = "jail0\0.host";
+	data.pathlen = 10;
+	CHECK(proto(ECHO_IOCTL_QUERY, &data) == EINVAL);
+	data.pathlen = 5;
+	data.buf = buf;
+	data.len = sizeof(buf);
+	CHECK(proto(ECHO_IOCTL_QUERY, &data) == ERANGE && data.len > sizeof(buf));
+	CHECK(nsdel("jails") == 0);
+}
+
+static void
+test_getbuf(void)
+{
+	nvlist_t *nvl = NULL;
+	nvecho_get_t get = {{0}};
+	char small[16];
+	void *packed = NULL;
+	size_t plen = 0;
+	uint64_t gen = 0;
+
+	nvl = config(2, 9);
+	packed = nvlist_pack(nvl, &plen);
+	set(nvl);
+	gen = store.est_snap->es_gen;
+
+	/* No buffer or too small a one gets the size and generation. */
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0);
+	CHECK(get.error == ERANGE && get.len == plen && get.gen == gen);
+	get.buf = small;
+	get.cap = sizeof(small);
+	get.gen = 0;
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0);
+	CHECK(get.error == ERANGE && get.len == plen && get.gen == gen);
+	get.buf = malloc(plen);
+	CHECK(get.buf != NULL);
+	get.cap = plen;
+	get.gen = 0;
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0);
+	CHECK(get.error == 0 && get.len == plen && get.gen == gen);
+	CHECK(memcmp(get.buf, packed, plen) == 0);
+
+	/* The generation the caller has is not copied again. */
+	memset(get.buf, 0, plen);
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0);
+	CHECK(get.error == EALREADY && get.gen == gen);
+	CHECK(((char *)get.buf)[0] == 0);
+	free(packed);
+
+	/* A config replaced between the size and the retry is read whole. */
+	nvl = config(3, 9);
+	packed = nvlist_pack(nvl, &plen);
+	set(nvl);
+	get.gen = gen;
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0);
+	CHECK(get.error == ERANGE && get.len == plen && get.gen > gen);
+	free(get.buf);
+	get.buf = malloc(plen);
+	CHECK(get.buf != NULL);
+	get.cap = plen;
+	get.gen = gen;
+	CHECK(proto(ECHO_IOCTL_GET, &get) == 0 && get.error == 0);
+	CHECK(get.len == plen && memcmp(get.buf, packed, plen) == 0);
+	free(get.buf);
+	free(packed);
+
+	snprintf(get.ns, sizeof(get.ns), "missing");
+	CHECK(proto(ECHO_IOCTL_GET, &get) == ENOENT);
+	memset(get.ns, 'x', sizeof(get.ns));
+	CHECK(proto(ECHO_IOCTL_GET, &get) == EINVAL);
+}
+
+static void
+test_batch(void)
+{
+	nvlist_t *nvl = NULL, *result = NULL;
+	nvecho_op_t ops[7];
+	nvecho_batch_t batch = {0};
+	void *packed = NULL;
+	char small[4], buf[256];
+	size_t plen = 0;
+
+	nvl = config(1, 5);
+	packed = nvlist_pack(nvl, &plen);
+	memset(ops, 0, sizeof(ops));
+	ops[0].op = ECHO_OP_SET;
+	snprintf(ops[0].ns, sizeof(ops[0].ns), "batch");
+	ops[0].buf = packed;
+	ops[0].len = plen;
+	ops[1].op = ECHO_OP_GET;
+	snprintf(ops[1].ns, sizeof(ops[1].ns), "batch");
+	ops[2].op = ECHO_OP_QUERY;
+	snprintf(ops[2].ns, sizeof(ops[2].ns), "batch");
+	ops[2].path = "g0.k1";
+	ops[2].pathlen = 5;
+	ops[2].buf = buf;
+	ops[2].len = sizeof(buf);
+	ops[3].op = ECHO_OP_QUERY;
+	snprintf(ops[3].ns, sizeof(ops[3].ns), "batch");
+	ops[3].path = "g0.k1";
+	ops[3].pathlen = 5;
+	ops[3].buf = small;
+	ops[3].len = sizeof(small);
+	ops[4].op = 99;
+	ops[5].op = ECHO_OP_DEL;
+	snprintf(ops[5].ns, sizeof(ops[5].ns), "batch");
+	ops[6].op = ECHO_OP_GET;
+	snprintf(ops[6].ns, sizeof(ops[6].ns), "batch");
+	batch.ops = ops;
+	batch.count = 7;
+	CHECK(proto(ECHO_IOCTL_BATCH, &batch) == 0);
+	CHECK(ops[0].error == 0);
+	CHECK(ops[1].error == 0 && ops[1].len == plen);
+	CHECK(ops[2].error == 0);
+	result = nvlist_unpack(buf, ops[2].len, 0);
+	CHECK(result != NULL && nvlist_get_number(result, "k1") == 5);
+	nvlist_destroy(result);
+	CHECK(ops[3].error == ERANGE && ops[3].len > sizeof(small));
+	CHECK(ops[4].error == EINVAL);
+	CHECK(ops[5].error == 0);
+	CHECK(ops[6].error == ENOENT);
+
+	batch.count = 0;
+	CHECK(proto(ECHO_IOCTL_BATCH, &batch) == EINVAL);
+	batch.count = ECHO_BATCHMAX + 1;
+	CHECK(proto(ECHO_IOCTL_BATCH, &batch) == EINVAL);
+	free(packed);
+	nvlist_destroy(nvl);
+}
+
+static void
+test_history(void)
+{
+	nvecho_history_t hist = {0};
+	nvlist_t *nvl = NULL;
+	const uint64_t *gens = NULL;
+	char small[4];
+	size_t n = 0;
+
+	set(config(1, 1));
+	set(config(1, 2));
+
+	/* Too small a buffer gets the size needed in the same call. */
+	hist.op = ECHO_HISTORY_LIST;
+	hist.buf = small;
+	hist.len = sizeof(small);
+	CHECK(proto(ECHO_IOCTL_HISTORY, &hist) == 0);
+	CHECK(hist.error == ERANGE && hist.len > sizeof(small));
+	hist.buf = malloc(hist.len);
+	CHECK(hist.buf != NULL);
+	CHECK(proto(ECHO_IOCTL_HISTORY, &hist) == 0 && hist.error == 0);
+	nvl = nvlist_unpack(hist.buf, hist.len, 0);
+	CHECK(nvl != NULL);
+	gens = nvlist_get_number_array(nvl, ECHO_HISTORY_GENS, &n);
+	CHECK(n >= 2 && gens[0] == store.est_snap->es_gen && gens[1] < gens[0]);
+	free(hist.buf);
+
+	hist.op = ECHO_HISTORY_GET;
+	hist.gen = gens[1];
+	hist.buf = small;
+	hist.len = sizeof(small);
+	CHECK(proto(ECHO_IOCTL_HISTORY, &hist) == 0);
+	CHECK(hist.error == ERANGE && hist.len > sizeof(small));
+	nvlist_destroy(nvl);
+}
+
+/* Waits for a publish past *arg on a file descriptor of its own. */
+static void *
+waiter(void *arg)
+{
+	nvecho_wait_t *wait = arg;
+	struct echo_file fp;
+	intptr_t error = 0;
+
+	echo_file_init(&fp);
+	error = echo_proto_ioctl(&store, &tab, &fp, ECHO_IOCTL_WAIT, wait);
+	echo_file_fini(&fp);
+	return (void *)error;
+}
+
+static void
+test_wait(void)
+{
+	nvecho_wait_t wait = {0};
+	pthread_t thread;
+	uint64_t gen = 0;
+	double start = 0;
+	void *error = NULL;
+
+	CHECK(proto(ECHO_IOCTL_GEN, &gen) == 0);
+	CHECK(gen == echo_core_gen());
+
+	/* Sleeps through nothing and wakes up to the next publish. */
+	wait.gen = gen;
+	wait.timeout = 10 * 1000;
+	CHECK(pthread_create(&thread, NULL, waiter, &wait) == 0);
+	usleep(WAIT_MS * 1000);
+	set(config(1, 7));
+	CHECK(pthread_join(thread, &error) == 0);
+	CHECK(error == NULL && wait.gen == gen + 1);
+	++gen;
+
+	/* Nothing published in time. */
+	wait.gen = gen;
+	wait.timeout = WAIT_MS;
+	start = test_now();
+	CHECK(proto(ECHO_IOCTL_WAIT, &wait) == ETIMEDOUT);
+	CHECK(wait.gen == gen && test_now() - start >= WAIT_MS / 1e3 * 0.9);
+	CHECK(echo_core_wait(gen, WAIT_MS, &gen) == ETIMEDOUT);
+	CHECK(gen == wait.gen);
+
+	/* Already past. */
+	wait.gen = gen - 1;
+	CHECK(proto(ECHO_IOCTL_WAIT, &wait) == 0 && wait.gen == gen);
+}
+
+static double
+bench_cached(size_t len, double duration)
+{
+	nvecho_t data = {0};
+	void *buf = NULL;
+	double start = 0;
+	uint64_t n = 0;
+
+	buf = malloc(len);
+	CHECK(buf != NULL);
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		data.buf = NULL;
+		CHECK(proto(ECHO_IOCTL, &data) == 0 && data.len == len);
+		data.buf = buf;
+		data.len = 0;
+		CHECK(proto(ECHO_IOCTL, &data) == 0);
+	}
+	free(buf);
+	return n / (test_now() - start);
+}
+
+static double
+bench_repacked(const nvlist_t *nvl, size_t len, double duration)
+{
+	void *buf = NULL, *packed = NULL;
+	double start = 0;
+	size_t plen = 0;
+	uint64_t n = 0;
+
+	buf = malloc(len);
+	CHECK(buf != NULL);
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		CHECK(nvlist_size(nvl) == len);
+		packed = nvlist_pack(nvl, &plen);
+		CHECK(packed != NULL && plen == len);
+		memcpy(buf, packed, plen);
+		free(packed);
+	}
+	free(buf);
+	return n / (test_now() - start);
+}
+
+static void
+bench_get(double duration)
+{
+	nvlist_t *nvl = NULL;
+	size_t len = 0;
+	double cached = 0, repacked = 0;
+
+	nvl = config(GROUPS, 7);
+	set(nvlist_clone(nvl));
+	len = store.est_snap->es_len;
+	cached = bench_cached(len, duration);
+	repacked = bench_repacked(nvl, len, duration);
+	printf("get: %zu bytes cached gets/s: %.0f repacked gets/s: %.0f\n",
+	    len, cached, repacked);
+	nvlist_destroy(nvl);
+}
+
+/*
+ * Set namespace ns0 while n namespaces exist, then set the same configs as
+ * n blocks of the global config.
+ */
+static void
+bench_ns(int n, double duration)
+{
+	nvlist_t *nvl = NULL, *all = NULL;
+	nvecho_ns_t data = {{0}};
+	nvecho_t gdata = {0};
+	char name[ECHO_NSNAMELEN];
+	double start = 0, nsrate = 0, globalrate = 0;
+	uint64_t count = 0;
+	int i = 0;
+
+	all = nvlist_create(0);
+	for (i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "ns%d", i);
+		CHECK(nsset(name, config(NSGROUPS, i)) == 0);
+		nvlist_move_nvlist(all, name, config(NSGROUPS, i));
+	}
+	nvl = config(NSGROUPS, 0);
+	snprintf(data.name, sizeof(data.name), "ns0");
+	data.buf = nvlist_pack(nvl, &data.len);
+	CHECK(data.buf != NULL);
+	start = test_now();
+	for (count = 0; count == 0 || test_now() - start < duration; ++count) {
+		CHECK(proto(ECHO_IOCTL_NSSET, &data) == 0);
+	}
+	nsrate = count / (test_now() - start);
+	gdata.buf = nvlist_pack(all, &gdata.len);
+	CHECK(gdata.buf != NULL);
+	start = test_now();
+	for (count = 0; count == 0 || test_now() - start < duration; ++count) {
+		CHECK(proto(ECHO_IOCTL, &gdata) == 0);
+	}
+	globalrate = count / (test_now() - start);
+	printf("namespaces: %d ns sets/s: %.0f global sets/s: %.0f\n", n,
+	    nsrate, globalrate);
+	for (i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "ns%d", i);
+		CHECK(nsdel(name) == 0);
+	}
+	free(gdata.buf);
+	free(data.buf);
+	nvlist_destroy(nvl);
+	nvlist_destroy(all);
+}
+
+/* A query of one value next to getting the whole config for it. */
+static void
+bench_query(double duration)
+{
+	nvecho_query_t data = {{0}};
+	void *buf = NULL;
+	double start = 0, rate = 0;
+	size_t len = 0;
+	uint64_t n = 0;
+
+	set(config(GROUPS, 7));
+	buf = get(&len);
+	data.path = "g7.k3";
+	data.pathlen = strlen(data.path);
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		data.buf = buf;
+		data.len = len;
+		CHECK(proto(ECHO_IOCTL_QUERY, &data) == 0);
+	}
+	rate = n / (test_now() - start);
+	printf("query: %zu bytes queries/s: %.0f get: %zu bytes gets/s: %.0f\n",
+	    data.len, rate, len, bench_cached(len, duration));
+	free(buf);
+}
+
+/* BATCH queries of different keys, in one call and in one call each. */
+static void
+bench_batch(double duration)
+{
+	nvecho_op_t ops[BATCH];
+	nvecho_batch_t batch = {ops, BATCH};
+	nvecho_query_t query = {{0}};
+	char paths[BATCH][32], bufs[BATCH][128];
+	double start = 0, batched = 0, single = 0;
+	uint64_t n = 0;
+	int i = 0;
+
+	set(config(GROUPS, 7));
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < BATCH; ++i) {
+		snprintf(paths[i], sizeof(paths[i]), "g%d.k%d", i, i % KEYS);
+		ops[i].op = ECHO_OP_QUERY;
+		ops[i].path = paths[i];
+		ops[i].pathlen = strlen(paths[i]);
+	}
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		for (i = 0; i < BATCH; ++i) {
+			ops[i].buf = bufs[i];
+			ops[i].len = sizeof(bufs[i]);
+		}
+		CHECK(proto(ECHO_IOCTL_BATCH, &batch) == 0);
+		for (i = 0; i < BATCH; ++i) {
+			CHECK(ops[i].error == 0);
+		}
+	}
+	batched = n * BATCH / (test_now() - start);
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < duration; ++n) {
+		for (i = 0; i < BATCH; ++i) {
+			query.path = paths[i];
+			query.pathlen = ops[i].pathlen;
+			query.buf = bufs[i];
+			query.len = sizeof(bufs[i]);
+			CHECK(proto(ECHO_IOCTL_QUERY, &query) == 0);
+		}
+	}
+	single = n * BATCH / (test_now() - start);
+	printf("batch: %d ops batched ops/s: %.0f single ops/s: %.0f\n", BATCH,
+	    batched, single);
+}
+
+/*
+ * GETS gets by a client that reuses its buffer, of a config set to a random
+ * size before each.  A size probe and a fetch always take two calls.
+ */
+static void
+bench_round_trips(void)
+{
+	struct client c = {0};
+	size_t len = 0;
+	uint64_t gen = 0;
+	unsigned seed = 1;
+	int i = 0;
+
+	for (i = 0; i < GETS; ++i) {
+		set(config(1 + rand_r(&seed) % GROUPS, i));
+		gen = 0;
+		CHECK(client_fetch(&c, "", &len, &gen) == 0);
+		CHECK(gen == store.est_snap->es_gen && len == store.est_snap->es_len);
+	}
+	printf("round trips: %d gets buffer: %zu bytes calls/get: %.2f "
+	    "probe and fetch calls/get: 2.00\n", GETS, c.c_cap,
+	    (double)c.c_calls / GETS);
+	free(c.c_buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	int n = 0;
+
+	CHECK(echo_core_init(NULL) == 0);
+	echo_store_init(&store);
+	echo_nstab_init(&tab, NULL, NULL);
+	echo_file_init(&file);
+	test_get();
+	test_ns();
+	test_query();
+	test_getbuf();
+	test_batch();
+	test_history();
+	test_wait();
+	printf("proto: ok\n");
+	bench_get(duration);
+	bench_query(duration);
+	bench_batch(duration);
+	for (n = 1; n <= MAXNS; n *= 4) {
+		bench_ns(n, duration);
+	}
+	bench_round_trips();
+	echo_file_fini(&file);
+	echo_nstab_fini(&tab);
+	echo_store_fini(&store);
+	echo_core_fini();
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Readers of a store against a writer publishing as fast as it can.  Every
+ * snapshot a reader gets must be whole and no older than the last one it
+ * saw.  Prints the reads per second for 1, 2, 4... readers up to the number
+ * of CPUs, which should grow with the readers since they share no lock.
+ */
+#include "echo_compat.h"
+
+#include <unistd.h>
+
+#include "echo.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+#include "test.h"
+
+#define MAXREADERS	64
+
+struct reader {
+	pthread_t	 r_thread;
+	uint64_t	 r_reads;
+};
+
+static struct echo_store store;
+static int stop;
+
+static void *
+reader(void *arg)
+{
+	struct reader *r = arg;
+	struct echo_snap *snap = NULL;
+	nvlist_t *nvl = NULL;
+	uint64_t last = 0;
+	size_t len = 0;
+	void *buf = NULL;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		snap = echo_store_acquire(&store);
+		CHECK(snap != NULL && snap->es_root != NULL);
+		CHECK(snap->es_gen >= last);
+		last = snap->es_gen;
+		if ((r->r_reads & 63) == 0) {
+			CHECK(echo_snap_query(snap, "gen", &buf, &len) == 0);
+			nvl = nvlist_unpack(buf, len, 0);
+			CHECK(nvl != NULL);
+			CHECK(nvlist_get_number(nvl, "gen") == snap->es_gen);
+			nvlist_destroy(nvl);
+			free(buf);
+		}
+		echo_snap_release(snap);
+		r->r_reads++;
+	}
+	return NULL;
+}
+
+static void *
+writer(void *arg __unused)
+{
+	nvlist_t *nvl = NULL;
+	nvlist_t *sub = NULL;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		nvl = nvlist_create(0);
+		sub = nvlist_create(0);
+		nvlist_add_string(sub, "name", "reader_test");
+		nvlist_move_nvlist(nvl, "static", sub);
+		nvlist_add_number(nvl, "gen", echo_core_gen() + 1);
+		CHECK(echo_store_publish(&store, nvl) == 0);
+	}
+	return NULL;
+}
+
+static double
+run(int nreaders, double duration)
+{
+	struct reader readers[MAXREADERS];
+	pthread_t wthread;
+	uint64_t total = 0;
+	double start = 0, elapsed = 0;
+	int i = 0;
+
+	memset(readers, 0, sizeof(readers));
+	stop = 0;
+	CHECK(pthread_create(&wthread, NULL, writer, NULL) == 0);
+	start = test_now();
+	for (i = 0; i < nreaders; ++i) {
+		CHECK(pthread_create(&readers[i].r_thread, NULL, reader,
+		    &readers[i]) == 0);
+	}
+	usleep(duration * 1e6);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nreaders; ++i) {
+		pthread_join(readers[i].r_thread, NULL);
+		total += readers[i].r_reads;
+	}
+	elapsed = test_now() - start;
+	pthread_join(wthread, NULL);
+	return total / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nvlist_t *nvl = NULL;
+	int n = 0;
+
+	CHECK(echo_core_init(NULL) == 0);
+	echo_store_init(&store);
+	nvl = nvlist_create(0);
+	nvlist_add_number(nvl, "gen", echo_core_gen() + 1);
+	CHECK(echo_store_publish(&store, nvl) == 0);
+	if (ncpu > MAXREADERS) {
+		ncpu = MAXREADERS;
+	}
+	for (n = 1; n <= ncpu; n *= 2) {
+		printf("readers: %d reads/s: %.0f\n", n, run(n, duration));
+	}
+	echo_store_fini(&store);
+	echo_core_fini();
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * UCL configs converted the way program does it, checked against a schema
+ * compiled from program/jail.schema on the way.  The sample config and a
+ * fleet of jails convert the same with the schema as without it, and
+ * configs that break it are refused.  Then prints the time a conversion of
+ * the fleet takes without and with the schema, whose checks should only add
+ * a few percent.
+ */
+#include <sys/nv.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ucl.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "schema.h"
+#include "template.h"
+#include "test.h"
+#include "testnv.h"
+
+#define SCHEMA		"../program/jail.schema"
+#define SAMPLE		"../program/ucl.conf"
+#define JAILS		2000
+
+/* Configs each breaking jail.schema in one way. */
+static const char *bad_configs[] = {
+	"jail0 { bridge = bridge0 }",
+	"jail0 { path = /j\n devfs_rule = 1.5 }",
+	"jail0 { path = /j\n devfs_rule = ten }",
+	"jail0 { path = /j\n persist = 10s }",
+	"jail0 { path = /j\n bogus = 1 }",
+	"jail0 { path = /j\n path = /k }",
+	"jail0 { path = /j\n interface { mtu = 1500 } }",
+	"jail0 { path = /j\n rules = [1, two] }",
+	"jail0 = yes",
+};
+
+#define NBAD	(sizeof(bad_configs) / sizeof(bad_configs[0]))
+
+static ucl_object_t *
+parse(const char *text, const char *file)
+{
+	struct ucl_parser *parser = NULL;
+	ucl_object_t *top = NULL;
+
+	parser = ucl_parser_new(0);
+	CHECK(parser != NULL);
+	if (file != NULL) {
+		CHECK(ucl_parser_add_file(parser, file));
+	} else {
+		CHECK(ucl_parser_add_string(parser, text, strlen(text)));
+	}
+	top = ucl_parser_get_object(parser);
+	CHECK(top != NULL);
+	ucl_parser_free(parser);
+	return top;
+}
+
+/* What ucl2nv() in program does, against sch. */
+static nvlist_t *
+convert(const ucl_object_t *top, const struct schema *sch)
+{
+	const ucl_object_t *obj = NULL;
+	ucl_object_iter_t it = NULL;
+	nvlist_t *nvl = NULL;
+
+	nvl = nvlist_create(0);
+	while ((obj = ucl_iterate_object(top, &it, true)) != NULL) {
+		uclobj2nv(nvl, obj, NULL, sch);
+	}
+	schema_required(sch, top, "config");
+	tmpl_free();
+	CHECK(nvlist_error(nvl) == 0);
+	return nvl;
+}
+
+/* A fleet of JAILS jails shaped like the sample config. */
+static char *
+fleet(void)
+{
+	FILE *fp = NULL;
+	char *text = NULL;
+	size_t len = 0;
+	int j = 0;
+
+	fp = open_memstream(&text, &len);
+	CHECK(fp != NULL);
+	for (j = 0; j < JAILS; ++j) {
+		fprintf(fp, "jail%d {\n"
+		    "  bridge = bridge%d\n"
+		    "  path = /usr/local/jails/${name}\n"
+		    "  persist = true\n"
+		    "  devfs_rule = %d\n", j, j % 4, j % 10);
+		fprintf(fp, "  interface {\n"
+		    "    create = ifconfig epair create up\n"
+		    "    create = ifconfig ${bridge} addm ${interface}a\n"
+		    "    destroy = ifconfig ${interface}a destroy\n"
+		    "  }\n");
+		fprintf(fp, "  exec {\n"
+		    "    start = /bin/sh /etc/rc\n"
+		    "    stop = /bin/sh /etc/rc.shutdown jail\n"
+		    "  }\n"
+		    "  host {\n"
+		    "    domain = example.com\n"
+		    "    hostname = ${name}.${domain}\n"
+		    "  }\n"
+		    "  rules = [%d, %d, 3]\n"
+		    "  truth = [true, false]\n"
+		    "}\n", j, j + 1);
+	}
+	CHECK(fclose(fp) == 0);
+	return text;
+}
+
+/* Whether converting text against sch exits with the schema's error. */
+static bool
+refused(const char *text, const struct schema *sch)
+{
+	ucl_object_t *top = NULL;
+	pid_t pid = 0;
+	int status = 0, fd = -1;
+
+	top = parse(text, NULL);
+	fflush(stdout);
+	pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDERR_FILENO);
+		nvlist_destroy(convert(top, sch));
+		_exit(0);
+	}
+	CHECK(waitpid(pid, &status, 0) == pid);
+	ucl_object_unref(top);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+static void
+check_same(const ucl_object_t *top, const struct schema *sch)
+{
+	nvlist_t *plain = NULL, *checked = NULL;
+
+	plain = convert(top, NULL);
+	checked = convert(top, sch);
+	CHECK(test_nvlist_same(plain, checked));
+	nvlist_destroy(plain);
+	nvlist_destroy(checked);
+}
+
+/*
+ * Time conversions without and with sch in turns, so that both see the same
+ * noise, for about duration seconds each.
+ */
+static void
+bench(const ucl_object_t *top, const struct schema *sch, double duration,
+    double *plainp, double *checkedp)
+{
+	double start = 0, t = 0, plain = 0, checked = 0;
+	uint64_t n = 0;
+
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < 2 * duration; ++n) {
+		t = test_now();
+		nvlist_destroy(convert(top, NULL));
+		plain += test_now() - t;
+		t = test_now();
+		nvlist_destroy(convert(top, sch));
+		checked += test_now() - t;
+	}
+	*plainp = plain / n;
+	*checkedp = checked / n;
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	struct schema *sch = NULL;
+	ucl_object_t *top = NULL;
+	double plain = 0, checked = 0;
+	char *text = NULL;
+	size_t i = 0;
+
+	sch = schema_load(SCHEMA);
+	top = parse(NULL, SAMPLE);
+	check_same(top, sch);
+	ucl_object_unref(top);
+	text = fleet();
+	top = parse(text, NULL);
+	check_same(top, sch);
+	for (i = 0; i < NBAD; ++i) {
+		CHECK(refused(bad_configs[i], sch));
+	}
+	printf("schema: ok\n");
+
+	bench(top, sch, duration, &plain, &checked);
+	printf("jails: %d convert ms: %.2f with schema ms: %.2f overhead: %.1f%%\n",
+	    JAILS, plain * 1e3, checked * 1e3, (checked / plain - 1) * 100);
+	ucl_object_unref(top);
+	free(text);
+	schema_free(sch);
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * The shared memory snapshot over a POSIX shared memory object: readers in
+ * other threads and in another process only ever see whole publishes, in
+ * order, and the failure cases report what echo_shm.h says.  Then prints
+ * the reads per second and the bytes read per second for 1, 2, 4...
+ * readers up to the number of CPUs, against one writer publishing as fast
+ * as it can.
+ */
+#include "echo_compat.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+
+#include "echo_shm.h"
+#include "test.h"
+
+#define SHM_SIZE	4000
+#define MAXREADERS	64
+
+struct reader {
+	pthread_t	 r_thread;
+	uint64_t	 r_reads;
+	uint64_t	 r_bytes;
+};
+
+static char shm_name[64];
+static int stop;
+
+/* Publish gen as gen % SHM_SIZE bytes, all of them the low byte of gen. */
+static void
+publish(struct echo_shm_hdr *hdr, uint64_t gen)
+{
+	unsigned char buf[SHM_SIZE];
+	size_t len = gen % SHM_SIZE;
+
+	memset(buf, (unsigned char)gen, len);
+	CHECK(echo_shm_publish(hdr, buf, len, gen) == 0);
+}
+
+/* Read once, checking that what was read is one whole publish. */
+static int
+read_once(const struct echo_shm_hdr *hdr, uint64_t *genp, size_t *lenp)
+{
+	unsigned char buf[SHM_SIZE];
+	size_t len = sizeof(buf), i = 0;
+	uint64_t gen = 0;
+	int error = 0;
+
+	error = echo_shm_read(hdr, buf, &len, &gen);
+	if (error) {
+		return error;
+	}
+	CHECK(gen >= *genp);
+	CHECK(len == gen % SHM_SIZE);
+	for (i = 0; i < len; ++i) {
+		CHECK(buf[i] == (unsigned char)gen);
+	}
+	*genp = gen;
+	*lenp = len;
+	return 0;
+}
+
+static void *
+reader(void *arg)
+{
+	struct reader *r = arg;
+	struct echo_shm_hdr *hdr = NULL;
+	uint64_t gen = 0;
+	size_t len = 0;
+	int error = 0;
+
+	CHECK(echo_shm_map(shm_name, 0, false, &hdr) == 0);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		error = read_once(hdr, &gen, &len);
+		if (error == EBUSY) {
+			continue;
+		}
+		CHECK(error == 0);
+		r->r_reads++;
+		r->r_bytes += len;
+	}
+	echo_shm_unmap(hdr);
+	return NULL;
+}
+
+/* A reader in another process follows the publishes up to last. */
+static void
+test_process(struct echo_shm_hdr *hdr, uint64_t last)
+{
+	struct echo_shm_hdr *child = NULL;
+	uint64_t gen = 0, g = 0;
+	size_t len = 0;
+	pid_t pid = 0;
+	int status = 0;
+
+	pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		CHECK(echo_shm_map(shm_name, 0, false, &child) == 0);
+		while (gen < last) {
+			read_once(child, &gen, &len);
+		}
+		echo_shm_unmap(child);
+		_exit(0);
+	}
+	for (g = 2; g <= last; ++g) {
+		publish(hdr, g);
+	}
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void
+test_errors(struct echo_shm_hdr *hdr)
+{
+	unsigned char buf[SHM_SIZE + 1] = {0};
+	uint64_t gen = 0, seq = 0;
+	size_t len = 0;
+
+	CHECK(echo_shm_publish(hdr, buf, SHM_SIZE + 1, 1) == ENOSPC);
+	publish(hdr, 100);
+	len = 5;
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == ERANGE && len == 100);
+
+	/* Data changed behind the producer's back. */
+	ECHO_SHM_DATA(hdr)[0] ^= 1;
+	len = sizeof(buf);
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == EIO);
+
+	/* A producer that died mid-update, then one that takes over. */
+	hdr->esh_seq |= 1;
+	seq = hdr->esh_seq;
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == EBUSY);
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == EBUSY);
+	publish(hdr, 101);
+	CHECK(hdr->esh_seq == seq + 1);
+	len = sizeof(buf);
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == 0 && gen == 101);
+}
+
+static void *
+writer(void *arg)
+{
+	struct echo_shm_hdr *hdr = arg;
+	uint64_t gen = 1000;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		publish(hdr, gen++);
+	}
+	return NULL;
+}
+
+static void
+run(struct echo_shm_hdr *hdr, int nreaders, double duration)
+{
+	struct reader readers[MAXREADERS];
+	pthread_t wthread;
+	uint64_t reads = 0, bytes = 0;
+	double start = 0, elapsed = 0;
+	int i = 0;
+
+	memset(readers, 0, sizeof(readers));
+	stop = 0;
+	CHECK(pthread_create(&wthread, NULL, writer, hdr) == 0);
+	start = test_now();
+	for (i = 0; i < nreaders; ++i) {
+		CHECK(pthread_create(&readers[i].r_thread, NULL, reader,
+		    &readers[i]) == 0);
+	}
+	usleep(duration * 1e6);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nreaders; ++i) {
+		pthread_join(readers[i].r_thread, NULL);
+		reads += readers[i].r_reads;
+		bytes += readers[i].r_bytes;
+	}
+	elapsed = test_now() - start;
+	pthread_join(wthread, NULL);
+	printf("readers: %d reads/s: %.0f MB/s: %.1f\n", nreaders,
+	    reads / elapsed, bytes / elapsed / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct echo_shm_hdr *hdr = NULL;
+	unsigned char buf[16];
+	uint64_t gen = 0;
+	size_t len = sizeof(buf);
+	int n = 0;
+
+	snprintf(shm_name, sizeof(shm_name), "/echo_shm_test.%d", (int)getpid());
+	CHECK(echo_shm_map(shm_name, SHM_SIZE, true, &hdr) == 0);
+	CHECK(echo_shm_read(hdr, buf, &len, &gen) == 0 && len == 0 && gen == 0);
+	test_process(hdr, 20000);
+	test_errors(hdr);
+	printf("shm: ok\n");
+	if (ncpu > MAXREADERS) {
+		ncpu = MAXREADERS;
+	}
+	for (n = 1; n <= ncpu; n *= 2) {
+		run(hdr, n, duration);
+	}
+	echo_shm_unmap(hdr);
+	shm_unlink(shm_name);
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * ${var} templates expanded while converting UCL configs the way program
+ * does it.  The sample config expands against its enclosing blocks and
+ * keeps references to nothing verbatim, a fleet of templated jails converts
+ * the same as the fleet written out by hand, and the jails after the first
+ * expand with the templates it compiled without allocating.  Then prints
+ * the time a conversion of the fleet takes as written out and as templates,
+ * whose expansion should only cost a copy of each string.
+ */
+#include <sys/nv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ucl.h>
+
+#include "convert.h"
+#include "template.h"
+#include "test.h"
+#include "testnv.h"
+#include "acct.h"
+
+#define SAMPLE		"../program/ucl.conf"
+#define JAILS		5000
+
+static ucl_object_t *
+parse(const char *text, const char *file)
+{
+	struct ucl_parser *parser = NULL;
+	ucl_object_t *top = NULL;
+
+	parser = ucl_parser_new(0);
+	CHECK(parser != NULL);
+	if (file != NULL) {
+		CHECK(ucl_parser_add_file(parser, file));
+	} else {
+		CHECK(ucl_parser_add_string(parser, text, strlen(text)));
+	}
+	top = ucl_parser_get_object(parser);
+	CHECK(top != NULL);
+	ucl_parser_free(parser);
+	return top;
+}
+
+/* What ucl2nv() in program does, without a schema. */
+static nvlist_t *
+convert(const ucl_object_t *top)
+{
+	const ucl_object_t *obj = NULL;
+	ucl_object_iter_t it = NULL;
+	nvlist_t *nvl = NULL;
+
+	nvl = nvlist_create(0);
+	while ((obj = ucl_iterate_object(top, &it, true)) != NULL) {
+		uclobj2nv(nvl, obj, NULL, NULL);
+	}
+	tmpl_free();
+	CHECK(nvlist_error(nvl) == 0);
+	return nvl;
+}
+
+/*
+ * A fleet of JAILS jails shaped like the sample config, with templates or
+ * with what they expand to written out.
+ */
+static char *
+fleet(bool templated)
+{
+	FILE *fp = NULL;
+	char *text = NULL;
+	size_t len = 0;
+	int j = 0;
+
+	fp = open_memstream(&text, &len);
+	CHECK(fp != NULL);
+	for (j = 0; j < JAILS; ++j) {
+		fprintf(fp, "jail%d {\n"
+		    "  bridge = bridge%d\n", j, j % 4);
+		if (templated) {
+			fprintf(fp, "  path = /usr/local/jails/${name}\n");
+		} else {
+			fprintf(fp, "  path = /usr/local/jails/jail%d\n", j);
+		}
+		fprintf(fp, "  interface {\n"
+		    "    create = ifconfig epair create up\n");
+		if (templated) {
+			fprintf(fp, "    create = ifconfig ${bridge} addm "
+			    "${interface}a\n");
+		} else {
+			fprintf(fp, "    create = ifconfig bridge%d addm "
+			    "${interface}a\n", j % 4);
+		}
+		fprintf(fp, "    destroy = ifconfig ${interface}a destroy\n"
+		    "  }\n"
+		    "  host {\n"
+		    "    domain = example.com\n");
+		if (templated) {
+			fprintf(fp, "    hostname = ${name}.${domain}\n");
+		} else {
+			fprintf(fp, "    hostname = jail%d.example.com\n", j);
+		}
+		fprintf(fp, "  }\n"
+		    "}\n");
+	}
+	CHECK(fclose(fp) == 0);
+	return text;
+}
+
+static void
+check_string(const nvlist_t *nvl, const char *name, const char *value)
+{
+	CHECK(nvlist_exists_string(nvl, name));
+	CHECK(strcmp(nvlist_get_string(nvl, name), value) == 0);
+}
+
+static void
+test_sample(void)
+{
+	const nvlist_t *jail = NULL;
+	const nvlist_t * const *ifaces = NULL;
+	const char * const *create = NULL;
+	ucl_object_t *top = NULL;
+	nvlist_t *nvl = NULL;
+	size_t n = 0, m = 0, i = 0;
+
+	top = parse(NULL, SAMPLE);
+	nvl = convert(top);
+	jail = nvlist_get_nvlist(nvl, "jail0");
+	check_string(jail, "path", "/usr/local/jails/jail0");
+	check_string(nvlist_get_nvlist(jail, "host"), "hostname",
+	    "jail0.example.com");
+	ifaces = nvlist_get_nvlist_array(jail, "interface", &n);
+	CHECK(n == 2);
+	for (i = 0; i < n; ++i) {
+		create = nvlist_get_string_array(ifaces[i], "create", &m);
+		CHECK(m == 2);
+		CHECK(strcmp(create[1], "ifconfig bridge0 addm ${interface}a") == 0);
+		check_string(ifaces[i], "destroy", "ifconfig ${interface}a destroy");
+	}
+	nvlist_destroy(nvl);
+	ucl_object_unref(top);
+}
+
+/*
+ * Expand the templates of every jail in top, the first jail in stage first
+ * and the others in stage rest.  The others share the first one's templates
+ * and its output buffer is already large enough, so they allocate nothing.
+ */
+static void
+test_reuse(const ucl_object_t *top)
+{
+	static const char *templates[] = {
+		"/usr/local/jails/${name}",
+		"ifconfig ${bridge} addm ${interface}a",
+		"${name}.${bridge}",
+	};
+	const ucl_object_t *jail = NULL;
+	ucl_object_iter_t it = NULL;
+	struct tmpl_scope scope = {0};
+	uint64_t allocs = 0;
+	size_t live = 0, peak = 0, i = 0;
+	char path[64];
+
+	acct_stage("first");
+	while ((jail = ucl_iterate_object(top, &it, true)) != NULL) {
+		scope.ts_obj = jail;
+		scope.ts_name = ucl_object_key(jail);
+		for (i = 0; i < sizeof(templates) / sizeof(templates[0]); ++i) {
+			tmpl_expand(templates[i], &scope);
+		}
+		snprintf(path, sizeof(path), "/usr/local/jails/%s",
+		    scope.ts_name);
+		CHECK(strcmp(tmpl_expand(templates[0], &scope), path) == 0);
+		acct_stage("rest");
+	}
+	acct_stage("test");
+	CHECK(acct_stage_count("first", &allocs, &live, &peak));
+	CHECK(allocs > 0);
+	CHECK(acct_stage_count("rest", &allocs, &live, &peak));
+	CHECK(allocs == 0);
+	tmpl_free();
+}
+
+/*
+ * Time conversions of plain and of templated in turns, so that both see
+ * the same noise, for about duration seconds each.
+ */
+static void
+bench(const ucl_object_t *plain, const ucl_object_t *templated,
+    double duration, double *plainp, double *templatedp)
+{
+	double start = 0, t = 0, p = 0, e = 0;
+	uint64_t n = 0;
+
+	start = test_now();
+	for (n = 0; n == 0 || test_now() - start < 2 * duration; ++n) {
+		t = test_now();
+		nvlist_destroy(convert(plain));
+		p += test_now() - t;
+		t = test_now();
+		nvlist_destroy(convert(templated));
+		e += test_now() - t;
+	}
+	*plainp = p / n;
+	*templatedp = e / n;
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = test_duration(argc, argv, 2.0);
+	ucl_object_t *plain = NULL, *templated = NULL;
+	nvlist_t *a = NULL, *b = NULL;
+	double p = 0, e = 0;
+	char *ptext = NULL, *ttext = NULL;
+
+	acct_enable();
+	test_sample();
+	ptext = fleet(false);
+	ttext = fleet(true);
+	plain = parse(ptext, NULL);
+	templated = parse(ttext, NULL);
+	a = convert(plain);
+	b = convert(templated);
+	CHECK(test_nvlist_same(a, b));
+	nvlist_destroy(a);
+	nvlist_destroy(b);
+	test_reuse(templated);
+	printf("template: ok\n");
+
+	bench(plain, templated, duration, &p, &e);
+	printf("jails: %d plain ms: %.2f templated ms: %.2f overhead: %.1f%%\n",
+	    JAILS, p * 1e3, e * 1e3, (e / p - 1) * 100);
+	ucl_object_unref(plain);
+	ucl_object_unref(templated);
+	free(ptext);
+	free(ttext);
+	return 0;
+}
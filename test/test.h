@@ -0,0 +1,39 @@
+/*
+ * Helpers shared by the userland tests and benchmarks.
+ */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Fail the program, saying where, unless cond holds. */
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,	\
+		    __LINE__, #cond);					\
+		exit(1);						\
+	}								\
+} while (0)
+
+static inline double
+test_now(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * How long each timed section of a benchmark runs, in seconds: the first
+ * argument if one is given, so that make test can run them briefly.
+ */
+static inline double
+test_duration(int argc, char **argv, double dflt)
+{
+	return argc > 1 ? atof(argv[1]) : dflt;
+}
+
+#endif /* !_TEST_H_ */
@@ -0,0 +1,96 @@
+/*
+ * Random configs for the tests that work on nvlists.
+ */
+#ifndef _TESTNV_H_
+#define _TESTNV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Key names, escapes included, so that they also make awkward paths. */
+static const char *test_keys[] = {"a", "b", "c.d", "e[1]", "f\\g", "h"};
+
+#define TEST_NKEYS	(sizeof(test_keys) / sizeof(test_keys[0]))
+
+/*
+ * A random nvlist of up to four pairs, with nested nvlists and nvlist
+ * arrays down to depth 3.
+ */
+static inline nvlist_t *
+test_nvlist(unsigned *seed, int depth)
+{
+	nvlist_t *nvl = NULL;
+	nvlist_t *elems[3];
+	const char *strs[4];
+	uint64_t nums[4];
+	const char *key = NULL;
+	int pairs = 0, i = 0, j = 0, count = 0;
+
+	nvl = nvlist_create(0);
+	pairs = rand_r(seed) % 5;
+	for (i = 0; i < pairs; ++i) {
+		key = test_keys[rand_r(seed) % TEST_NKEYS];
+		if (nvlist_exists(nvl, key)) {
+			continue;
+		}
+		count = 1 + rand_r(seed) % 3;
+		switch (rand_r(seed) % (depth > 2 ? 5 : 7)) {
+			case 0:
+				nvlist_add_number(nvl, key, rand_r(seed) % 3);
+				break;
+			case 1:
+				nvlist_add_string(nvl, key, rand_r(seed) % 2 ? "x" : "y");
+				break;
+			case 2:
+				nvlist_add_bool(nvl, key, rand_r(seed) % 2);
+				break;
+			case 3:
+				for (j = 0; j < count; ++j) {
+					nums[j] = rand_r(seed) % 3;
+				}
+				nvlist_add_number_array(nvl, key, nums, count);
+				break;
+			case 4:
+				for (j = 0; j < count; ++j) {
+					strs[j] = rand_r(seed) % 2 ? "p" : "q";
+				}
+				nvlist_add_string_array(nvl, key, strs, count);
+				break;
+			case 5:
+				nvlist_move_nvlist(nvl, key, test_nvlist(seed, depth + 1));
+				break;
+			case 6:
+				for (j = 0; j < count; ++j) {
+					elems[j] = test_nvlist(seed, depth + 1);
+				}
+				nvlist_add_nvlist_array(nvl, key,
+				    (const nvlist_t * const *)elems, count);
+				for (j = 0; j < count; ++j) {
+					nvlist_destroy(elems[j]);
+				}
+				break;
+		}
+	}
+	return nvl;
+}
+
+/* Whether a and b hold the same pairs in the same order. */
+static inline bool
+test_nvlist_same(const nvlist_t *a, const nvlist_t *b)
+{
+	void *abuf = NULL, *bbuf = NULL;
+	size_t alen = 0, blen = 0;
+	bool same = false;
+
+	abuf = nvlist_pack(a, &alen);
+	bbuf = nvlist_pack(b, &blen);
+	same = abuf != NULL && bbuf != NULL && alen == blen &&
+	    memcmp(abuf, bbuf, alen) == 0;
+	free(abuf);
+	free(bbuf);
+	return same;
+}
+
+#endif /* !_TESTNV_H_ */
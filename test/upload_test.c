@@ -0,0 +1,344 @@
+/*
+ * Chunked uploads: the structural check of compact blobs agrees with the
+ * decoder however the blob is cut, sessions stage only the pages sent so
+ * far within the budget, compact blobs commit straight from them, and bad
+ * chunks and namespaces are refused where they arrive.
+ */
+#include "echo_compat.h"
+
+#include "echo.h"
+#include "echo_compact.h"
+#include "echo_upload.h"
+#include "echo_history.h"
+#include "echo_core.h"
+#include "test.h"
+#include "testnv.h"
+
+#define ROUNDS		20000
+
+/* Check buf in pieces of random size, as the chunks of an upload would be. */
+static int
+check_pieces(const uint8_t *buf, size_t len, unsigned *seed)
+{
+	struct echo_compact_check cc;
+	size_t off = 0, piece = 0;
+	int error = 0;
+
+	echo_compact_check_init(&cc, len);
+	for (off = 0; error == 0 && off < len; off += piece) {
+		piece = 1 + rand_r(seed) % 16;
+		if (piece > len - off) {
+			piece = len - off;
+		}
+		error = echo_compact_check(&cc, buf + off, piece);
+	}
+	if (error == 0 && !echo_compact_check_done(&cc)) {
+		error = EINVAL;
+	}
+	return error;
+}
+
+/*
+ * Every blob the decoder takes passes the check and every blob the check
+ * refuses the decoder refuses too, for blobs damaged at random as well.
+ * Only names repeated in a nvlist are left to the decoder.
+ */
+static void
+test_check(unsigned *seed)
+{
+	nvlist_t *nvl = NULL, *out = NULL;
+	uint8_t *buf = NULL;
+	size_t len = 0, cut = 0;
+	int i = 0, error = 0, decoded = 0;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		nvl = test_nvlist(seed, 0);
+		CHECK(echo_compact_encode(nvl, (void **)&buf, &len) == 0);
+		CHECK(check_pieces(buf, len, seed) == 0);
+		cut = len;
+		switch (rand_r(seed) % 3) {
+			case 0:
+				buf[rand_r(seed) % len] ^= 1 << rand_r(seed) % 8;
+				break;
+			case 1:
+				buf[rand_r(seed) % len] = rand_r(seed);
+				break;
+			case 2:
+				cut = rand_r(seed) % len;
+				break;
+		}
+		error = check_pieces(buf, cut, seed);
+		decoded = echo_compact_decode(buf, cut, &out);
+		if (decoded == 0) {
+			CHECK(error == 0);
+			nvlist_destroy(out);
+		}
+		CHECK(error == 0 || decoded != 0);
+		echo_free(buf);
+		nvlist_destroy(nvl);
+	}
+}
+
+static int
+upload(struct echo_upload *up, struct echo_store *st, int op,
+    const void *buf, size_t off, size_t len)
+{
+	nvecho_upload_t udata;
+
+	memset(&udata, 0, sizeof(udata));
+	udata.op = op;
+	udata.off = off;
+	udata.buf = (const char *)buf + off;
+	udata.len = len;
+	udata.size = len;
+	udata.hash = echo_hash(ECHO_HASH_INIT, buf, len);
+	return echo_upload_ioctl(up, st, NULL, &udata);
+}
+
+/* Send all of buf in chunks of at most chunk bytes and commit it. */
+static int
+upload_all(struct echo_upload *up, struct echo_store *st, const void *buf,
+    size_t len, size_t chunk)
+{
+	size_t off = 0, n = 0;
+	int error = 0;
+
+	CHECK(upload(up, st, ECHO_UPLOAD_BEGIN, buf, 0, len) == 0);
+	for (off = 0; off < len; off += n) {
+		n = len - off < chunk ? len - off : chunk;
+		error = upload(up, st, ECHO_UPLOAD_CHUNK, buf, off, n);
+		if (error) {
+			upload(up, st, ECHO_UPLOAD_ABORT, NULL, 0, 0);
+			return error;
+		}
+	}
+	return upload(up, st, ECHO_UPLOAD_COMMIT, buf, 0, len);
+}
+
+/*
+ * A config of about size bytes, most of it in strings that occur once and
+ * so are inline in a compact blob.
+ */
+static nvlist_t *
+big_nvlist(size_t size)
+{
+	nvlist_t *nvl = NULL;
+	char name[32], value[101];
+	size_t i = 0;
+	int n = 0;
+
+	memset(value, 'v', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	nvl = nvlist_create(0);
+	for (i = 0; i < size / 120; ++i) {
+		n = snprintf(name, sizeof(name), "key%zu", i);
+		memcpy(value, name, n);
+		nvlist_add_string(nvl, name, value);
+	}
+	return nvl;
+}
+
+static void
+check_stored(struct echo_store *st, const nvlist_t *nvl)
+{
+	struct echo_snap *snap = NULL;
+	nvlist_t *stored = NULL;
+
+	snap = echo_store_acquire(st);
+	stored = echo_vtree_export(snap->es_root);
+	CHECK(test_nvlist_same(stored, nvl));
+	nvlist_destroy(stored);
+	echo_snap_release(snap);
+}
+
+/* Both formats over several pages, in chunks that straddle pages. */
+static void
+test_session(struct echo_upload *up, struct echo_store *st)
+{
+	nvlist_t *nvl = NULL;
+	void *packed = NULL, *compact = NULL;
+	size_t plen = 0, clen = 0;
+
+	nvl = big_nvlist(5 * ECHO_CHUNKMAX / 2);
+	packed = nvlist_pack(nvl, &plen);
+	CHECK(packed != NULL && plen > 2 * ECHO_CHUNKMAX);
+	CHECK(echo_compact_encode(nvl, &compact, &clen) == 0);
+	CHECK(clen > ECHO_CHUNKMAX);
+
+	CHECK(upload_all(up, st, packed, plen, ECHO_CHUNKMAX) == 0);
+	check_stored(st, nvl);
+	CHECK(upload_all(up, st, packed, plen, 1000) == 0);
+	check_stored(st, nvl);
+	CHECK(upload_all(up, st, compact, clen, ECHO_CHUNKMAX - 7) == 0);
+	check_stored(st, nvl);
+	CHECK(upload_all(up, st, compact, 100, 100) == EINVAL);
+	CHECK(upload_all(up, st, packed, 100, 100) == EINVAL);
+
+	free(packed);
+	echo_free(compact);
+	nvlist_destroy(nvl);
+}
+
+/*
+ * A session only holds the pages it was sent, so a blob larger than the
+ * budget can begin but not fill, and an abort gives the pages back.
+ */
+static void
+test_budget(struct echo_upload *up, struct echo_store *st)
+{
+	struct echo_upload other;
+	u_long budget = echo_upload_budget;
+	static uint8_t buf[4 * ECHO_CHUNKMAX];
+	nvecho_upload_t udata;
+
+	memset(&udata, 0, sizeof(udata));
+	echo_upload_init(&other);
+	echo_upload_budget = 2 * ECHO_CHUNKMAX;
+	/* One dictionary entry, long enough to fill all chunks sent. */
+	memset(buf, 'x', sizeof(buf));
+	buf[0] = ECHO_COMPACT_MAGIC;
+	buf[1] = ECHO_COMPACT_VERSION;
+	buf[2] = 1;
+	buf[3] = 0x80;
+	buf[4] = 0x80;
+	buf[5] = 3 * ECHO_CHUNKMAX / 0x4000;
+
+	udata.op = ECHO_UPLOAD_BEGIN;
+	udata.size = sizeof(buf);
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+	CHECK(echo_upload_ioctl(&other, st, NULL, &udata) == 0);
+	udata.op = ECHO_UPLOAD_CHUNK;
+	udata.buf = buf;
+	udata.len = ECHO_CHUNKMAX;
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+	CHECK(echo_upload_ioctl(&other, st, NULL, &udata) == 0);
+	udata.off = ECHO_CHUNKMAX;
+	udata.buf = buf + ECHO_CHUNKMAX;
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == ENOMEM);
+	CHECK(up->eu_off == ECHO_CHUNKMAX && up->eu_npages == 1);
+	udata.op = ECHO_UPLOAD_ABORT;
+	CHECK(echo_upload_ioctl(&other, st, NULL, &udata) == 0);
+	udata.op = ECHO_UPLOAD_CHUNK;
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+	CHECK(up->eu_npages == 2);
+	udata.op = ECHO_UPLOAD_ABORT;
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+
+	echo_upload_budget = budget;
+	echo_upload_fini(&other);
+}
+
+/*
+ * A chunk that breaks the structure is refused where it arrives, and the
+ * session stays open for the right chunk.
+ */
+static void
+test_bad_chunk(struct echo_upload *up, struct echo_store *st)
+{
+	nvlist_t *nvl = NULL;
+	uint8_t *good = NULL, *bad = NULL;
+	size_t len = 0, off = 0;
+
+	nvl = big_nvlist(3 * ECHO_CHUNKMAX);
+	CHECK(echo_compact_encode(nvl, (void **)&good, &len) == 0);
+	bad = malloc(len);
+	memcpy(bad, good, len);
+	bad[1] = ECHO_COMPACT_VERSION + 1;
+	/* A string in the second page holds a NUL. */
+	off = ECHO_CHUNKMAX + 10;
+	while (bad[off] != 'v') {
+		off++;
+	}
+	CHECK(off < 2 * ECHO_CHUNKMAX);
+	bad[off] = '\0';
+
+	CHECK(upload(up, st, ECHO_UPLOAD_BEGIN, good, 0, len) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, bad, 0, 16) == EPROTONOSUPPORT);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, good, 0, ECHO_CHUNKMAX) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, bad, ECHO_CHUNKMAX,
+	    ECHO_CHUNKMAX) == EINVAL);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, good, ECHO_CHUNKMAX,
+	    ECHO_CHUNKMAX) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, good, 2 * ECHO_CHUNKMAX,
+	    len - 2 * ECHO_CHUNKMAX) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_COMMIT, good, 0, len) == 0);
+	check_stored(st, nvl);
+
+	/* The chunks were sent but are not the blob that was announced. */
+	CHECK(upload(up, st, ECHO_UPLOAD_BEGIN, bad, 0, len) == 0);
+	for (off = 0; off < len; off += ECHO_CHUNKMAX) {
+		CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, good, off,
+		    len - off < ECHO_CHUNKMAX ? len - off : ECHO_CHUNKMAX) == 0);
+	}
+	CHECK(upload(up, st, ECHO_UPLOAD_COMMIT, bad, 0, len) == EBADMSG);
+	CHECK(upload(up, st, ECHO_UPLOAD_COMMIT, bad, 0, len) == ENOENT);
+
+	free(bad);
+	echo_free(good);
+	nvlist_destroy(nvl);
+}
+
+/* A packed nvlist whose header is wrong fails at its first chunk. */
+static void
+test_bad_header(struct echo_upload *up, struct echo_store *st)
+{
+	nvlist_t *nvl = NULL;
+	uint8_t *buf = NULL;
+	size_t len = 0;
+
+	nvl = big_nvlist(1000);
+	buf = nvlist_pack(nvl, &len);
+	CHECK(buf != NULL);
+	CHECK(upload(up, st, ECHO_UPLOAD_BEGIN, buf, 0, len) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, buf, 0, 10) == 0);
+	buf[12]++;
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, buf, 10, 10) == EINVAL);
+	buf[12]--;
+	CHECK(upload(up, st, ECHO_UPLOAD_CHUNK, buf, 10, len - 10) == 0);
+	CHECK(upload(up, st, ECHO_UPLOAD_COMMIT, buf, 0, len) == 0);
+	check_stored(st, nvl);
+	free(buf);
+	nvlist_destroy(nvl);
+}
+
+/* A namespace the table would refuse fails at begin, not at commit. */
+static void
+test_bad_ns(struct echo_upload *up, struct echo_store *st)
+{
+	nvecho_upload_t udata;
+
+	memset(&udata, 0, sizeof(udata));
+	udata.op = ECHO_UPLOAD_BEGIN;
+	udata.size = 100;
+	snprintf(udata.ns, sizeof(udata.ns), "no/slash");
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == EINVAL);
+	memset(udata.ns, 'x', sizeof(udata.ns));
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == EINVAL);
+	snprintf(udata.ns, sizeof(udata.ns), "ns-0");
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+	udata.op = ECHO_UPLOAD_ABORT;
+	CHECK(echo_upload_ioctl(up, st, NULL, &udata) == 0);
+}
+
+int
+main(void)
+{
+	struct echo_upload up;
+	struct echo_store store;
+	unsigned seed = 1;
+
+	CHECK(echo_core_init(NULL) == 0);
+	echo_store_init(&store);
+	echo_upload_init(&up);
+	test_check(&seed);
+	test_session(&up, &store);
+	test_budget(&up, &store);
+	test_bad_chunk(&up, &store);
+	test_bad_header(&up, &store);
+	test_bad_ns(&up, &store);
+	echo_upload_fini(&up);
+	echo_store_fini(&store);
+	echo_core_fini();
+	printf("upload: ok\n");
+	return 0;
+}